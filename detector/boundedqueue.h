@@ -0,0 +1,111 @@
+/*
+ * boundedqueue.h: Lock free queue of a fixed size for several producer and
+ *                 consumer threads.
+ *
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * This code is distributed under the terms and conditions of the
+ * GNU GENERAL PUBLIC LICENSE. See the file COPYING for details.
+ */
+
+#ifndef BOUNDEDQUEUE_H_
+#define BOUNDEDQUEUE_H_
+
+#include <stddef.h>
+#include <atomic>
+#include <utility>
+
+// Each cell carries a sequence number, which tells whether the cell is free
+// for the producer or filled for the consumer of a position. A thread claims
+// a position by advancing the head or tail, so the threads never wait for
+// each other. Push and Pop return false if the queue is full or empty.
+template <class T>
+class cBoundedQueue {
+public:
+    // The size is rounded up to a power of two
+    cBoundedQueue(size_t size) {
+        size_t cells = 2;
+        while (cells < size) {
+            cells *= 2;
+        }
+        mMask = cells - 1;
+        mCells = new CELL[cells];
+        for (size_t i = 0; i < cells; i++) {
+            mCells[i].seq.store(i, std::memory_order_relaxed);
+        }
+        mHead.store(0, std::memory_order_relaxed);
+        mTail.store(0, std::memory_order_relaxed);
+    }
+    ~cBoundedQueue() {
+        delete[] mCells;
+    }
+
+    bool Push(const T &value) {
+        CELL *cell;
+        size_t pos = mHead.load(std::memory_order_relaxed);
+        for (;;) {
+            cell = &mCells[pos & mMask];
+            size_t seq = cell->seq.load(std::memory_order_acquire);
+            long diff = (long)seq - (long)pos;
+            if (diff == 0) {
+                if (mHead.compare_exchange_weak(pos, pos + 1,
+                                                std::memory_order_relaxed)) {
+                    break;
+                }
+            }
+            else if (diff < 0) {
+                return false; // Full
+            }
+            else {
+                pos = mHead.load(std::memory_order_relaxed);
+            }
+        }
+        cell->value = value;
+        cell->seq.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool Pop(T &value) {
+        CELL *cell;
+        size_t pos = mTail.load(std::memory_order_relaxed);
+        for (;;) {
+            cell = &mCells[pos & mMask];
+            size_t seq = cell->seq.load(std::memory_order_acquire);
+            long diff = (long)seq - (long)(pos + 1);
+            if (diff == 0) {
+                if (mTail.compare_exchange_weak(pos, pos + 1,
+                                                std::memory_order_relaxed)) {
+                    break;
+                }
+            }
+            else if (diff < 0) {
+                return false; // Empty
+            }
+            else {
+                pos = mTail.load(std::memory_order_relaxed);
+            }
+        }
+        value = std::move(cell->value);
+        cell->seq.store(pos + mMask + 1, std::memory_order_release);
+        return true;
+    }
+
+private:
+    typedef struct {
+        std::atomic<size_t> seq;
+        T value;
+    } CELL;
+
+    CELL *mCells;
+    size_t mMask;
+    // Producers and consumers on different cache lines
+    char mPadHead[64];
+    std::atomic<size_t> mHead;
+    char mPadTail[64];
+    std::atomic<size_t> mTail;
+
+    cBoundedQueue(const cBoundedQueue &);
+    cBoundedQueue &operator=(const cBoundedQueue &);
+};
+
+#endif /* BOUNDEDQUEUE_H_ */
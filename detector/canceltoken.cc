@@ -0,0 +1,121 @@
+/*
+ * canceltoken.cc: Cancellation of a running detection and deadlines for
+ *                 the stages of a detection.
+ *
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * This code is distributed under the terms and conditions of the
+ * GNU GENERAL PUBLIC LICENSE. See the file COPYING for details.
+ */
+
+#include <stddef.h>
+#include <chrono>
+#include <thread>
+#include "canceltoken.h"
+#include "devicebackend.h"
+
+using namespace std;
+
+const int cCancelToken::POLL_INTERVAL;
+thread_local cCancelStage *cCancelStage::mCurrent = NULL;
+
+cCancelToken::cCancelToken(const TIMEOUTS &timeouts)
+{
+    mCancelled = false;
+    mExpired = false;
+    mTimeouts = timeouts;
+}
+
+void cCancelToken::Cancel(void)
+{
+    lock_guard<mutex> lock(mMutex);
+    mCancelled = true;
+    mCancel.notify_all();
+}
+
+bool cCancelToken::Sleep(int ms)
+{
+    unique_lock<mutex> lock(mMutex);
+    return !mCancel.wait_for(lock, chrono::milliseconds(ms),
+                             [this] { return (bool)mCancelled; });
+}
+
+cCancelStage::cCancelStage(cCancelToken *token)
+{
+    mToken = token;
+    mDeadline = 0;
+    Enter();
+}
+
+cCancelStage::cCancelStage(cCancelToken *token, cCancelToken::STAGE stage)
+{
+    mToken = token;
+    mDeadline = 0;
+    if ((token != NULL) && (token->GetTimeout(stage) > 0)) {
+        mDeadline = cDeviceBackend::Now() + token->GetTimeout(stage);
+    }
+    Enter();
+}
+
+// The deadline of an outer stage limits the inner stage as well
+void cCancelStage::Enter(void)
+{
+    mOuter = mCurrent;
+    if (mOuter != NULL) {
+        if (mToken == NULL) {
+            mToken = mOuter->mToken;
+        }
+        if ((mOuter->mDeadline != 0) &&
+            ((mDeadline == 0) || (mOuter->mDeadline < mDeadline))) {
+            mDeadline = mOuter->mDeadline;
+        }
+    }
+    mCurrent = this;
+}
+
+cCancelStage::~cCancelStage()
+{
+    mCurrent = mOuter;
+}
+
+bool cCancelStage::IsExpired(void) const
+{
+    if ((mDeadline == 0) || (cDeviceBackend::Now() < mDeadline)) {
+        return false;
+    }
+    if (mToken != NULL) {
+        mToken->Expire();
+    }
+    return true;
+}
+
+bool cCancelStage::IsCancelled(void) const
+{
+    return ((mToken != NULL) && mToken->IsCancelled()) || IsExpired();
+}
+
+int cCancelStage::Remaining(void) const
+{
+    if (mDeadline == 0) {
+        return -1;
+    }
+    long long remaining = mDeadline - cDeviceBackend::Now();
+    return (remaining > 0) ? (int)remaining : 0;
+}
+
+bool cCancelStage::Sleep(int ms)
+{
+    int remaining = Remaining();
+    if ((remaining >= 0) && (remaining < ms)) {
+        ms = remaining;
+    }
+    if (mToken != NULL) {
+        if (!mToken->Sleep(ms)) {
+            return false;
+        }
+    }
+    else {
+        this_thread::sleep_for(chrono::milliseconds(ms));
+    }
+    return !IsCancelled();
+}
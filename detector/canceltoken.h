@@ -0,0 +1,95 @@
+/*
+ * canceltoken.h: Cancellation of a running detection and deadlines for
+ *                the stages of a detection.
+ *
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * This code is distributed under the terms and conditions of the
+ * GNU GENERAL PUBLIC LICENSE. See the file COPYING for details.
+ */
+
+#ifndef CANCELTOKEN_H_
+#define CANCELTOKEN_H_
+
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+
+// Each detection has a token, which is cancelled when the device is removed
+// or the detector stops. The code of a detection checks the token between
+// its steps, and its waits end early when the token is cancelled.
+class cCancelToken {
+public:
+    typedef enum {
+        STAGE_PROPERTIES,   // A query of the device properties
+        STAGE_MOUNT,        // Mount of the media
+        STAGE_SCAN,         // Scan of the files of the media
+        STAGE_PROBE,        // Probe of an optical disc
+        STAGE_COUNT
+    } STAGE;
+    // Time limit of each stage in ms, 0 for no limit
+    typedef struct {
+        int stage[STAGE_COUNT];
+    } TIMEOUTS;
+
+    // Time between two checks of a token by a waiting thread
+    static const int POLL_INTERVAL = 20;
+
+    cCancelToken(const TIMEOUTS &timeouts);
+    // May be called from any thread
+    void Cancel(void);
+    bool IsCancelled(void) const { return mCancelled; }
+    // A stage of the detection ran out of time, so the detection may have
+    // missed the media
+    void Expire(void) { mExpired = true; }
+    bool HasExpired(void) const { return mExpired; }
+    int GetTimeout(STAGE stage) const { return mTimeouts.stage[stage]; }
+    // Wait ms milliseconds, false if the token is cancelled before
+    bool Sleep(int ms);
+
+private:
+    std::atomic<bool> mCancelled;
+    std::atomic<bool> mExpired;
+    TIMEOUTS mTimeouts;
+    std::mutex mMutex;
+    std::condition_variable mCancel;
+
+    cCancelToken(const cCancelToken &);
+    cCancelToken &operator=(const cCancelToken &);
+};
+
+// A stage of a detection running in this thread. The deadline starts with
+// the construction, stages may be nested. Code without access to the token,
+// e.g. the backends, finds the innermost stage of the thread by Current.
+class cCancelStage {
+public:
+    // A stage without a deadline, e.g. a whole detection
+    cCancelStage(cCancelToken *token);
+    cCancelStage(cCancelToken *token, cCancelToken::STAGE stage);
+    ~cCancelStage();
+
+    // The token is cancelled or the deadline of this or an outer stage
+    // has passed
+    bool IsCancelled(void) const;
+    bool IsExpired(void) const;
+    // Remaining ms until the deadline, -1 without deadline
+    int Remaining(void) const;
+    // Wait ms milliseconds, false if the stage is cancelled before
+    bool Sleep(int ms);
+    cCancelToken *GetToken(void) const { return mToken; }
+    static cCancelStage *Current(void) { return mCurrent; }
+
+private:
+    cCancelToken *mToken;
+    // Monotonic time in ms, 0 without deadline
+    long long mDeadline;
+    cCancelStage *mOuter;
+    static thread_local cCancelStage *mCurrent;
+
+    void Enter(void);
+
+    cCancelStage(const cCancelStage &);
+    cCancelStage &operator=(const cCancelStage &);
+};
+
+#endif /* CANCELTOKEN_H_ */
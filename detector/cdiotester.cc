@@ -8,23 +8,58 @@
  * GNU GENERAL PUBLIC LICENSE. See the file COPYING for details.
  */
 #include "cdiotester.h"
+#include <stdio.h>
 #include <cdio/cdio.h>
 
-bool cCdioTester::isMedia (cMediaHandle d, stringList &keylist)
+// Start of all tracks and of the lead out, empty without a TOC
+static std::string TocIdentity (CdIo_t *cdio)
+{
+    track_t first;
+    track_t count;
+    char buf[16];
+    std::string id;
+
+    first = cdio_get_first_track_num(cdio);
+    count = cdio_get_num_tracks(cdio);
+    if ((first == CDIO_INVALID_TRACK) || (count == CDIO_INVALID_TRACK)) {
+        return id;
+    }
+    id = "CD";
+    for (track_t tr = first; tr < first + count; tr++) {
+        snprintf(buf, sizeof(buf), ":%d", (int)cdio_get_track_lsn(cdio, tr));
+        id += buf;
+    }
+    snprintf(buf, sizeof(buf), ":%d",
+             (int)cdio_get_track_lsn(cdio, CDIO_CDROM_LEADOUT_TRACK));
+    id += buf;
+    return id;
+}
+
+bool cCdioTester::isMedia (const cMediaHandle &d, stringList &keylist)
+{
+    std::string identity;
+    return probeMedia(d, keylist, identity);
+}
+
+// The TOC is read anyway for the test, so it identifies the media as well
+bool cCdioTester::probeMedia (const cMediaHandle &d, stringList &keylist,
+                                 std::string &identity)
 {
     CdIo_t *cdio;
     bool ismedia = TRUE;
     track_t tr;
     MEDIA_MASK_T m = d.GetMediaMask();
+
+    identity.clear();
 #ifdef DEBUG
   mLogger->logmsg(LOGLEVEL_INFO, "cCdioTester: CDIO check file >%s< %x",
           d.GetDeviceFile().c_str(), m);
 #endif
-    if (!(m & MEDIA_OPTICAL)) {
+    if (!canMatch(m)) {
         return (false);
     }
-    if (!(m & MEDIA_AVAILABLE))
-    {
+    // The device may have been removed while the probe was waiting
+    if (d.IsCancelled()) {
         return (false);
     }
     cdio = cdio_open(d.GetDeviceFile().c_str(), DRIVER_DEVICE);
@@ -34,6 +69,7 @@ bool cCdioTester::isMedia (cMediaHandle d, stringList &keylist)
         return false;
     }
 
+    identity = TocIdentity(cdio);
     tr = cdio_get_first_track_num(cdio);
     if (tr == CDIO_INVALID_TRACK) {
         ismedia = false;
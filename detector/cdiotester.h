@@ -19,7 +19,14 @@ class cCdioTester : public cMediaTester
 public:
     cCdioTester(cLogger *l, const std::string descr, const std::string ext) :
                     cMediaTester (l, descr, ext) {}
-    bool isMedia (cMediaHandle d, stringList &keylist);
+    bool isMedia (const cMediaHandle &d, stringList &keylist);
+    // The start of all tracks and the lead out identify an audio CD
+    bool probeMedia (const cMediaHandle &d, stringList &keylist,
+                       std::string &identity);
+    bool isIndependent (void) const { return true; }
+    MEDIA_MASK_T requiredMask (void) const {
+        return MEDIA_OPTICAL | MEDIA_AVAILABLE;
+    }
     cMediaTester *create(cLogger *l) const {
         return new cCdioTester(l, mDescription, mExt);
     }
@@ -234,6 +234,20 @@ bool cConfigFileParser::GetKeys (const string sectionname,
 
     return true;
 }
+// Return true if the key exists in the given section. Unlike GetValues no
+// error is logged for a missing key, so this can be used for optional keys.
+bool cConfigFileParser::HasKey (const string sectionname, const string key)
+{
+    Section::iterator seciter;
+
+    seciter = mSections.find(StringTools::ToUpper(sectionname));
+    if (seciter == mSections.end()) {
+        return false;
+    }
+    return (seciter->second.find(StringTools::ToUpper(key)) !=
+            seciter->second.end());
+}
+
 // Return a a key in a given section as single value (not split into a key list)
 
 bool cConfigFileParser::GetSingleValue (const string sectionname,
@@ -36,6 +36,7 @@ public:
     cConfigFileParser(cLogger *l) {mLogger = l;}
     bool Parse (const std::string filename);
     bool GetKeys (const std::string sectionname, stringList &values);
+    bool HasKey (const std::string sectionname, const std::string key);
     bool GetFirstSection (Section::iterator &iter, std::string &sectionname);
     bool GetNextSection (Section::iterator &iter, std::string &sectionname);
     bool GetValues (const std::string sectionname, const std::string key,
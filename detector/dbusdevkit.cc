@@ -13,8 +13,12 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <time.h>
+#include <sys/epoll.h>
 #include <string>
+#include <algorithm>
 #include "dbusdevkit.h"
+#include "canceltoken.h"
 
 using namespace std;
 
@@ -28,36 +32,201 @@ const string cDbusDevkit::DEVICEKIT_DISKS_OBJECT = "/org/freedesktop/DeviceKit/D
 const string cDbusDevkit::UDISKS_SERVICE2 = "org.freedesktop.UDisks2";
 const string cDbusDevkit::UDISKS_OBJECT2 = "/org/freedesktop/UDisks2";
 const string cDbusDevkit::UDISKS_OBJECT2_DEV = "/org/freedesktop/UDisks2/block_devices";
+const char *cDbusDevkit::OBJECTMANAGER_INTERFACE = "org.freedesktop.DBus.ObjectManager";
+const char *cDbusDevkit::PROPERTIES_INTERFACE = "org.freedesktop.DBus.Properties";
 /* UDisks */
 const string cDbusDevkit::UDISKS_SERVICE = "org.freedesktop.UDisks";
 const string cDbusDevkit::UDISKS_OBJECT = "/org/freedesktop/UDisks";
 const string cDbusDevkit::UDISKS_INTERFACE = "Device";
 
-cDeviceKitException::cDeviceKitException (const char *file, int line,
-                                                const std::string errtxt)
+const int cDbusDevkit::MIN_BUS_BACKOFF;
+const int cDbusDevkit::MAX_BUS_BACKOFF;
+
+void cDbusService::Set(DBusConnection *conn, const string &name,
+                          const string &objectpath, bool udisks2)
 {
-    char buf[40];
-    sprintf(buf, ", %d, ", line);
-    std::string fn = file;
-    mErrTxt = fn + buf + errtxt;
+    if (mConn != NULL) {
+        dbus_connection_unref(mConn);
+    }
+    mConn = dbus_connection_ref(conn);
+    mName = name;
+    mObjectPath = objectpath;
+    mUDisk2 = udisks2;
 }
 
-cDbusDevkit::cDbusDevkit(cLogger *logger)
+cDbusDevkit::cDbusDevkit(cLogger *logger) : cDeviceBackend(logger)
 {
+    // The connection for the calls is used by several threads
+    dbus_threads_init_default();
     mConnSystem = NULL;
-    mLogger = logger;
+    mConnCalls = NULL;
+    mReading = false;
     mObjectPath.clear();
     mService.clear();
     mUDisk2 = false;
+    mProbeService = true;
+    mServiceLost = false;
+    mBusBackoff = MIN_BUS_BACKOFF;
+    mNextBusAttempt = 0;
+    mCallTimeout = 0;
     // initialize the errors
     dbus_error_init(&mErr);
 }
 
 cDbusDevkit::~cDbusDevkit()
 {
-    if (mConnSystem != NULL) {
-        dbus_connection_unref (mConnSystem);
+    DisconnectBus();
+}
+
+/*
+ * Integration of the dbus connection into the event loop. libdbus tells
+ * which file descriptors (watches) it needs to wait for and when it needs
+ * to be called for a timeout.
+ */
+dbus_bool_t cDbusDevkit::AddWatch(DBusWatch *watch, void *data)
+{
+    cDbusDevkit *devkit = (cDbusDevkit *)data;
+    int fd = dbus_watch_get_unix_fd(watch);
+    devkit->mWatches[fd].push_back(watch);
+    return devkit->UpdateWatch(fd);
+}
+
+void cDbusDevkit::RemoveWatch(DBusWatch *watch, void *data)
+{
+    cDbusDevkit *devkit = (cDbusDevkit *)data;
+    int fd = dbus_watch_get_unix_fd(watch);
+    devkit->mWatches[fd].remove(watch);
+    devkit->UpdateWatch(fd);
+}
+
+void cDbusDevkit::ToggleWatch(DBusWatch *watch, void *data)
+{
+    cDbusDevkit *devkit = (cDbusDevkit *)data;
+    devkit->UpdateWatch(dbus_watch_get_unix_fd(watch));
+}
+
+// Collect the flags of all enabled watches of a file descriptor
+bool cDbusDevkit::UpdateWatch(int fd)
+{
+    uint32_t events = 0;
+    WatchList &watches = mWatches[fd];
+    WatchList::iterator it;
+
+    for (it = watches.begin(); it != watches.end(); it++) {
+        if (dbus_watch_get_enabled(*it)) {
+            unsigned int flags = dbus_watch_get_flags(*it);
+            if (flags & DBUS_WATCH_READABLE) {
+                events |= EPOLLIN;
+            }
+            if (flags & DBUS_WATCH_WRITABLE) {
+                events |= EPOLLOUT;
+            }
+        }
+    }
+    if (watches.empty()) {
+        mWatches.erase(fd);
+    }
+    return mEventLoop.SetFd(fd, events);
+}
+
+dbus_bool_t cDbusDevkit::AddTimeout(DBusTimeout *timeout, void *data)
+{
+    cDbusDevkit *devkit = (cDbusDevkit *)data;
+    TIMEOUT t;
+    t.timeout = timeout;
+    t.start = devkit->Now();
+    devkit->mTimeouts.push_back(t);
+    return TRUE;
+}
+
+void cDbusDevkit::RemoveTimeout(DBusTimeout *timeout, void *data)
+{
+    cDbusDevkit *devkit = (cDbusDevkit *)data;
+    TimeoutList::iterator it;
+    for (it = devkit->mTimeouts.begin(); it != devkit->mTimeouts.end(); it++) {
+        if (it->timeout == timeout) {
+            devkit->mTimeouts.erase(it);
+            return;
+        }
+    }
+}
+
+void cDbusDevkit::ToggleTimeout(DBusTimeout *timeout, void *data)
+{
+    cDbusDevkit *devkit = (cDbusDevkit *)data;
+    TimeoutList::iterator it;
+    // The interval restarts when a timeout is enabled again
+    for (it = devkit->mTimeouts.begin(); it != devkit->mTimeouts.end(); it++) {
+        if (it->timeout == timeout) {
+            it->start = devkit->Now();
+        }
+    }
+}
+
+/*
+ * Wait for I/O on the dbus connection for at most timeout ms and let libdbus
+ * handle it. Returns false if the event loop was woken up by Wakeup.
+ */
+bool cDbusDevkit::WaitIo(int timeout)
+{
+    cEventLoop::FDEVENT events[cEventLoop::MAX_EVENTS];
+    TimeoutList::iterator tit;
+    long long now = Now();
+    int wait = timeout;
+    bool woken;
+
+    // Wake up for the next dbus timeout
+    for (tit = mTimeouts.begin(); tit != mTimeouts.end(); tit++) {
+        if (dbus_timeout_get_enabled(tit->timeout)) {
+            long long remaining = tit->start +
+                                  dbus_timeout_get_interval(tit->timeout) - now;
+            if (remaining < 0) {
+                remaining = 0;
+            }
+            if ((wait < 0) || (remaining < wait)) {
+                wait = remaining;
+            }
+        }
+    }
+
+    int n = mEventLoop.Wait(wait, events, cEventLoop::MAX_EVENTS, woken);
+    for (int i = 0; i < n; i++) {
+        unsigned int flags = 0;
+        if (events[i].events & EPOLLIN) {
+            flags |= DBUS_WATCH_READABLE;
+        }
+        if (events[i].events & EPOLLOUT) {
+            flags |= DBUS_WATCH_WRITABLE;
+        }
+        if (events[i].events & EPOLLERR) {
+            flags |= DBUS_WATCH_ERROR;
+        }
+        if (events[i].events & EPOLLHUP) {
+            flags |= DBUS_WATCH_HANGUP;
+        }
+        // Copy the list, handling a watch may add or remove watches
+        WatchList watches = mWatches[events[i].fd];
+        WatchList::iterator wit;
+        for (wit = watches.begin(); wit != watches.end(); wit++) {
+            if (dbus_watch_get_enabled(*wit)) {
+                dbus_watch_handle(*wit, flags);
+            }
+        }
+    }
+
+    now = Now();
+    TimeoutList expired;
+    for (tit = mTimeouts.begin(); tit != mTimeouts.end(); tit++) {
+        if ((dbus_timeout_get_enabled(tit->timeout)) &&
+            (tit->start + dbus_timeout_get_interval(tit->timeout) <= now)) {
+            tit->start = now;
+            expired.push_back(*tit);
+        }
     }
+    for (tit = expired.begin(); tit != expired.end(); tit++) {
+        dbus_timeout_handle(tit->timeout);
+    }
+    return !woken;
 }
 
 bool cDbusDevkit::StartService(const string &name)
@@ -71,105 +240,533 @@ bool cDbusDevkit::StartService(const string &name)
     return false;
 }
 
-bool cDbusDevkit::WaitConn (void) throw (cDeviceKitException)
+bool cDbusDevkit::AddMatch(const string &rule)
+{
+    dbus_bus_add_match (mConnSystem, rule.c_str(), &mErr);
+    if (dbus_error_is_set(&mErr)) {
+        mLogger->logmsg(LOGLEVEL_ERROR, "Match Error %s (%s)", rule.c_str(),
+                        mErr.message);
+        dbus_error_free(&mErr);
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Connect to the system bus. Failed attempts are repeated with an
+ * increasing delay.
+ */
+bool cDbusDevkit::ConnectBus (void)
 {
-    // connect to the bus and check for errors
     if (mConnSystem != NULL) {
         return true;
     }
+    if (Now() < mNextBusAttempt) {
+        return false;
+    }
 
-    mConnSystem = dbus_bus_get (DBUS_BUS_SYSTEM, &mErr);
+    // Use private connections, since the main loop of the signal
+    // connection is driven by the event loop of the detector thread. The
+    // calls are not read by this loop, so a call of a worker does not
+    // depend on the thread waiting for signals.
+    DBusConnection *signals = dbus_bus_get_private (DBUS_BUS_SYSTEM, &mErr);
+    DBusConnection *calls = NULL;
+    if (signals != NULL) {
+        calls = dbus_bus_get_private (DBUS_BUS_SYSTEM, &mErr);
+    }
     if (dbus_error_is_set(&mErr)) {
         mLogger->logmsg(LOGLEVEL_ERROR, "Connection Error (%s)", mErr.message);
         dbus_error_free(&mErr);
-        mConnSystem = NULL;
+    }
+    if (calls == NULL) {
+        if (signals != NULL) {
+            dbus_connection_close (signals);
+            dbus_connection_unref (signals);
+        }
+        mNextBusAttempt = Now() + mBusBackoff;
+        mBusBackoff = min(mBusBackoff * 2, MAX_BUS_BACKOFF);
         return false;
     }
+    mBusBackoff = MIN_BUS_BACKOFF;
+    dbus_connection_set_exit_on_disconnect(signals, FALSE);
+    dbus_connection_set_exit_on_disconnect(calls, FALSE);
+    {
+        lock_guard<mutex> lock(mMutex);
+        mConnSystem = signals;
+        mConnCalls = calls;
+    }
+    if ((!dbus_connection_set_watch_functions(mConnSystem, AddWatch, RemoveWatch,
+                                              ToggleWatch, this, NULL)) ||
+        (!dbus_connection_set_timeout_functions(mConnSystem, AddTimeout,
+                                                RemoveTimeout, ToggleTimeout,
+                                                this, NULL))) {
+        mLogger->logmsg(LOGLEVEL_ERROR, "Can not set watch functions");
+    }
+
+    // Track the owners of the disk services, so that the detector notices
+    // when a service is started or restarted.
+    const string *services[] = { &UDISKS_SERVICE2, &UDISKS_SERVICE,
+                                 &DEVICEKIT_DISKS_SERVICE };
+    for (size_t i = 0; i < sizeof(services) / sizeof(services[0]); i++) {
+        AddMatch(string("type='signal',sender='") + DBUS_SERVICE_DBUS +
+                 "',interface='" + DBUS_INTERFACE_DBUS +
+                 "',member='NameOwnerChanged',arg0='" + *services[i] + "'");
+    }
+    mProbeService = true;
+    return true;
+}
+
+/*
+ * Drop the bus connections, e.g. after the bus was restarted. Running calls
+ * keep their reference to the connection and fail.
+ */
+void cDbusDevkit::DisconnectBus (void)
+{
+    DBusConnection *signals;
+    DBusConnection *calls;
+
     if (mConnSystem == NULL) {
-        return false;
+        return;
+    }
+    {
+        lock_guard<mutex> lock(mMutex);
+        signals = mConnSystem;
+        calls = mConnCalls;
+        mConnSystem = NULL;
+        mConnCalls = NULL;
+        mService.clear();
+        mObjectPath.clear();
+        mPropertyCache.clear();
+        mBlockDrive.clear();
     }
+    mServiceRules.clear();
+    dbus_connection_set_watch_functions(signals, NULL, NULL, NULL,
+                                        NULL, NULL);
+    dbus_connection_set_timeout_functions(signals, NULL, NULL, NULL,
+                                          NULL, NULL);
+    dbus_connection_close (signals);
+    dbus_connection_unref (signals);
+    dbus_connection_close (calls);
+    dbus_connection_unref (calls);
+}
 
-    // Check if DEVICEKIT DISK2, DEVICEKIT DISK or UDISK is available
+/*
+ * Check if DEVICEKIT DISK2, DEVICEKIT DISK or UDISK is available and
+ * subscribe to its signals. The services are only probed again, when the
+ * owner of one of the service names changes.
+ */
+bool cDbusDevkit::FindService (void)
+{
+    string service;
+    string objectpath;
+    bool udisks2 = false;
 
+    mProbeService = false;
     if (StartService(UDISKS_SERVICE2)) {
         mLogger->logmsg(LOGLEVEL_INFO, "Udisks2 found");
-        mService = UDISKS_SERVICE2;
-        mObjectPath = UDISKS_OBJECT2;
-        mUDisk2 = true;
+        service = UDISKS_SERVICE2;
+        objectpath = UDISKS_OBJECT2;
+        udisks2 = true;
     }
     else if (StartService(UDISKS_SERVICE)) {
         mLogger->logmsg(LOGLEVEL_INFO, "Udisks found");
-        mService = UDISKS_SERVICE;
-        mObjectPath = UDISKS_OBJECT;
+        service = UDISKS_SERVICE;
+        objectpath = UDISKS_OBJECT;
     }
     else if (StartService(DEVICEKIT_DISKS_SERVICE)) {
         mLogger->logmsg(LOGLEVEL_INFO, "Obsolete Devicekit found");
-        dbus_error_free(&mErr);
-        mService = DEVICEKIT_DISKS_SERVICE;
-        mObjectPath = DEVICEKIT_DISKS_OBJECT;
+        service = DEVICEKIT_DISKS_SERVICE;
+        objectpath = DEVICEKIT_DISKS_OBJECT;
     }
     else {
         mLogger->logmsg(LOGLEVEL_WARNING, "No Devicekit/Udisk Disks found");
-        mService.clear();
-        mObjectPath.clear();
+        // Report all devices as new, when a service appears
+        mServiceLost = true;
         return false;
     }
 
-    string rule ="type='signal',interface='";
-    if (mUDisk2) {
-        rule = rule + "org.freedesktop.DBus.Properties'";
+    // add filters for the messages we want to see. The rules are limited
+    // to the disk service, so that signals of other services on the system
+    // bus do not wake up the detector.
+    string rule = "type='signal',sender='" + service + "',interface='";
+    if (udisks2) {
+        mServiceRules.push_back(rule + PROPERTIES_INTERFACE +
+                                "',member='PropertiesChanged'," +
+                                "path_namespace='" + objectpath + "'");
+        // Objects added or removed
+        mServiceRules.push_back(rule + OBJECTMANAGER_INTERFACE +
+                                "',member='InterfacesAdded'," +
+                                "path='" + objectpath + "'");
+        mServiceRules.push_back(rule + OBJECTMANAGER_INTERFACE +
+                                "',member='InterfacesRemoved'," +
+                                "path='" + objectpath + "'");
     }
     else {
-        rule = rule + mService + "'";
+        mServiceRules.push_back(rule + service + "',path='" + objectpath + "'");
+    }
+    stringList::iterator it;
+    for (it = mServiceRules.begin(); it != mServiceRules.end(); it++) {
+        if (!AddMatch(*it)) {
+            mServiceRules.erase(it, mServiceRules.end());
+            for (it = mServiceRules.begin(); it != mServiceRules.end(); it++) {
+                dbus_bus_remove_match(mConnSystem, it->c_str(), NULL);
+            }
+            mServiceRules.clear();
+            return false;
+        }
+    }
+    {
+        // The calls use the service from now on
+        lock_guard<mutex> lock(mMutex);
+        mService = service;
+        mObjectPath = objectpath;
+        mUDisk2 = udisks2;
+    }
+    if (mServiceLost) {
+        mServiceLost = false;
+        ServiceRestarted();
     }
+    return true;
+}
 
-    // add a filter for the messages we want to see
-    dbus_bus_add_match (mConnSystem, rule.c_str(), &mErr); // see signals from the given interface
-    if (dbus_error_is_set(&mErr)) {
-        mLogger->logmsg(LOGLEVEL_ERROR, "Match Error (%s)", mErr.message);
-        dbus_error_free(&mErr);
-        return false;
+/*
+ * The disk service disappeared from the bus. The properties of the known
+ * devices are kept, so that devices removed while the service is away can
+ * be reported when it comes back.
+ */
+void cDbusDevkit::ServiceLost (void)
+{
+    CacheMap::iterator cit;
+    stringList::iterator it;
+
+    mLogger->logmsg(LOGLEVEL_WARNING, "Disk service %s lost", mService.c_str());
+    {
+        // The calls fail without a service from now on
+        lock_guard<mutex> lock(mMutex);
+        for (cit = mPropertyCache.begin(); cit != mPropertyCache.end(); cit++) {
+            DEVICE_PROPERTIES props;
+            const string &path = cit->first;
+            // Only complete entries can be described without the service,
+            // the service must not be called while it is away.
+            if ((!cit->second.complete) ||
+                (cit->second.interfaces.find(mUDisk2 ? "Block" : UDISKS_INTERFACE) ==
+                 cit->second.interfaces.end())) {
+                continue;
+            }
+            if (mUDisk2) {
+                DriveMap::const_iterator dit = mBlockDrive.find(path);
+                DescribeDevice(true, PeekProperties(path, "Block"),
+                               PeekProperties(path, "Filesystem"),
+                               (dit == mBlockDrive.end()) ? NULL :
+                                       PeekProperties(dit->second, "Drive"),
+                               props);
+            }
+            else {
+                DescribeDevice(false, PeekProperties(path, UDISKS_INTERFACE),
+                               NULL, NULL, props);
+            }
+            mLostDevices[path] = props;
+        }
+        mService.clear();
+        mObjectPath.clear();
+        mPropertyCache.clear();
+        mBlockDrive.clear();
+    }
+    for (it = mServiceRules.begin(); it != mServiceRules.end(); it++) {
+        dbus_bus_remove_match(mConnSystem, it->c_str(), NULL);
+    }
+    mServiceRules.clear();
+    mServiceLost = true;
+}
+
+/*
+ * The disk service is back. Enumerate the devices again and report the
+ * devices, which appeared or disappeared in the meantime.
+ */
+void cDbusDevkit::ServiceRestarted (void)
+{
+    stringList devices;
+    stringList::iterator it;
+    map<string, DEVICE_PROPERTIES>::iterator lit;
+
+    try {
+        devices = EnumerateDevices();
+    } catch (cDeviceKitException &e) {
+        mLogger->logmsg(LOGLEVEL_WARNING, "Enumeration failed %s", e.what());
+        return;
+    }
+    for (it = devices.begin(); it != devices.end(); it++) {
+        lit = mLostDevices.find(*it);
+        if (lit != mLostDevices.end()) {
+            mLostDevices.erase(lit);
+        }
+        else {
+            DEVICE_EVENT event;
+            event.path = *it;
+            event.signal = DeviceAdded;
+            mServiceEvents.push_back(event);
+        }
     }
+    for (lit = mLostDevices.begin(); lit != mLostDevices.end(); lit++) {
+        DEVICE_EVENT event;
+        event.path = lit->first;
+        event.signal = DeviceRemoved;
+        event.properties = lit->second;
+        mServiceEvents.push_back(event);
+    }
+    mLostDevices.clear();
+}
+
+// Handle a change of the owner of one of the disk services
+void cDbusDevkit::NameOwnerChanged (DBusMessage *msg)
+{
+    const char *name;
+    const char *oldowner;
+    const char *newowner;
+
+    if (!dbus_message_get_args(msg, NULL, DBUS_TYPE_STRING, &name,
+                               DBUS_TYPE_STRING, &oldowner,
+                               DBUS_TYPE_STRING, &newowner,
+                               DBUS_TYPE_INVALID)) {
+        return;
+    }
+    mLogger->logmsg(LOGLEVEL_INFO, "Owner of %s changed to >%s<", name, newowner);
+    if ((!mService.empty()) && (mService == name) && (oldowner[0] != '\0')) {
+        // The service stopped or was replaced by a new instance
+        ServiceLost();
+    }
+    if ((mService.empty()) && (newowner[0] != '\0')) {
+        FindService();
+    }
+}
 
+/*
+ * Return true, if the bus is connected and a disk service is available.
+ * Called by the thread reading the signals only, before by the first call.
+ */
+bool cDbusDevkit::WaitConn (void)
+{
+    if (!ConnectBus()) {
+        return false;
+    }
+    if (mService.empty()) {
+        return mProbeService && FindService();
+    }
     return true;
 }
 
+void cDbusDevkit::Service (cDbusService &svc)
+{
+    if (!mReading) {
+        lock_guard<mutex> lock(mConnectMutex);
+        if (!mReading) {
+            WaitConn();
+        }
+    }
+    lock_guard<mutex> lock(mMutex);
+    if ((mConnCalls == NULL) || mService.empty()) {
+        DEVKITEXCEPTION("No udisk found");
+    }
+    svc.Set(mConnCalls, mService, mObjectPath, mUDisk2);
+}
+
+DBusMessage *cDbusDevkit::Call (const cDbusService &svc, DBusMessage *getmsg)
+{
+    DBusError err;
+
+    dbus_error_init(&err);
+    DBusMessage *msg = dbus_connection_send_with_reply_and_block(
+                            svc.GetConnection(), getmsg, CallTimeout(), &err);
+    if (dbus_error_is_set(&err)) {
+        string errmsg = "dbus_connection_send_with_reply failed ";
+        errmsg += err.message;
+        dbus_error_free(&err);
+        DEVKITEXCEPTION(errmsg);
+    }
+    return msg;
+}
+
 /*
- * Wait for the device kit
- * timout : timeout in miliseconds
+ * Decode an ObjectManager InterfacesAdded or InterfacesRemoved signal and
+ * update the property cache. Returns the resulting device signal for
+ * block devices, Unkown for all other objects.
  */
-bool cDbusDevkit::WaitDevkit(int timeout, string &retpath, DEVICE_SIGNAL &signal)
+cDbusDevkit::DEVICE_SIGNAL cDbusDevkit::DecodeInterfaceSignal (DBusMessage *msg,
+                                                                   bool added,
+                                                                   DEVICE_EVENT &event)
 {
-    DBusMessage *devkitmsg;
-    bool sigrcv = false;
-    int conntimeout = 5;
-    const char *service;
+    DBusMessageIter iter;
+    DBusMessageIter sub;
+    DBusMessageIter ifentry;
+    DEVICE_SIGNAL signal = DeviceChanged;
+    char *val;
+    string prefix = mService + ".";
 
-    while ((!WaitConn()) && (conntimeout > 0)) {
-        sleep(1);
-        conntimeout--;
+    if ((!dbus_message_iter_init(msg, &iter)) ||
+        (dbus_message_iter_get_arg_type(&iter) != DBUS_TYPE_OBJECT_PATH)) {
+        return Unkown;
     }
-    if (conntimeout == 0) {
-        mLogger->logmsg(LOGLEVEL_ERROR, "No response from dbus");
-        return false;
+    dbus_message_iter_get_basic(&iter, &val);
+    event.path = val;
+    event.interfaces.clear();
+    if ((!dbus_message_iter_next(&iter)) ||
+        (dbus_message_iter_get_arg_type(&iter) != DBUS_TYPE_ARRAY)) {
+        return Unkown;
     }
-    if (mUDisk2) {
-        service = (const char *)"org.freedesktop.DBus.Properties";
+
+    // Collect the names of the added/removed interfaces
+    dbus_message_iter_recurse(&iter, &sub);
+    while (dbus_message_iter_get_arg_type(&sub) != DBUS_TYPE_INVALID) {
+        if (added) {
+            dbus_message_iter_recurse(&sub, &ifentry);
+            dbus_message_iter_get_basic(&ifentry, &val);
+        }
+        else {
+            dbus_message_iter_get_basic(&sub, &val);
+        }
+        if (strncmp(val, prefix.c_str(), prefix.length()) == 0) {
+            event.interfaces.push_back(val + prefix.length());
+        }
+        dbus_message_iter_next(&sub);
+    }
+    bool block = (find(event.interfaces.begin(), event.interfaces.end(),
+                       "Block") != event.interfaces.end());
+
+    if (added) {
+        lock_guard<mutex> lock(mMutex);
+        CacheMap::iterator cit = mPropertyCache.find(event.path);
+        if (cit == mPropertyCache.end()) {
+            // A new object announces all its interfaces at once
+            cit = mPropertyCache.insert(make_pair(event.path, CACHEENTRY())).first;
+            cit->second.complete = true;
+        }
+        try {
+            DecodeInterfaceDict(iter, mService, cit->second);
+            StoreDrive(event.path, cit->second);
+        } catch (cDeviceKitException &e) {
+            mLogger->logmsg(LOGLEVEL_WARNING, "InterfacesAdded %s", e.what());
+            mPropertyCache.erase(cit);
+        }
+        if (block) {
+            signal = DeviceAdded;
+        }
+    }
+    else if (block) {
+        // Keep the properties of the removed device for the event
+        try {
+            GetDeviceProperties(event.path, event.properties);
+        } catch (cDeviceKitException &e) {
+            mLogger->logmsg(LOGLEVEL_WARNING, "DeviceKit Error %s", e.what());
+        }
+        lock_guard<mutex> lock(mMutex);
+        mPropertyCache.erase(event.path);
+        mBlockDrive.erase(event.path);
+        signal = DeviceRemoved;
     }
     else {
-        service = mService.c_str();
+        lock_guard<mutex> lock(mMutex);
+        CacheMap::iterator cit = mPropertyCache.find(event.path);
+        if (cit != mPropertyCache.end()) {
+            stringList::iterator it;
+            for (it = event.interfaces.begin(); it != event.interfaces.end(); it++) {
+                cit->second.interfaces.erase(*it);
+                cit->second.missing.insert(*it);
+            }
+        }
+    }
+    if (event.path.compare(0, UDISKS_OBJECT2_DEV.length(), UDISKS_OBJECT2_DEV) != 0) {
+        return Unkown; // Drives, jobs...
     }
-    do {
-        dbus_connection_read_write(mConnSystem, timeout);
+    return signal;
+}
+
+/*
+ * Read the next device signal from the bus.
+ * timout : timeout in miliseconds, if no message is queued
+ */
+bool cDbusDevkit::ReadSignal(int timeout, DEVICE_EVENT &event)
+{
+    DBusMessage *devkitmsg;
+    DBusMessageIter iter;
+    const char *service;
+    char *val;
+    bool waited = false;
+    DEVICE_SIGNAL signal;
+
+    for (;;) {
+        // Events found after a restart of the disk service
+        if (!mServiceEvents.empty()) {
+            event = mServiceEvents.front();
+            mServiceEvents.pop_front();
+            return true;
+        }
+        if (mConnSystem == NULL) {
+            return false;
+        }
+        if (mUDisk2) {
+            service = PROPERTIES_INTERFACE;
+        }
+        else {
+            service = mService.c_str();
+        }
         devkitmsg = dbus_connection_pop_message(mConnSystem);
-        if (devkitmsg != NULL) {
-            string path = dbus_message_get_path(devkitmsg);
-            /* mLogger->logmsg(LOGLEVEL_INFO, "Message received %s Member %s Path %s",
-                    dbus_message_get_interface(devkitmsg),
-                    dbus_message_get_member(devkitmsg),
-                    path.c_str()); */
-            signal = Unkown;
-            // check if the message is a signal from the correct interface and with the correct name
+        if (devkitmsg == NULL) {
+            if (waited) {
+                return false;
+            }
+            if (!WaitIo(timeout)) {
+                return false; // Woken up
+            }
+            waited = true;
+            continue;
+        }
+        const char *path = dbus_message_get_path(devkitmsg);
+        /* mLogger->logmsg(LOGLEVEL_INFO, "Message received %s Member %s Path %s",
+                dbus_message_get_interface(devkitmsg),
+                dbus_message_get_member(devkitmsg),
+                path); */
+        signal = Unkown;
+        if (dbus_message_is_signal(devkitmsg, DBUS_INTERFACE_LOCAL,
+                                   "Disconnected")) {
+            mLogger->logmsg(LOGLEVEL_ERROR, "Disconnected from dbus");
+            dbus_message_unref(devkitmsg);
+            if (!mService.empty()) {
+                ServiceLost();
+            }
+            DisconnectBus();
+            return false;
+        }
+        if (dbus_message_is_signal(devkitmsg, DBUS_INTERFACE_DBUS,
+                                   "NameOwnerChanged")) {
+            NameOwnerChanged(devkitmsg);
+            dbus_message_unref(devkitmsg);
+            continue;
+        }
+        if ((path == NULL) || mService.empty()) { // e.g. NameAcquired
+            dbus_message_unref(devkitmsg);
+            continue;
+        }
+        event.interfaces.clear();
+        // check if the message is a signal from the correct interface and with the correct name
+        if (mUDisk2) {
+            if (dbus_message_is_signal(devkitmsg, service, "PropertiesChanged")) {
+                UpdatePropertyCache(path, devkitmsg);
+                if (strncmp(path, UDISKS_OBJECT2_DEV.c_str(),
+                            UDISKS_OBJECT2_DEV.length()) == 0) {
+                    event.path = path;
+                    signal = DeviceChanged;
+                }
+            }
+            else if (dbus_message_is_signal(devkitmsg, OBJECTMANAGER_INTERFACE,
+                                            "InterfacesAdded")) {
+                signal = DecodeInterfaceSignal(devkitmsg, true, event);
+            }
+            else if (dbus_message_is_signal(devkitmsg, OBJECTMANAGER_INTERFACE,
+                                            "InterfacesRemoved")) {
+                signal = DecodeInterfaceSignal(devkitmsg, false, event);
+            }
+        }
+        else {
             if (dbus_message_is_signal(devkitmsg, service, "DeviceAdded")) {
                 signal = DeviceAdded;
             }
@@ -179,29 +776,62 @@ bool cDbusDevkit::WaitDevkit(int timeout, string &retpath, DEVICE_SIGNAL &signal
             else if (dbus_message_is_signal(devkitmsg, service, "DeviceChanged")) {
                 signal = DeviceChanged;
             }
-            else if (dbus_message_is_signal(devkitmsg, service, "PropertiesChanged")) {
-               if (path.find("/org/freedesktop/UDisks2/block_devices") != string::npos)
-               {
-                   signal = DeviceChanged;
-               }
-            }
             if (signal != Unkown) {
-                // read the parameters
-                mLogger->logmsg(LOGLEVEL_INFO, "DeviceChange Signal for %s", path.c_str());
-                retpath = path;
-                sigrcv = true;
+                // The device object is passed as argument
+                event.path = path;
+                if (dbus_message_iter_init(devkitmsg, &iter) &&
+                    (dbus_message_iter_get_arg_type(&iter) == DBUS_TYPE_OBJECT_PATH)) {
+                    dbus_message_iter_get_basic(&iter, &val);
+                    event.path = val;
+                }
+                if (signal == DeviceRemoved) {
+                    try {
+                        GetDeviceProperties(event.path, event.properties);
+                    } catch (cDeviceKitException &e) {
+                        mLogger->logmsg(LOGLEVEL_WARNING, "DeviceKit Error %s",
+                                        e.what());
+                    }
+                }
+                // No property values available with the signal
+                ForgetDevice(event.path);
             }
-            dbus_message_unref(devkitmsg);
         }
-        else {
-            retpath = "";
-            return false;
+        dbus_message_unref(devkitmsg);
+        if (signal != Unkown) {
+            mLogger->logmsg(LOGLEVEL_INFO, "DeviceChange Signal for %s",
+                            event.path.c_str());
+            event.signal = signal;
+            return true;
         }
-    } while (!sigrcv);
-    return true;
+    }
+}
+
+/*
+ * Connect to the system bus. The disk service need not be available, its
+ * appearance is signalled by NameOwnerChanged. Without a bus connection
+ * wait until the next connection attempt is due.
+ */
+bool cDbusDevkit::Connect(void)
+{
+    cEventLoop::FDEVENT events[cEventLoop::MAX_EVENTS];
+    bool woken;
+
+    if (!mReading) {
+        lock_guard<mutex> lock(mConnectMutex);
+        mReading = true;
+    }
+    WaitConn();
+    if (mConnSystem != NULL) {
+        return true;
+    }
+    long long wait = mNextBusAttempt - Now();
+    if (wait > 0) {
+        mEventLoop.Wait(wait, events, cEventLoop::MAX_EVENTS, woken);
+    }
+    return false;
 }
 
-string cDbusDevkit::FindDeviceByDeviceFile (const string device) throw (cDeviceKitException)
+string cDbusDevkit::FindDeviceByDeviceFile (const string device)
 {
     DBusMessage *msg = NULL;
     DBusMessage *getmsg = NULL;
@@ -209,14 +839,12 @@ string cDbusDevkit::FindDeviceByDeviceFile (const string device) throw (cDeviceK
     char *val;
     string retval;
     const char *dev = device.c_str();
+    cDbusService svc;
 
-    if (!WaitConn()) {
-        DEVKITEXCEPTION("No udisk found");
-    }
-
-    getmsg = dbus_message_new_method_call(mService.c_str(),   // target for the method call
-                                       mObjectPath.c_str(),       // object to call on
-                                       mService.c_str(),          // interface to call on
+    Service(svc);
+    getmsg = dbus_message_new_method_call(svc.GetName().c_str(),   // target for the method call
+                                       svc.GetObjectPath().c_str(), // object to call on
+                                       svc.GetName().c_str(),       // interface to call on
                                        "FindDeviceByDeviceFile");   // method name
     if (getmsg == NULL) {
         DEVKITEXCEPTION("dbus_message_new_method_call Message Null");
@@ -227,14 +855,7 @@ string cDbusDevkit::FindDeviceByDeviceFile (const string device) throw (cDeviceK
                                      DBUS_TYPE_INVALID);
 
         // send message and get a handle for a reply
-        msg = dbus_connection_send_with_reply_and_block(mConnSystem, getmsg,
-                                                              -1, &mErr);
-        if (dbus_error_is_set(&mErr)) {
-            string errmsg = "dbus_connection_send_with_reply failed";
-            errmsg += mErr.message;
-            dbus_error_free(&mErr);
-            DEVKITEXCEPTION(errmsg);
-        }
+        msg = Call(svc, getmsg);
 
         // read the parameters
         if (!dbus_message_iter_init(msg, &iter)) {
@@ -267,79 +888,72 @@ string cDbusDevkit::FindDeviceByDeviceFile (const string device) throw (cDeviceK
 }
 
 /*
- * Optimistic XML "parser"
+ * Enumerate all UDisks2 objects with one GetManagedObjects call. The
+ * property cache is filled with the returned interfaces and properties of
+ * all objects, the object paths of the block devices are returned.
  */
-char *cDbusDevkit::getXML(char **val, const char *tag)
-{
-    char *start = strstr(*val, tag);
-    char *end;
-    if (start == NULL){
-        return NULL;
-    }
-    start = strchr(start, '"');
-    start++;
-    end = strchr(start, '"');
-    if (end == NULL) {
-        return NULL;
-    }
-    *end = '\0';
-    end++;
-    *val = end;
-    return (start);
-}
-
-stringList cDbusDevkit::EnumerateDevices2 (void) throw (cDeviceKitException)
+stringList cDbusDevkit::EnumerateDevices2 (const cDbusService &svc)
 {
     stringList retval;
     DBusMessage *getmsg = NULL;
     DBusMessage *msg = NULL;
     DBusMessageIter iter;
+    DBusMessageIter objects;
+    DBusMessageIter object;
     char *val;
+    string prefix = UDISKS_OBJECT2_DEV + "/";
 
-    getmsg = dbus_message_new_method_call( "org.freedesktop.UDisks2", //mService,   // busname target for the method call
-                                            UDISKS_OBJECT2_DEV.c_str(),  // org/freedesktop/UDisks2/block_devices", //mObjectPath,       // object to call on
-                                            "org.freedesktop.DBus.Introspectable", //                               mDevicekitInterface.c_str(),    // interface to call on      // interface to call on
-                                            "Introspect");   // method name
+    getmsg = dbus_message_new_method_call(svc.GetName().c_str(), // busname target for the method call
+                                          svc.GetObjectPath().c_str(), // object to call on
+                                          OBJECTMANAGER_INTERFACE, // interface to call on
+                                          "GetManagedObjects");   // method name
     try {
            if (getmsg == NULL) {
                DEVKITEXCEPTION("dbus_message_new_method_call Message Null");
            }
            // send message and get a handle for a reply
-           msg = dbus_connection_send_with_reply_and_block(mConnSystem, getmsg,
-                                                                 -1, &mErr);
-           if (dbus_error_is_set(&mErr)) {
-               string errmsg = "dbus_connection_send_with_reply failed ";
-               errmsg += mErr.message;
-               dbus_error_free(&mErr);
-               DEVKITEXCEPTION(errmsg);
-           }
+           msg = Call(svc, getmsg);
 
            // read the parameters
            if (!dbus_message_iter_init(msg, &iter)) {
                DEVKITEXCEPTION("Message has no arguments!");
            }
            int msgtype = dbus_message_iter_get_arg_type(&iter);
-           if (msgtype != DBUS_TYPE_STRING) {
-
-               mLogger->logmsg(LOGLEVEL_ERROR, "Argument is not a string >%c<!",
+           if (msgtype != DBUS_TYPE_ARRAY) {
+               mLogger->logmsg(LOGLEVEL_ERROR, "Argument is not an array >%c<!",
                        msgtype);
-               DEVKITEXCEPTION("Argument is not a string");
+               DEVKITEXCEPTION("Argument is not an array");
            }
-           dbus_message_iter_get_basic(&iter, &val);
-#ifdef DEBUG
-           mLogger->logmsg(LOGLEVEL_INFO, "Argument %s", val);
-#endif
-           char *token;
-           while ((token = getXML(&val, (const char*)"node name")) != NULL) {
+           dbus_message_iter_recurse(&iter, &objects);
+           while (dbus_message_iter_get_arg_type(&objects) == DBUS_TYPE_DICT_ENTRY) {
+               dbus_message_iter_recurse(&objects, &object);
+               dbus_message_iter_get_basic(&object, &val);
+               dbus_message_iter_next(&object);
+
+               CACHEENTRY entry;
+               entry.complete = true;
+               DecodeInterfaceDict(object, svc.GetName(), entry);
+               bool block = (entry.interfaces.find("Block") != entry.interfaces.end());
+               {
+                   lock_guard<mutex> lock(mMutex);
+                   CACHEENTRY &cached = mPropertyCache[val];
+                   cached.interfaces.swap(entry.interfaces);
+                   cached.missing.clear();
+                   cached.complete = true;
+                   StoreDrive(val, cached);
+               }
+
+               if ((strncmp(val, prefix.c_str(), prefix.length()) == 0) &&
+                   block) {
 #ifdef DEBUG
-           mLogger->logmsg(LOGLEVEL_INFO, "Device %s", token);
+                   mLogger->logmsg(LOGLEVEL_INFO, "Device %s", val);
 #endif
-               string s = UDISKS_OBJECT2_DEV;
-               s = s + "/";
-               s = s + token;
-               retval.push_back(s);
+                   retval.push_back(val);
+               }
+               dbus_message_iter_next(&objects);
            }
-
+           dbus_message_unref(getmsg);
+           dbus_message_unref(msg);
     } catch (cDeviceKitException &e) {
         if (getmsg != NULL) {
             dbus_message_unref(getmsg);
@@ -352,7 +966,7 @@ stringList cDbusDevkit::EnumerateDevices2 (void) throw (cDeviceKitException)
     return retval;
 }
 
-stringList cDbusDevkit::EnumerateDevices (void) throw (cDeviceKitException)
+stringList cDbusDevkit::EnumerateDevices (void)
 {
     DBusMessage *msg = NULL;
     DBusMessage *getmsg = NULL;
@@ -360,17 +974,15 @@ stringList cDbusDevkit::EnumerateDevices (void) throw (cDeviceKitException)
     DBusMessageIter subiter;
     stringList retval;
     char *val;
+    cDbusService svc;
 
-    if (!WaitConn()) {
-        DEVKITEXCEPTION("No udisk found");
-    }
-
-    if (mUDisk2) {
-        return EnumerateDevices2();
+    Service(svc);
+    if (svc.IsUDisks2()) {
+        return EnumerateDevices2(svc);
     }
-    getmsg = dbus_message_new_method_call(mService.c_str(),   // target for the method call
-                                       mObjectPath.c_str(),       // object to call on
-                                       mService.c_str(),          // interface to call on
+    getmsg = dbus_message_new_method_call(svc.GetName().c_str(),   // target for the method call
+                                       svc.GetObjectPath().c_str(), // object to call on
+                                       svc.GetName().c_str(),       // interface to call on
                                        "EnumerateDevices");   // method name
 
     try {
@@ -379,14 +991,7 @@ stringList cDbusDevkit::EnumerateDevices (void) throw (cDeviceKitException)
         }
 
         // send message and get a handle for a reply
-        msg = dbus_connection_send_with_reply_and_block(mConnSystem, getmsg,
-                                                              -1, &mErr);
-        if (dbus_error_is_set(&mErr)) {
-            string errmsg = "dbus_connection_send_with_reply failed ";
-            errmsg += mErr.message;
-            dbus_error_free(&mErr);
-            DEVKITEXCEPTION(errmsg);
-        }
+        msg = Call(svc, getmsg);
 
         // read the parameters
         if (!dbus_message_iter_init(msg, &iter)) {
@@ -429,304 +1034,902 @@ stringList cDbusDevkit::EnumerateDevices (void) throw (cDeviceKitException)
     return retval;
 }
 
-DBusMessage *cDbusDevkit::CallDbusProperty (const string &path,
-                                                const string &name,
-                                                DBusMessageIter *iter,
-                                                const string &udisk_interface)
-                                                throw (cDeviceKitException)
-{
-    DBusMessage *msg = NULL;
-    DBusMessage *getmsg = NULL;
+/*
+ * Get Property as string
+ */
+string cDbusDevkit::GetDbusPropertyS (const cDbusService &svc,
+                                          const string &path,
+                                          const string &name,
+                                          const string &udisk_interface)
+{
+    cDbusResult<cDbusProperty> prop = FindProperty(svc, path, name,
+                                                   udisk_interface);
+    CheckStatus(prop);
+    if (!prop.IsOk()) { // Ignore "No such interface"
+        return "";
+    }
+    return prop.GetValue().GetString();
+}
 
-    getmsg = dbus_message_new_method_call(mService.c_str(),   // org.freedesktop.UDisks2 target for the method call
-                                       path.c_str(),                // object to call on
-                                       "org.freedesktop.DBus.Properties", // interface to call on
-                                       "Get"); // method name
-    if (dbus_error_is_set(&mErr)) {
-        string errmsg = "dbus_message_new_method_call failed";
-        errmsg += mErr.message;
-        dbus_error_free(&mErr);
-        DEVKITEXCEPTION(errmsg);
+/*
+ * Get property as array of string
+ */
+stringList cDbusDevkit::GetDbusPropertyAS (const cDbusService &svc,
+                                               const string &path,
+                                               const string &name,
+                                               const string &udisk_interface)
+{
+    cDbusResult<cDbusProperty> prop = FindProperty(svc, path, name,
+                                                   udisk_interface);
+    CheckStatus(prop);
+    if (!prop.IsOk()) { // Ignore "No such interface"
+        return stringList();
     }
-    if (getmsg == NULL) {
-        DEVKITEXCEPTION("dbus_message_new_method_call Message Null");
+    return prop.GetValue().GetList();
+}
+
+/*
+ * Get Integer property
+ */
+dbus_int32_t cDbusDevkit::GetDbusPropertyU (const cDbusService &svc,
+                                               const string &path,
+                                               const string &name,
+                                               const string &udisk_interface,
+                                               int defaultval)
+{
+    cDbusResult<cDbusProperty> prop = FindProperty(svc, path, name,
+                                                   udisk_interface);
+    CheckStatus(prop);
+    if (!prop.IsOk()) { // Ignore "No such interface"
+        return defaultval;
+    }
+    if (prop.GetValue().GetType() != cDbusProperty::PropertyInt) {
+        mLogger->logmsg(LOGLEVEL_ERROR, "Argument is not int %s!", name.c_str());
+        DEVKITEXCEPTION ("Argument is not int");
     }
+    return prop.GetValue().GetInt();
+}
 
-    try {
-        string interface = mService + "." + udisk_interface;
-        const char *dev_inter = interface.c_str();
-        const char *na = name.c_str();
+/*
+ * Get boolean property
+ */
+bool cDbusDevkit::GetDbusPropertyB (const cDbusService &svc,
+                                       const string &path,
+                                       const string &name,
+                                       const string &udisk_interface,
+                                       bool defaultval)
+{
+    cDbusResult<cDbusProperty> prop = FindProperty(svc, path, name,
+                                                   udisk_interface);
+    CheckStatus(prop);
+    if (!prop.IsOk()) { // Ignore "No such interface"
+        return defaultval;
+    }
+    if (prop.GetValue().GetType() != cDbusProperty::PropertyBool) {
+        mLogger->logmsg(LOGLEVEL_ERROR, "Argument is not bool %s!", name.c_str());
+        DEVKITEXCEPTION ("Argument is not bool");
+    }
+    return prop.GetValue().GetBool();
+}
 
-        dbus_message_append_args(getmsg, DBUS_TYPE_STRING, &dev_inter,
-                                    DBUS_TYPE_STRING, &na, DBUS_TYPE_INVALID);
+string cDbusProperty::GetString(void) const
+{
+    if (mType == PropertyString) {
+        return mString;
+    }
+    if ((mType == PropertyStringList) && (!mList.empty())) {
+        return mList.front();
+    }
+    return "";
+}
 
-        // send message and get a handle for a reply
-        msg = dbus_connection_send_with_reply_and_block(mConnSystem, getmsg,
-                                                              -1, &mErr);
-        if (dbus_error_is_set (&mErr)) {
-            string errmsg = "dbus_connection_send_with_reply failed ";
-            errmsg += mErr.message;
-            errmsg += " Name " + name;
-            dbus_error_free(&mErr);
-            DEVKITEXCEPTION(errmsg);
-        }
+stringList cDbusProperty::GetList(void) const
+{
+    stringList retval;
+    if (mType == PropertyStringList) {
+        return mList;
+    }
+    if ((mType == PropertyString) && (!mString.empty())) {
+        retval.push_back(mString);
+    }
+    return retval;
+}
 
-        // read the parameters
-        if (!dbus_message_iter_init(msg, iter)) {
-            DEVKITEXCEPTION("Message has no arguments " + name);
+DBusMessageIter *cDbusDecoder::Unwrap (DBusMessageIter &iter,
+                                        DBusMessageIter &variant)
+{
+    if (dbus_message_iter_get_arg_type(&iter) != DBUS_TYPE_VARIANT) {
+        return &iter;
+    }
+    dbus_message_iter_recurse(&iter, &variant);
+    return &variant;
+}
+
+template <> bool cDbusDecoder::GetProperty (DBusMessageIter &iter,
+                                              string &value)
+{
+    DBusMessageIter variant;
+    DBusMessageIter subiter;
+    DBusMessageIter *it = Unwrap(iter, variant);
+    const char *val = NULL;
+    int len = 0;
+
+    switch (dbus_message_iter_get_arg_type(it)) {
+    case DBUS_TYPE_STRING:
+    case DBUS_TYPE_OBJECT_PATH:
+        dbus_message_iter_get_basic(it, &val);
+        value = val;
+        return true;
+    case DBUS_TYPE_ARRAY:
+        dbus_message_iter_recurse(it, &subiter);
+        switch (dbus_message_iter_get_element_type(it)) {
+        case DBUS_TYPE_BYTE: // Byte string, copied in one piece
+            dbus_message_iter_get_fixed_array(&subiter, &val, &len);
+            if ((val == NULL) || (len <= 0)) {
+                value.clear();
+            }
+            else {
+                value.assign(val, strnlen(val, len));
+            }
+            return true;
+        case DBUS_TYPE_ARRAY:
+            if (dbus_message_iter_get_arg_type(&subiter) == DBUS_TYPE_INVALID) {
+                value.clear();
+                return true;
+            }
+            return GetProperty(subiter, value);
+        default:
+            return false;
         }
+    default:
+        return false;
+    }
+}
 
-        int msgtype = dbus_message_iter_get_arg_type(iter);
-        if (msgtype != DBUS_TYPE_VARIANT) {
-            mLogger->logmsg(LOGLEVEL_ERROR, "Argument is not Variant %c!",
-                    msgtype);
-            DEVKITEXCEPTION("Argument is not Variant " + name);
+template <> bool cDbusDecoder::GetProperty (DBusMessageIter &iter,
+                                              stringList &value)
+{
+    DBusMessageIter variant;
+    DBusMessageIter subiter;
+    DBusMessageIter *it = Unwrap(iter, variant);
+
+    if ((dbus_message_iter_get_arg_type(it) != DBUS_TYPE_ARRAY) ||
+        (dbus_message_iter_get_element_type(it) == DBUS_TYPE_BYTE)) {
+        return false;
+    }
+    dbus_message_iter_recurse(it, &subiter);
+    while (dbus_message_iter_get_arg_type(&subiter) != DBUS_TYPE_INVALID) {
+        value.push_back(string());
+        if ((!GetProperty(subiter, value.back())) || (value.back().empty())) {
+            value.pop_back();
         }
-        // free message
-        dbus_message_unref(getmsg);
-    } catch (cDeviceKitException &e) {
-        if (getmsg != NULL) {
-            dbus_message_unref(getmsg);
+        dbus_message_iter_next(&subiter);
+    }
+    return true;
+}
+
+template <> bool cDbusDecoder::GetProperty (DBusMessageIter &iter,
+                                              bool &value)
+{
+    DBusMessageIter variant;
+    DBusMessageIter *it = Unwrap(iter, variant);
+    dbus_bool_t bval = FALSE;
+
+    if (dbus_message_iter_get_arg_type(it) != DBUS_TYPE_BOOLEAN) {
+        return false;
+    }
+    dbus_message_iter_get_basic(it, &bval);
+    value = bval;
+    return true;
+}
+
+template <> bool cDbusDecoder::GetProperty (DBusMessageIter &iter,
+                                              dbus_uint64_t &value)
+{
+    DBusMessageIter variant;
+    DBusMessageIter *it = Unwrap(iter, variant);
+    DBusBasicValue val;
+
+    switch (dbus_message_iter_get_arg_type(it)) {
+    case DBUS_TYPE_BYTE:
+        dbus_message_iter_get_basic(it, &val);
+        value = val.byt;
+        return true;
+    case DBUS_TYPE_UINT16:
+        dbus_message_iter_get_basic(it, &val);
+        value = val.u16;
+        return true;
+    case DBUS_TYPE_INT16:
+        dbus_message_iter_get_basic(it, &val);
+        value = val.i16;
+        return true;
+    case DBUS_TYPE_UINT32:
+        dbus_message_iter_get_basic(it, &val);
+        value = val.u32;
+        return true;
+    case DBUS_TYPE_INT32:
+        dbus_message_iter_get_basic(it, &val);
+        value = val.i32;
+        return true;
+    case DBUS_TYPE_UINT64:
+    case DBUS_TYPE_INT64:
+        dbus_message_iter_get_basic(it, &val);
+        value = val.u64;
+        return true;
+    default:
+        return false;
+    }
+}
+
+/*
+ * Decode the content of a variant into a property
+ */
+void cDbusDevkit::DecodeProperty (DBusMessageIter &iter, cDbusProperty &prop)
+{
+    bool bval = false;
+    dbus_uint64_t ival = 0;
+
+    switch (dbus_message_iter_get_arg_type(&iter)) {
+    case DBUS_TYPE_STRING:
+    case DBUS_TYPE_OBJECT_PATH:
+        cDbusDecoder::GetProperty(iter, prop.NewString());
+        break;
+    case DBUS_TYPE_BOOLEAN:
+        cDbusDecoder::GetProperty(iter, bval);
+        prop.SetBool(bval);
+        break;
+    case DBUS_TYPE_BYTE:
+    case DBUS_TYPE_INT16:
+    case DBUS_TYPE_UINT16:
+    case DBUS_TYPE_INT32:
+    case DBUS_TYPE_UINT32:
+    case DBUS_TYPE_INT64:
+    case DBUS_TYPE_UINT64:
+        cDbusDecoder::GetProperty(iter, ival);
+        prop.SetInt(ival);
+        break;
+    case DBUS_TYPE_ARRAY:
+        // Byte array is a string, all other arrays are string lists
+        if (dbus_message_iter_get_element_type(&iter) == DBUS_TYPE_BYTE) {
+            cDbusDecoder::GetProperty(iter, prop.NewString());
         }
-        if (msg != NULL) {
-            dbus_message_unref(msg);
+        else {
+            cDbusDecoder::GetProperty(iter, prop.NewList());
         }
-        throw;
+        break;
+    default: // Ignore types not needed by the media testers
+        break;
     }
-    return msg;
 }
 
 /*
- * Get string from an iterator of types String, Object Path or Byte Array
+ * Decode a property dictionary a{sv}
  */
-string cDbusDevkit::GetString(DBusMessageIter &iter) throw (cDeviceKitException) {
-   DBusMessageIter subiter;
-   string retval = "";
-   char *val;
-   dbus_int32_t bval = 0;
-
-   int msgtype = dbus_message_iter_get_arg_type(&iter);
-   if ((msgtype == DBUS_TYPE_STRING) || (msgtype == DBUS_TYPE_OBJECT_PATH)) {
-       dbus_message_iter_get_basic(&iter, &val);
-       retval = val;
-   }
-   else if (msgtype == DBUS_TYPE_ARRAY) { // Decode byte array
-       dbus_message_iter_recurse(&iter, &subiter);
-       msgtype = dbus_message_iter_get_arg_type(&subiter);
-       if (msgtype == DBUS_TYPE_INVALID) {
-           return "";
-       }
-       if (msgtype == DBUS_TYPE_ARRAY) {
-           return GetString(subiter);
-       }
-       if (msgtype != DBUS_TYPE_BYTE) {
-           string err = "Argument is not Byte String >";
-           if (msgtype == DBUS_TYPE_INVALID) {
-               err += "INVALID";
-           }
-           else {
-               err += msgtype;
-           }
-           err += "<";
-           DEVKITEXCEPTION(err);
-       }
-       do {
-           dbus_message_iter_get_basic(&subiter, &bval);
-           if (bval != 0) {
-               retval.push_back((char)bval);
-           }
-       } while (dbus_message_iter_next(&subiter) && ((bval != 0)));
-   }
-   else {
-       string err = "Argument is not a String >";
-       if (msgtype == DBUS_TYPE_INVALID) {
-           err += "INVALID";
-       }
-       else {
-           err += msgtype;
-       }
-       err += "<";
-       DEVKITEXCEPTION (err);
-   }
-
-   return retval;
+void cDbusDevkit::DecodePropertyDict (DBusMessageIter &iter, PropertyMap &props)
+{
+    DBusMessageIter dict;
+    DBusMessageIter entry;
+    DBusMessageIter variant;
+    char *name;
+
+    dbus_message_iter_recurse(&iter, &dict);
+    while (dbus_message_iter_get_arg_type(&dict) == DBUS_TYPE_DICT_ENTRY) {
+        dbus_message_iter_recurse(&dict, &entry);
+        dbus_message_iter_get_basic(&entry, &name);
+        dbus_message_iter_next(&entry);
+        dbus_message_iter_recurse(&entry, &variant);
+        DecodeProperty(variant, props[name]);
+        dbus_message_iter_next(&dict);
+    }
 }
 
 /*
- * Get Property as string
+ * Decode the interfaces and properties of an object a{sa{sv}} into a cache
+ * entry. Interfaces not belonging to the disk service are skipped.
  */
-string cDbusDevkit::GetDbusPropertyS (const string &path,
-                                          const string &name,
-                                          const string &udisk_interface)
-                                          throw (cDeviceKitException)
+void cDbusDevkit::DecodeInterfaceDict (DBusMessageIter &iter,
+                                           const string &service,
+                                           CACHEENTRY &entry)
 {
-    DBusMessage *msg = NULL;
-    DBusMessageIter subiter;
-    DBusMessageIter iter;
-    string retval;
+    DBusMessageIter dict;
+    DBusMessageIter ifentry;
+    char *name;
+    string prefix = service + ".";
+
+    dbus_message_iter_recurse(&iter, &dict);
+    while (dbus_message_iter_get_arg_type(&dict) == DBUS_TYPE_DICT_ENTRY) {
+        dbus_message_iter_recurse(&dict, &ifentry);
+        dbus_message_iter_get_basic(&ifentry, &name);
+        if (strncmp(name, prefix.c_str(), prefix.length()) == 0) {
+            dbus_message_iter_next(&ifentry);
+            PropertyMap &props = entry.interfaces[name + prefix.length()];
+            props.clear();
+            DecodePropertyDict(ifentry, props);
+            entry.missing.erase(name + prefix.length());
+        }
+        dbus_message_iter_next(&dict);
+    }
+}
 
-    try {
-        msg = CallDbusProperty(path, name, &iter, udisk_interface);
-    } catch (cDeviceKitException &e) { // Ignore "No such interface"
-        return "";
+cDbusStatus::cDbusStatus (const DBusError &err)
+{
+    mError = (err.name != NULL) ? err.name : "";
+    mMessage = (err.message != NULL) ? err.message : "";
+    if (dbus_error_has_name(&err, DBUS_ERROR_UNKNOWN_INTERFACE) ||
+        (dbus_error_has_name(&err, DBUS_ERROR_INVALID_ARGS) &&
+         (mMessage.find("No such interface") != string::npos))) {
+        // udisks2 answers GetAll for a missing interface with InvalidArgs
+        mStatus = StatusNoInterface;
     }
-    dbus_message_iter_recurse(&iter, &subiter);
+    else if (dbus_error_has_name(&err, DBUS_ERROR_UNKNOWN_OBJECT) ||
+             dbus_error_has_name(&err, DBUS_ERROR_UNKNOWN_METHOD)) {
+        mStatus = StatusNoObject;
+    }
+    else if (dbus_error_has_name(&err, DBUS_ERROR_UNKNOWN_PROPERTY)) {
+        mStatus = StatusNoProperty;
+    }
+    else {
+        mStatus = StatusFailed;
+    }
+}
+
+cDbusPendingCall::~cDbusPendingCall()
+{
+    if (mCall != NULL) {
+        dbus_pending_call_cancel(mCall);
+        dbus_pending_call_unref(mCall);
+    }
+    if (mReply != NULL) {
+        dbus_message_unref(mReply);
+    }
+}
+
+/*
+ * Wait for the reply of the call. Returns NULL if the call failed, err
+ * contains the reason in this case.
+ */
+DBusMessage *cDbusPendingCall::GetReply(DBusError *err)
+{
+    if ((mReply == NULL) && (mCall != NULL)) {
+        dbus_pending_call_block(mCall);
+        mReply = dbus_pending_call_steal_reply(mCall);
+        dbus_pending_call_unref(mCall);
+        mCall = NULL;
+    }
+    if (mReply == NULL) {
+        dbus_set_error_const(err, DBUS_ERROR_DISCONNECTED, "No reply");
+        return NULL;
+    }
+    if (dbus_set_error_from_message(err, mReply)) {
+        return NULL;
+    }
+    return mReply;
+}
+
+/*
+ * Timeout of a call: the rest of the stage of the detection running in this
+ * thread, e.g. a mount may take longer than a property query. Calls outside
+ * a stage with a time limit use the call timeout. A cancelled detection
+ * makes no more calls, e.g. to a device already removed.
+ */
+int cDbusDevkit::CallTimeout(void)
+{
+    int timeout = (mCallTimeout > 0) ? mCallTimeout : -1;
+    cCancelStage *stage = cCancelStage::Current();
+    if (stage != NULL) {
+        if (stage->IsCancelled()) {
+            DEVKITEXCEPTION("Detection cancelled");
+        }
+        int remaining = stage->Remaining();
+        if (remaining > 0) {
+            timeout = remaining;
+        }
+    }
+    return timeout;
+}
+
+/*
+ * Send a method call without waiting for the reply. The message is
+ * unreferenced.
+ */
+cDbusPendingCall *cDbusDevkit::CallAsync(const cDbusService &svc,
+                                          DBusMessage *getmsg)
+{
+    DBusPendingCall *call = NULL;
+    int timeout;
 
     try {
-        retval = GetString(subiter);
+        timeout = CallTimeout();
     } catch (cDeviceKitException &e) {
-        if (msg != NULL) {
-            dbus_message_unref(msg);
-        }
-        mLogger->logmsg(LOGLEVEL_ERROR, "%s %s",
-                        e.what(), name.c_str());
+        dbus_message_unref(getmsg);
         throw;
     }
-    // free reply and close connection
-    dbus_message_unref(msg);
-    return retval;
+    if (!dbus_connection_send_with_reply(svc.GetConnection(), getmsg, &call,
+                                         timeout)) {
+        dbus_message_unref(getmsg);
+        DEVKITEXCEPTION("dbus_connection_send_with_reply out of memory");
+    }
+    dbus_message_unref(getmsg);
+    // call is NULL if the connection is already closed, GetReply will fail
+    return new cDbusPendingCall(call);
 }
 
 /*
- * Get property as array of string
+ * Start a Properties.GetAll call for an interface
  */
-stringList cDbusDevkit::GetDbusPropertyAS (const string &path,
-                                               const string &name,
-                                               const string &udisk_interface)
-                                               throw (cDeviceKitException)
+cDbusPendingCall *cDbusDevkit::GetAllPropertiesAsync (const cDbusService &svc,
+                                                          const string &path,
+                                                          const string &udisk_interface)
+{
+    DBusMessage *getmsg = NULL;
+
+    getmsg = dbus_message_new_method_call(svc.GetName().c_str(),   // target for the method call
+                                       path.c_str(),                // object to call on
+                                       PROPERTIES_INTERFACE, // interface to call on
+                                       "GetAll"); // method name
+    if (getmsg == NULL) {
+        DEVKITEXCEPTION("dbus_message_new_method_call Message Null");
+    }
+
+    string interface = svc.GetName() + "." + udisk_interface;
+    const char *dev_inter = interface.c_str();
+
+    dbus_message_append_args(getmsg, DBUS_TYPE_STRING, &dev_inter,
+                                DBUS_TYPE_INVALID);
+    return CallAsync(svc, getmsg);
+}
+
+/*
+ * Wait for the reply of a GetAll call and decode the properties.
+ */
+cDbusStatus cDbusDevkit::GetAllPropertiesReply (cDbusPendingCall *call,
+                                                    PropertyMap &props)
 {
-    DBusMessage *msg = NULL;
     DBusMessageIter iter;
-    DBusMessageIter subiter;
-    stringList retval;
-    string s;
+    DBusError err;
 
-    try {
-        msg = CallDbusProperty(path, name, &iter, udisk_interface);
-    } catch (cDeviceKitException &e) { // Ignore "No such interface"
-        return retval;
+    props.clear();
+    dbus_error_init(&err);
+    DBusMessage *msg = call->GetReply(&err);
+    if (msg == NULL) { // e.g. "No such interface"
+        cDbusStatus status(err);
+#ifdef DEBUG
+        mLogger->logmsg(LOGLEVEL_INFO, "GetAll: %s", err.message);
+#endif
+        dbus_error_free(&err);
+        return status;
+    }
+
+    // read the parameters
+    if (!dbus_message_iter_init(msg, &iter)) {
+        return cDbusStatus(cDbusStatus::StatusFailed,
+                           "GetAll message has no arguments");
+    }
+
+    int msgtype = dbus_message_iter_get_arg_type(&iter);
+    if (msgtype != DBUS_TYPE_ARRAY) {
+        mLogger->logmsg(LOGLEVEL_ERROR, "Argument is not Array %c!",
+                msgtype);
+        return cDbusStatus(cDbusStatus::StatusFailed,
+                           "GetAll argument is not Array");
     }
     try {
-        int msgtype = dbus_message_iter_get_arg_type(&iter);
-        if (msgtype != DBUS_TYPE_VARIANT) {
-            mLogger->logmsg(LOGLEVEL_ERROR, "Argument is not Variant %c! %s",
-                    msgtype, name.c_str());
-            DEVKITEXCEPTION("Argument is not Variant");
+        DecodePropertyDict(iter, props);
+    } catch (cDeviceKitException &e) {
+        props.clear();
+        return cDbusStatus(cDbusStatus::StatusFailed, e.what());
+    }
+    return cDbusStatus();
+}
+
+/*
+ * Get all properties of an interface with one Properties.GetAll call
+ */
+cDbusStatus cDbusDevkit::GetAllProperties (const cDbusService &svc,
+                                               const string &path,
+                                               const string &udisk_interface,
+                                               PropertyMap &props)
+{
+    cDbusPendingCall *call = GetAllPropertiesAsync(svc, path, udisk_interface);
+    cDbusStatus status = GetAllPropertiesReply(call, props);
+    delete call;
+    return status;
+}
+
+/*
+ * Fetch the properties of several devices, including their drives, in
+ * parallel. All GetAll calls are sent before the first reply is read, so
+ * the devices cost the latency of two round trips (block and drive level)
+ * instead of some round trips for each device. The results are stored in
+ * the property cache.
+ */
+void cDbusDevkit::PrefetchProperties (const stringList &paths)
+{
+    typedef struct {
+        std::string path;
+        std::string interface;
+        cDbusPendingCall *call;
+    } PENDING;
+    std::list<PENDING> pending;
+    std::list<PENDING>::iterator pit;
+    stringList interfaces;
+    stringList drives;
+    stringList::const_iterator it;
+    stringList::iterator iit;
+    cDbusService svc;
+
+    Service(svc);
+    if (svc.IsUDisks2()) {
+        interfaces.push_back("Block");
+        interfaces.push_back("Filesystem");
+    }
+    else {
+        interfaces.push_back(UDISKS_INTERFACE);
+    }
+
+    // Level 0: block devices, level 1: their drives
+    for (int level = 0; level < 2; level++) {
+        const stringList &objects = (level == 0) ? paths : drives;
+        try {
+            for (it = objects.begin(); it != objects.end(); it++) {
+                for (iit = interfaces.begin(); iit != interfaces.end(); iit++) {
+                    if (!IsCached(*it, *iit)) {
+                        PENDING p;
+                        p.path = *it;
+                        p.interface = *iit;
+                        p.call = NULL;
+                        pending.push_back(p);
+                        pending.back().call = GetAllPropertiesAsync(svc, *it,
+                                                                    *iit);
+                    }
+                }
+            }
+            dbus_connection_flush(svc.GetConnection());
+
+            for (pit = pending.begin(); pit != pending.end(); pit++) {
+                PropertyMap props;
+                cDbusStatus status = GetAllPropertiesReply(pit->call, props);
+                if (status.IsOk() ||
+                    (status.GetStatus() == cDbusStatus::StatusNoInterface)) {
+                    lock_guard<mutex> lock(mMutex);
+                    StoreProperties(pit->path, pit->interface, status.IsOk(),
+                                    props);
+                }
+                else {
+                    // Not cached, a later lookup will try again
+                    mLogger->logmsg(LOGLEVEL_WARNING, "GetAll %s failed: %s",
+                                    pit->path.c_str(),
+                                    status.GetMessage().c_str());
+                }
+            }
+        } catch (cDeviceKitException &e) {
+            for (pit = pending.begin(); pit != pending.end(); pit++) {
+                delete pit->call;
+            }
+            throw;
         }
-        dbus_message_iter_recurse(&iter, &subiter);
-        msgtype = dbus_message_iter_get_arg_type(&subiter);
-        if (msgtype != DBUS_TYPE_ARRAY) {
-            mLogger->logmsg(LOGLEVEL_ERROR, "Argument is not Array %c! %s",
-                    msgtype, name.c_str());
-            DEVKITEXCEPTION("Argument is not Array");
+        for (pit = pending.begin(); pit != pending.end(); pit++) {
+            delete pit->call;
         }
-
-        dbus_message_iter_recurse(&subiter, &iter);
-        msgtype = dbus_message_iter_get_arg_type(&subiter);
-        if (msgtype != DBUS_TYPE_ARRAY) {
-            mLogger->logmsg(LOGLEVEL_ERROR, "Argument is not Array %c! %s",
-                    msgtype, name.c_str());
-            DEVKITEXCEPTION("Argument is not Array");
+        pending.clear();
+        if (!svc.IsUDisks2()) {
+            break;
         }
 
-        do {
-            try {
-                retval.push_back(GetString(subiter));
-            } catch (cDeviceKitException &e) {
-                if (msg != NULL) {
-                    dbus_message_unref(msg);
-                }
-                mLogger->logmsg(LOGLEVEL_ERROR, "%s %s",
-                                e.what(), name.c_str());
-                throw;
+        // Collect the drives of the block devices
+        for (it = paths.begin(); it != paths.end(); it++) {
+            string drive = GetDrive(svc, *it);
+            if ((!drive.empty()) && (drive != "/") &&
+                (find(drives.begin(), drives.end(), drive) == drives.end())) {
+                drives.push_back(drive);
             }
-        } while (dbus_message_iter_next(&subiter));
-    } catch (cDeviceKitException &e) {
-        if (msg != NULL) {
-            dbus_message_unref(msg);
         }
-        throw;
+        interfaces.clear();
+        interfaces.push_back("Drive");
     }
-    // free reply and close connection
-    dbus_message_unref(msg);
+}
 
-    // An empty array of strings contains one null string, so fix this
-    if (!retval.empty()) {
-        if (retval.front().empty()) {
-            retval.clear();
+// Remember the drive of a block device announced with all its properties
+void cDbusDevkit::StoreDrive (const string &path, const CACHEENTRY &entry)
+{
+    InterfaceMap::const_iterator iit = entry.interfaces.find("Block");
+    if (iit == entry.interfaces.end()) {
+        return;
+    }
+    string drive = GetProperty(&iit->second, "Drive").GetString();
+    if ((!drive.empty()) && (drive != "/")) {
+        mBlockDrive[path] = drive;
+    }
+}
+
+/*
+ * Return the drive object of a UDisks2 block device. The mapping does not
+ * change while the block device exists, so it is queried only once.
+ */
+string cDbusDevkit::GetDrive (const cDbusService &svc, const string &path)
+{
+    {
+        lock_guard<mutex> lock(mMutex);
+        DriveMap::const_iterator it = mBlockDrive.find(path);
+        if (it != mBlockDrive.end()) {
+            return it->second;
         }
     }
-    return retval;
+    PropertyMap block;
+    GetCachedProperties(svc, path, "Block", block);
+    string drive = GetProperty(&block, "Drive").GetString();
+    if ((!drive.empty()) && (drive != "/")) {
+        lock_guard<mutex> lock(mMutex);
+        mBlockDrive[path] = drive;
+    }
+    return drive;
+}
+
+// Return true if the interface of this object is known in the cache,
+// either with its properties or as not available.
+bool cDbusDevkit::IsCached (const string &path, const string &udisk_interface)
+{
+    if (path.empty() || (path == "/")) {
+        return true;
+    }
+    lock_guard<mutex> lock(mMutex);
+    CacheMap::const_iterator cit = mPropertyCache.find(path);
+    if (cit == mPropertyCache.end()) {
+        return false;
+    }
+    return ((cit->second.complete) ||
+            (cit->second.interfaces.find(udisk_interface) !=
+                     cit->second.interfaces.end()) ||
+            (cit->second.missing.find(udisk_interface) !=
+                     cit->second.missing.end()));
+}
+
+// Store the result of a GetAll call in the cache
+void cDbusDevkit::StoreProperties (const string &path,
+                                       const string &udisk_interface,
+                                       bool available, PropertyMap &props)
+{
+    CacheMap::iterator cit = mPropertyCache.find(path);
+    if (cit == mPropertyCache.end()) {
+        cit = mPropertyCache.insert(make_pair(path, CACHEENTRY())).first;
+        cit->second.complete = false;
+    }
+    if (!available) {
+        cit->second.missing.insert(udisk_interface);
+        return;
+    }
+    cit->second.interfaces[udisk_interface] = props;
+}
+
+// Drop the cached properties of a device, e.g. after a mount
+void cDbusDevkit::ForgetDevice (const string &path)
+{
+    lock_guard<mutex> lock(mMutex);
+    mPropertyCache.erase(path);
 }
 
 /*
- * Get Integer property
+ * Return the cached properties of an interface. On a cache miss all
+ * properties of the interface are fetched with one GetAll call. A missing
+ * interface is cached as well, failed calls are not.
  */
-dbus_int32_t cDbusDevkit::GetDbusPropertyU (const string &path,
-                                               const string &name,
-                                               const string &udisk_interface,
-                                               int defaultval)
-                                               throw (cDeviceKitException)
+cDbusResult<PropertyMap> cDbusDevkit::LookupProperties (const cDbusService &svc,
+                                                           const string &path,
+                                                           const string &udisk_interface)
 {
-    DBusMessage *msg = NULL;
-    dbus_int32_t *val = NULL;
-    dbus_int32_t retval = 0;
-    DBusMessageIter subiter;
-    DBusMessageIter iter;
+    static const cDbusStatus nointerface(cDbusStatus::StatusNoInterface, "");
 
-    try {
-        msg = CallDbusProperty(path, name, &iter, udisk_interface);
-    } catch (cDeviceKitException &e) { // Ignore "No such interface"
-        return defaultval;
+    if (path.empty() || (path == "/")) { // e.g. no drive for a loop device
+        return cDbusResult<PropertyMap>(nointerface, PropertyMap());
     }
-    dbus_message_iter_recurse(&iter, &subiter);
-    int msgtype = dbus_message_iter_get_arg_type(&subiter);
-    if (msgtype != DBUS_TYPE_UINT32) {
-        mLogger->logmsg(LOGLEVEL_ERROR, "Argument is not int %c!", msgtype);
-        dbus_message_unref(msg);
-        DEVKITEXCEPTION ("Argument is not int");
+    {
+        lock_guard<mutex> lock(mMutex);
+        CacheMap::iterator cit = mPropertyCache.find(path);
+        if (cit != mPropertyCache.end()) {
+            CACHEENTRY &entry = cit->second;
+            InterfaceMap::iterator it = entry.interfaces.find(udisk_interface);
+            if (it != entry.interfaces.end()) {
+                return cDbusResult<PropertyMap>(it->second);
+            }
+            if ((entry.complete) ||
+                (entry.missing.find(udisk_interface) != entry.missing.end())) {
+                return cDbusResult<PropertyMap>(nointerface, PropertyMap());
+            }
+        }
     }
-    dbus_message_iter_get_basic(&subiter, &val);
-    retval = *val;
-    // free reply and close connection
-    dbus_message_unref(msg);
-    return retval;
+    PropertyMap props;
+    cDbusStatus status = GetAllProperties(svc, path, udisk_interface, props);
+    if (status.IsOk() ||
+        (status.GetStatus() == cDbusStatus::StatusNoInterface)) {
+        lock_guard<mutex> lock(mMutex);
+        StoreProperties(path, udisk_interface, status.IsOk(), props);
+    }
+    return cDbusResult<PropertyMap>(status, props);
+}
+
+const PropertyMap *cDbusDevkit::PeekProperties (const string &path,
+                                                    const string &udisk_interface)
+{
+    CacheMap::iterator cit = mPropertyCache.find(path);
+    if (cit == mPropertyCache.end()) {
+        return NULL;
+    }
+    InterfaceMap::iterator it = cit->second.interfaces.find(udisk_interface);
+    return (it == cit->second.interfaces.end()) ? NULL : &it->second;
+}
+
+bool cDbusDevkit::GetCachedProperties (const cDbusService &svc,
+                                           const string &path,
+                                           const string &udisk_interface,
+                                           PropertyMap &props)
+{
+    cDbusResult<PropertyMap> result = LookupProperties(svc, path,
+                                                       udisk_interface);
+    CheckStatus(result);
+    props = result.GetValue();
+    return result.IsOk();
+}
+
+cDbusResult<cDbusProperty> cDbusDevkit::FindProperty (const cDbusService &svc,
+                                                          const string &path,
+                                                          const string &name,
+                                                          const string &udisk_interface)
+{
+    cDbusResult<PropertyMap> props = LookupProperties(svc, path,
+                                                      udisk_interface);
+    if (!props.IsOk()) {
+        return cDbusResult<cDbusProperty>(props, cDbusProperty());
+    }
+    PropertyMap::const_iterator it = props.GetValue().find(name);
+    if (it == props.GetValue().end()) {
+        return cDbusResult<cDbusProperty>(
+                cDbusStatus(cDbusStatus::StatusNoProperty, name),
+                cDbusProperty());
+    }
+    return cDbusResult<cDbusProperty>(it->second);
+}
+
+// Throw an exception for a failed dbus call. A missing interface, object
+// or property is not an error.
+void cDbusDevkit::CheckStatus (const cDbusStatus &status)
+{
+    if (status.IsFailed()) {
+        DEVKITEXCEPTION(status.GetError() + " " + status.GetMessage());
+    }
+}
+
+// Return a property from a cached property map, an empty property if it
+// does not exist.
+const cDbusProperty &cDbusDevkit::GetProperty (const PropertyMap *props,
+                                                   const string &name)
+{
+    static const cDbusProperty empty;
+    if (props == NULL) {
+        return empty;
+    }
+    PropertyMap::const_iterator it = props->find(name);
+    if (it == props->end()) {
+        return empty;
+    }
+    return it->second;
 }
 
 /*
- * Get boolean property
+ * Update the property cache from a PropertiesChanged signal. Changed values
+ * are taken over, invalidated properties force a reload of the interface.
  */
-bool cDbusDevkit::GetDbusPropertyB (const string &path,
-                                       const string &name,
-                                       const string &udisk_interface,
-                                       bool defaultval)
-                                       throw (cDeviceKitException)
+void cDbusDevkit::UpdatePropertyCache (const char *path, DBusMessage *msg)
 {
-    DBusMessage *msg = NULL;
-    dbus_bool_t retval = FALSE;
-    DBusMessageIter subiter;
     DBusMessageIter iter;
+    DBusMessageIter dict;
+    char *val;
 
+    lock_guard<mutex> lock(mMutex);
+    CacheMap::iterator cit = mPropertyCache.find(path);
+    if (cit == mPropertyCache.end()) {
+        return;
+    }
+    // Interfaces may appear with this change
+    cit->second.missing.clear();
+    cit->second.complete = false;
+
+    if ((!dbus_message_iter_init(msg, &iter)) ||
+        (dbus_message_iter_get_arg_type(&iter) != DBUS_TYPE_STRING)) {
+        mPropertyCache.erase(cit);
+        return;
+    }
+    dbus_message_iter_get_basic(&iter, &val);
+    string interface = val;
+    string prefix = mService + ".";
+    if (interface.compare(0, prefix.length(), prefix) != 0) {
+        return;
+    }
+    interface.erase(0, prefix.length());
+    InterfaceMap::iterator iit = cit->second.interfaces.find(interface);
+    if (iit == cit->second.interfaces.end()) {
+        return;
+    }
     try {
-        msg = CallDbusProperty(path, name, &iter, udisk_interface);
-    } catch (cDeviceKitException &e) { // Ignore "No such interface"
-        return defaultval;
+        // Changed properties
+        if ((!dbus_message_iter_next(&iter)) ||
+            (dbus_message_iter_get_arg_type(&iter) != DBUS_TYPE_ARRAY)) {
+            DEVKITEXCEPTION("Changed properties missing");
+        }
+        DecodePropertyDict(iter, iit->second);
+        // Invalidated properties
+        if (dbus_message_iter_next(&iter) &&
+            (dbus_message_iter_get_arg_type(&iter) == DBUS_TYPE_ARRAY)) {
+            dbus_message_iter_recurse(&iter, &dict);
+            if (dbus_message_iter_get_arg_type(&dict) != DBUS_TYPE_INVALID) {
+                cit->second.interfaces.erase(iit);
+            }
+        }
+    } catch (cDeviceKitException &e) {
+        mLogger->logmsg(LOGLEVEL_WARNING, "PropertiesChanged %s", e.what());
+        mPropertyCache.erase(cit);
     }
-    dbus_message_iter_recurse(&iter, &subiter);
-    int msgtype = dbus_message_iter_get_arg_type(&subiter);
-    if (msgtype != DBUS_TYPE_BOOLEAN) {
-        mLogger->logmsg(LOGLEVEL_ERROR, "Argument is not bool %c!", msgtype);
-        dbus_message_unref(msg);
-        DEVKITEXCEPTION ("Argument is not bool");
+}
+
+void cDbusDevkit::GetDeviceProperties(const string &path,
+                                          DEVICE_PROPERTIES &props)
+{
+    cDbusService svc;
+    PropertyMap block;
+    PropertyMap fs;
+    PropertyMap drive;
+
+    // A missing interface leaves its properties empty
+    Service(svc);
+    if (svc.IsUDisks2()) {
+        GetCachedProperties(svc, path, "Block", block);
+        GetCachedProperties(svc, path, "Filesystem", fs);
+        GetCachedProperties(svc, GetDrive(svc, path), "Drive", drive);
+        DescribeDevice(true, &block, &fs, &drive, props);
+    }
+    else {
+        GetCachedProperties(svc, path, UDISKS_INTERFACE, block);
+        DescribeDevice(false, &block, NULL, NULL, props);
+    }
+}
+
+// Fill the device properties from the property maps of the interfaces,
+// only block is used for UDisks 1.
+void cDbusDevkit::DescribeDevice(bool udisks2,
+                                     const PropertyMap *block,
+                                     const PropertyMap *fs,
+                                     const PropertyMap *drive,
+                                     DEVICE_PROPERTIES &props)
+{
+    if (udisks2) {
+        props.nativePath = GetProperty(block, "PreferredDevice").GetString();
+        props.deviceFile = GetProperty(block, "Device").GetString();
+        props.type = GetProperty(block, "IdType").GetString();
+        props.uuid = GetProperty(block, "IdUUID").GetString();
+        props.label = GetProperty(block, "IdLabel").GetString();
+        props.size = GetProperty(block, "Size").GetInt();
+        props.isPartition = GetProperty(block, "HintPartitionable").GetBool();
+        props.mountPaths = GetProperty(fs, "MountPoints").GetList();
+        props.isMounted = !props.mountPaths.empty();
+        props.isOptical = (GetProperty(drive, "Media").GetString().find("optical")
+                           != string::npos);
+        props.isMediaAvailable = GetProperty(drive, "MediaAvailable").GetBool();
+    }
+    else {
+        props.nativePath = GetProperty(block, "native-path").GetString();
+        props.deviceFile = GetProperty(block, "device-file").GetString();
+        props.type = GetProperty(block, "id-type").GetString();
+        props.uuid = GetProperty(block, "id-uuid").GetString();
+        props.label = GetProperty(block, "id-label").GetString();
+        props.size = GetProperty(block, "device-size").GetInt();
+        props.isPartition = GetProperty(block, "device-is-partition").GetBool();
+        props.mountPaths = GetProperty(block, "DeviceMountPaths").GetList();
+        props.isMounted = GetProperty(block, "device-is-mounted").GetBool();
+        props.isOptical = GetProperty(block, "device-is-optical-disc").GetBool();
+        props.isMediaAvailable = GetProperty(block, "device-is-media-available").GetBool();
     }
-    dbus_message_iter_get_basic(&subiter, &retval);
-    // free reply and close connection
-    dbus_message_unref(msg);
-    return retval;
 }
 
 string cDbusDevkit::AutoMount(const string path)
-    throw (cDeviceKitException)
 {
     DBusMessage *msg = NULL;
     DBusMessage *getmsg = NULL;
@@ -736,24 +1939,20 @@ string cDbusDevkit::AutoMount(const string path)
     int argcnt = 0;
     string retval;
     string interface;
+    cDbusService svc;
 
+    Service(svc);
     try {
-        if (mUDisk2) {
-            interface = mService + "." + "Filesystem";
+        if (svc.IsUDisks2()) {
+            interface = svc.GetName() + "." + "Filesystem";
 
-            getmsg = dbus_message_new_method_call(mService.c_str(), // target for the method call
+            getmsg = dbus_message_new_method_call(svc.GetName().c_str(), // target for the method call
                     path.c_str(),           // object to call on
                     interface.c_str(),      // interface to call on
                     "Mount");            // method name
             if (getmsg == NULL) {
                 DEVKITEXCEPTION("dbus_message_new_method_call Message Null");
             }
-            if (dbus_error_is_set(&mErr)) {
-                string errmsg = "dbus_message_new_method_call failed ";
-                errmsg += mErr.message;
-                dbus_error_free(&mErr);
-                DEVKITEXCEPTION(errmsg);
-            }
             DBusMessageIter iter1, dict;
 
             dbus_message_iter_init_append(getmsg, &iter1 );
@@ -765,32 +1964,18 @@ string cDbusDevkit::AutoMount(const string path)
                     &dict );
 
             dbus_message_iter_close_container(&iter1, &dict);
-            dbus_error_init(&mErr);
-            msg = dbus_connection_send_with_reply_and_block(mConnSystem, getmsg,
-                    -1, &mErr);
-            if (dbus_error_is_set(&mErr)) {
-                string errmsg = "dbus_connection_send_with_reply failed ";
-                errmsg += mErr.message;
-                dbus_error_free(&mErr);
-                DEVKITEXCEPTION(errmsg);
-            }
+            msg = Call(svc, getmsg);
         }
         else {
-            interface = mService + "." + UDISKS_INTERFACE;
+            interface = svc.GetName() + "." + UDISKS_INTERFACE;
 
-            getmsg = dbus_message_new_method_call(mService.c_str(), // target for the method call
+            getmsg = dbus_message_new_method_call(svc.GetName().c_str(), // target for the method call
                     path.c_str(),           // object to call on
                     interface.c_str(),      // interface to call on
                     "FilesystemMount");            // method name
             if (getmsg == NULL) {
                 DEVKITEXCEPTION("dbus_message_new_method_call Message Null");
             }
-            if (dbus_error_is_set(&mErr)) {
-                string errmsg = "dbus_message_new_method_call failed ";
-                errmsg += mErr.message;
-                dbus_error_free(&mErr);
-                DEVKITEXCEPTION(errmsg);
-            }
 
             if (! dbus_message_append_args(getmsg, DBUS_TYPE_STRING, &fs_type,
                     DBUS_TYPE_ARRAY, DBUS_TYPE_STRING, opts, &argcnt,
@@ -798,14 +1983,7 @@ string cDbusDevkit::AutoMount(const string path)
                 DEVKITEXCEPTION("dbus_message_append_args failed ");
             }
         }
-        msg = dbus_connection_send_with_reply_and_block(mConnSystem, getmsg,
-                                                        -1, &mErr);
-        if (dbus_error_is_set(&mErr)) {
-            string errmsg = "dbus_connection_send_with_reply failed ";
-            errmsg += mErr.message;
-            dbus_error_free(&mErr);
-            DEVKITEXCEPTION(errmsg);
-        }
+        msg = Call(svc, getmsg);
 
         DBusMessageIter args;
         // read the parameters
@@ -834,18 +2012,19 @@ string cDbusDevkit::AutoMount(const string path)
 
     retval = val;
     dbus_message_unref(msg);
+    ForgetDevice(path);
     return retval;
 }
 
-void cDbusDevkit::CallInterfaceV(const string &path,
+void cDbusDevkit::CallInterfaceV(const cDbusService &svc,
+                                 const string &path,
                                  const string &name,
                                  const string &interface)
-    throw (cDeviceKitException)
 {
     DBusMessage *msg, *getmsg;
     char *dbusarr[] = {};
 
-    getmsg = dbus_message_new_method_call(mService.c_str(),   // target for the method call
+    getmsg = dbus_message_new_method_call(svc.GetName().c_str(),   // target for the method call
                                        path.c_str(),          // object to call on
                                        interface.c_str(),     // interface to call on
                                        name.c_str());         // method name
@@ -856,111 +2035,126 @@ void cDbusDevkit::CallInterfaceV(const string &path,
     dbus_message_append_args (getmsg,
                            DBUS_TYPE_ARRAY, DBUS_TYPE_STRING, dbusarr, 0,
                            DBUS_TYPE_INVALID);
-    msg = dbus_connection_send_with_reply_and_block(mConnSystem, getmsg,
-                                                          -1,  &mErr);
-    if (dbus_error_is_set(&mErr)) {
-        string errmsg = "dbus_connection_send_with_reply failed";
-        errmsg += mErr.message;
-        dbus_error_free(&mErr);
-        DEVKITEXCEPTION(errmsg);
-    }
+    msg = Call(svc, getmsg);
 
     dbus_message_unref (msg);
 }
 
-bool cDbusDevkit::IsMediaAvailable(const string &path)
-                                                    throw (cDeviceKitException) {
-    if (mUDisk2) {
-        string drive = GetDbusPropertyS (path, "Drive", "Block");
-        return GetDbusPropertyB (drive, "MediaAvailable", "Drive");
+bool cDbusDevkit::IsMediaAvailable(const string &path) {
+    cDbusService svc;
+
+    Service(svc);
+    if (svc.IsUDisks2()) {
+        string drive = GetDrive(svc, path);
 #ifdef DEBUG
   mLogger->logmsg(LOGLEVEL_INFO, "Drive %s", drive.c_str());
 #endif
-        return false;
+        return GetDbusPropertyB (svc, drive, "MediaAvailable", "Drive");
     }
-    return GetDbusPropertyB (path, "device-is-media-available", UDISKS_INTERFACE);
+    return GetDbusPropertyB (svc, path, "device-is-media-available", UDISKS_INTERFACE);
 }
 
-bool cDbusDevkit::IsPartition(const string &path)
-                                                    throw (cDeviceKitException) {
-    if (mUDisk2) {
-        return GetDbusPropertyB (path, "HintPartitionable", "Block");
+bool cDbusDevkit::IsPartition(const string &path) {
+    cDbusService svc;
+
+    Service(svc);
+    if (svc.IsUDisks2()) {
+        return GetDbusPropertyB (svc, path, "HintPartitionable", "Block");
     }
-    return GetDbusPropertyB (path, "device-is-partition", UDISKS_INTERFACE);
+    return GetDbusPropertyB (svc, path, "device-is-partition", UDISKS_INTERFACE);
 }
 
-string cDbusDevkit::GetNativePath (const string &path)
-                                                     throw (cDeviceKitException) {
-    if (mUDisk2) {
-        return GetDbusPropertyS (path, "PreferredDevice", "Block");
+string cDbusDevkit::GetNativePath (const string &path) {
+    cDbusService svc;
+
+    Service(svc);
+    if (svc.IsUDisks2()) {
+        return GetDbusPropertyS (svc, path, "PreferredDevice", "Block");
     }
-    return GetDbusPropertyS (path, "native-path", UDISKS_INTERFACE);
+    return GetDbusPropertyS (svc, path, "native-path", UDISKS_INTERFACE);
 }
 
-bool cDbusDevkit::IsOpticalDisk(const string &path)
-                                                    throw (cDeviceKitException) {
-    if (mUDisk2) {
-        string drive = GetDbusPropertyS (path, "Drive", "Block");
-        string media = GetDbusPropertyS (drive, "Media", "Drive");
+bool cDbusDevkit::IsOpticalDisk(const string &path) {
+    cDbusService svc;
+
+    Service(svc);
+    if (svc.IsUDisks2()) {
+        string drive = GetDrive(svc, path);
+        string media = GetDbusPropertyS (svc, drive, "Media", "Drive");
 #ifdef DEBUG
   mLogger->logmsg(LOGLEVEL_INFO, "IsOpticalDisk %s", media.c_str());
 #endif
         return (media.find("optical") != string::npos);
     }
-    return GetDbusPropertyB (path, "device-is-optical-disc", UDISKS_INTERFACE);
+    return GetDbusPropertyB (svc, path, "device-is-optical-disc", UDISKS_INTERFACE);
 }
 
-stringList cDbusDevkit::GetMountPaths (const string &path)
-                                                    throw (cDeviceKitException) {
-    if (mUDisk2) {
-        stringList mountpoints = GetDbusPropertyAS (path, "MountPoints", "Filesystem");
+stringList cDbusDevkit::GetMountPaths (const string &path) {
+    cDbusService svc;
+
+    Service(svc);
+    if (svc.IsUDisks2()) {
+        stringList mountpoints = GetDbusPropertyAS (svc, path, "MountPoints", "Filesystem");
         return (mountpoints);
     }
-    return GetDbusPropertyAS (path, "DeviceMountPaths", UDISKS_INTERFACE);
+    return GetDbusPropertyAS (svc, path, "DeviceMountPaths", UDISKS_INTERFACE);
 }
-bool cDbusDevkit::IsMounted(const string &path)
-                                                    throw (cDeviceKitException){
-    if (mUDisk2) {
+bool cDbusDevkit::IsMounted(const string &path){
+    cDbusService svc;
+
+    Service(svc);
+    if (svc.IsUDisks2()) {
         return !GetMountPaths(path).empty();
     }
-    return GetDbusPropertyB (path, "device-is-mounted", UDISKS_INTERFACE);
+    return GetDbusPropertyB (svc, path, "device-is-mounted", UDISKS_INTERFACE);
 }
 
-stringList cDbusDevkit::GetDeviceFileById (const string &path)
-                throw (cDeviceKitException) {
-    if (mUDisk2) {
-        return GetDbusPropertyAS (path, "Id", "Block");
+stringList cDbusDevkit::GetDeviceFileById (const string &path) {
+    cDbusService svc;
+
+    Service(svc);
+    if (svc.IsUDisks2()) {
+        return GetDbusPropertyAS (svc, path, "Id", "Block");
     }
-    return GetDbusPropertyAS (path, "device-file-by-id", UDISKS_INTERFACE);
+    return GetDbusPropertyAS (svc, path, "device-file-by-id", UDISKS_INTERFACE);
 }
-stringList cDbusDevkit::GetDeviceFileByPath (const string &path)
-                                                    throw (cDeviceKitException) {
-    if (mUDisk2) {
-        return GetDbusPropertyAS (path, "Device", "Block");
+stringList cDbusDevkit::GetDeviceFileByPath (const string &path) {
+    cDbusService svc;
+
+    Service(svc);
+    if (svc.IsUDisks2()) {
+        return GetDbusPropertyAS (svc, path, "Device", "Block");
     }
-    return GetDbusPropertyAS (path, "device-file-by-path", UDISKS_INTERFACE);
+    return GetDbusPropertyAS (svc, path, "device-file-by-path", UDISKS_INTERFACE);
 }
 
-string cDbusDevkit::GetDeviceFile (const string &path)
-                                                   throw (cDeviceKitException) {
-    if (mUDisk2) {
-        return GetDbusPropertyS (path, "Device", "Block");
+string cDbusDevkit::GetDeviceFile (const string &path) {
+    cDbusService svc;
+
+    Service(svc);
+    if (svc.IsUDisks2()) {
+        return GetDbusPropertyS (svc, path, "Device", "Block");
     }
-    return GetDbusPropertyS (path, "device-file", UDISKS_INTERFACE);
+    return GetDbusPropertyS (svc, path, "device-file", UDISKS_INTERFACE);
 }
 
-string cDbusDevkit::GetType (const string &path) throw (cDeviceKitException) {
-    if (mUDisk2) {
-        return GetDbusPropertyS (path, "IdType", "Block");
+string cDbusDevkit::GetType (const string &path) {
+    cDbusService svc;
+
+    Service(svc);
+    if (svc.IsUDisks2()) {
+        return GetDbusPropertyS (svc, path, "IdType", "Block");
     }
-    return GetDbusPropertyS (path, "id-type", UDISKS_INTERFACE);
+    return GetDbusPropertyS (svc, path, "id-type", UDISKS_INTERFACE);
 }
 
-void cDbusDevkit::UnMount (const std::string &path)
-                  throw (cDeviceKitException) {
+void cDbusDevkit::UnMount (const std::string &path) {
+    cDbusService svc;
 
-    if (mUDisk2) {
-        CallInterfaceV (path, "Unmount", "Filesystem");
+    Service(svc);
+    ForgetDevice(path);
+    if (svc.IsUDisks2()) {
+        CallInterfaceV (svc, path, "Unmount", "Filesystem");
     }
-    CallInterfaceV (path, "FilesystemUnmount", UDISKS_INTERFACE);
+    CallInterfaceV (svc, path, "FilesystemUnmount", UDISKS_INTERFACE);
 }
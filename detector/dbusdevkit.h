@@ -16,67 +16,256 @@
 #include <string>
 #include <string.h>
 #include <list>
+#include <mutex>
+#include <atomic>
 #include <exception>
 #include <stdio.h>
 #include "logger.h"
 #include "stdtypes.h"
+#include "devicebackend.h"
 
-#define DEVKITEXCEPTION(t) throw cDeviceKitException(__FILE__, __LINE__,(t))
+// Value of a single dbus property as returned by Properties.Get/GetAll.
+// Strings, object paths and byte strings are stored as string, arrays of
+// them as string list.
+class cDbusProperty {
+public:
+    typedef enum {
+        PropertyNone,
+        PropertyString,
+        PropertyStringList,
+        PropertyBool,
+        PropertyInt
+    } PROPERTY_TYPE;
 
-class cDeviceKitException : private std::exception
-{
 private:
-    std::string mErrTxt;
+    PROPERTY_TYPE mType;
+    std::string mString;
+    stringList mList;
+    dbus_uint64_t mInt;
+    bool mBool;
+
+public:
+    cDbusProperty() : mType(PropertyNone), mInt(0), mBool(false) {};
+    void SetString(const std::string &s) { mType = PropertyString; mString = s; }
+    void SetList(const stringList &l) { mType = PropertyStringList; mList = l; }
+    // Empty value of the given type to be filled by the decoder
+    std::string &NewString(void) {
+        mType = PropertyString;
+        mString.clear();
+        return mString;
+    }
+    stringList &NewList(void) {
+        mType = PropertyStringList;
+        mList.clear();
+        return mList;
+    }
+    void SetBool(bool b) { mType = PropertyBool; mBool = b; }
+    void SetInt(dbus_uint64_t i) { mType = PropertyInt; mInt = i; }
+    PROPERTY_TYPE GetType(void) const { return mType; }
+    std::string GetString(void) const;
+    stringList GetList(void) const;
+    bool GetBool(void) const { return (mType == PropertyBool) && mBool; }
+    dbus_uint64_t GetInt(void) const {
+        return (mType == PropertyInt) ? mInt : 0;
+    }
+};
+
+typedef std::map<std::string, cDbusProperty> PropertyMap;
 
+typedef std::map<std::string, PropertyMap> InterfaceMap;
+
+// Decoding of dbus arguments into C++ types. Variants are unwrapped, byte
+// arrays are read as (zero terminated) string and arrays are appended to the
+// container of the caller. Returns false if the argument has another type.
+class cDbusDecoder {
 public:
-    cDeviceKitException (const char *errtxt) : mErrTxt(errtxt) {};
-    cDeviceKitException (const std::string errtxt) : mErrTxt(errtxt) {};
-    cDeviceKitException (const char *file, int line, const std::string errtxt);
+    template <class T> static bool GetProperty (DBusMessageIter &iter,
+                                                  T &value);
 
-    virtual ~cDeviceKitException () throw () {};
-    virtual const char *what(void) const throw () {
-        return (mErrTxt.c_str());
+private:
+    // Iterator of the value, recursed into a variant if needed
+    static DBusMessageIter *Unwrap (DBusMessageIter &iter,
+                                      DBusMessageIter &variant);
+};
+
+// Strings, object paths, byte arrays or the first element of an array of
+// byte arrays
+template <> bool cDbusDecoder::GetProperty (DBusMessageIter &iter,
+                                              std::string &value);
+// Arrays of strings, object paths or byte arrays, empty elements are skipped
+template <> bool cDbusDecoder::GetProperty (DBusMessageIter &iter,
+                                              stringList &value);
+template <> bool cDbusDecoder::GetProperty (DBusMessageIter &iter,
+                                              bool &value);
+// All integer types
+template <> bool cDbusDecoder::GetProperty (DBusMessageIter &iter,
+                                              dbus_uint64_t &value);
+
+// Handle of an asynchronous dbus call. The caller blocks only when the
+// reply is fetched, so several calls can be in flight at the same time.
+class cDbusPendingCall {
+private:
+    DBusPendingCall *mCall;
+    DBusMessage *mReply;
+
+    cDbusPendingCall(const cDbusPendingCall &);
+    cDbusPendingCall &operator=(const cDbusPendingCall &);
+
+public:
+    cDbusPendingCall(DBusPendingCall *call) : mCall(call), mReply(NULL) {};
+    ~cDbusPendingCall();
+    // Wait for the reply, which is owned by this object.
+    DBusMessage *GetReply(DBusError *err);
+    bool IsCompleted(void) {
+        return (mCall == NULL) || dbus_pending_call_get_completed(mCall);
     }
 };
 
-class cDbusDevkit {
+// Outcome of a dbus call. A missing interface is a regular result for many
+// devices (e.g. no file system on an audio CD), so it is reported as status
+// and exceptions are left for real failures.
+class cDbusStatus {
 public:
     typedef enum {
-        DeviceAdded,
-        DeviceRemoved,
-        DeviceChanged,
-        Unkown
-    } DEVICE_SIGNAL;
+        StatusOk,
+        StatusNoInterface, // The object does not implement the interface
+        StatusNoObject,    // The object does not exist (any more)
+        StatusNoProperty,  // The interface has no such property
+        StatusFailed       // Any other error
+    } STATUS;
+
+private:
+    STATUS mStatus;
+    std::string mError;
+    std::string mMessage;
+
+public:
+    cDbusStatus() : mStatus(StatusOk) {};
+    cDbusStatus(STATUS status, const std::string &message)
+        : mStatus(status), mMessage(message) {};
+    // Classify a dbus error by its name
+    cDbusStatus(const DBusError &err);
+    STATUS GetStatus(void) const { return mStatus; }
+    bool IsOk(void) const { return mStatus == StatusOk; }
+    bool IsFailed(void) const { return mStatus == StatusFailed; }
+    // Name of the dbus error and its message
+    const std::string &GetError(void) const { return mError; }
+    const std::string &GetMessage(void) const { return mMessage; }
+};
 
+// Value of a dbus call together with its status
+template <class T> class cDbusResult : public cDbusStatus {
+private:
+    T mValue;
+
+public:
+    cDbusResult(const T &value) : mValue(value) {};
+    cDbusResult(const cDbusStatus &status, const T &value)
+        : cDbusStatus(status), mValue(value) {};
+    const T &GetValue(void) const { return mValue; }
+};
+
+// Connection and disk service used by the calls of one method. The
+// connection is referenced, so it stays valid when the bus is dropped by the
+// thread reading the signals in the meantime, the calls fail then.
+class cDbusService {
+private:
+    DBusConnection *mConn;
+    std::string mName;
+    std::string mObjectPath;
+    bool mUDisk2;
+
+    cDbusService(const cDbusService &);
+    cDbusService &operator=(const cDbusService &);
+
+public:
+    cDbusService() : mConn(NULL), mUDisk2(false) {};
+    ~cDbusService() {
+        if (mConn != NULL) {
+            dbus_connection_unref(mConn);
+        }
+    }
+    void Set(DBusConnection *conn, const std::string &name,
+             const std::string &objectpath, bool udisks2);
+    DBusConnection *GetConnection(void) const { return mConn; }
+    const std::string &GetName(void) const { return mName; }
+    const std::string &GetObjectPath(void) const { return mObjectPath; }
+    bool IsUDisks2(void) const { return mUDisk2; }
+};
+
+// The methods may be called from several threads at the same time and
+// while another thread waits for the signals in WaitDevkit. The signals
+// are read from a connection of their own, the calls share a second
+// connection, which is used by libdbus without the event loop.
+class cDbusDevkit : public cDeviceBackend {
+public:
     cDbusDevkit(cLogger *logger);
-    ~cDbusDevkit();
-    bool WaitDevkit(int timeout, std::string &retpath, DEVICE_SIGNAL &signal);
+    virtual ~cDbusDevkit();
 
-    std::string FindDeviceByDeviceFile (const std::string device)
-                                                throw (cDeviceKitException);
-    stringList EnumerateDevices (void) throw (cDeviceKitException);
+    std::string FindDeviceByDeviceFile (const std::string device);
+    stringList EnumerateDevices (void);
     // Do automount and return mount path
-    std::string AutoMount(const std::string path) throw (cDeviceKitException);
-    void UnMount (const std::string &path) throw (cDeviceKitException);
-    std::string GetNativePath (const std::string &path)
-                                   throw (cDeviceKitException) ;
-
-    std::string GetType (const std::string &path) throw (cDeviceKitException);
-    std::string GetDeviceFile (const std::string &path)
-                                           throw (cDeviceKitException);
-    stringList GetDeviceFileById (const std::string &path)
-                                            throw (cDeviceKitException);
-    stringList GetDeviceFileByPath (const std::string &path)
-                                             throw (cDeviceKitException);
-    stringList GetMountPaths (const std::string &path) throw (cDeviceKitException);
-    bool IsMounted(const std::string &path) throw (cDeviceKitException);
-    bool IsOpticalDisk(const std::string &path) throw (cDeviceKitException);
-    bool IsPartition(const std::string &path) throw (cDeviceKitException);
-    bool IsMediaAvailable(const std::string &path) throw (cDeviceKitException);
-  private:
+    std::string AutoMount(const std::string path);
+    void UnMount (const std::string &path);
+    std::string GetNativePath (const std::string &path) ;
+
+    std::string GetType (const std::string &path);
+    std::string GetDeviceFile (const std::string &path);
+    stringList GetDeviceFileById (const std::string &path);
+    stringList GetDeviceFileByPath (const std::string &path);
+    stringList GetMountPaths (const std::string &path);
+    bool IsMounted(const std::string &path);
+    bool IsOpticalDisk(const std::string &path);
+    bool IsPartition(const std::string &path);
+    bool IsMediaAvailable(const std::string &path);
+    // Fetch all properties needed for a media description with one
+    // GetAll call per interface.
+    void GetDeviceProperties(const std::string &path, DEVICE_PROPERTIES &props);
+    // Fill the property cache for several devices with pipelined calls
+    void PrefetchProperties(const stringList &paths);
+    void SetCallTimeout(int timeout) { mCallTimeout = timeout; }
+    // Asynchronous GetAll, the reply is decoded by GetAllPropertiesReply
+    cDbusPendingCall *GetAllPropertiesAsync (const cDbusService &svc,
+                                               const std::string &path,
+                                               const std::string &udisk_interface);
+    cDbusStatus GetAllPropertiesReply (cDbusPendingCall *call, PropertyMap &props);
+
+protected:
+    bool Connect (void);
+    bool ReadSignal (int timeout, DEVICE_EVENT &event);
+
+private:
+    typedef std::list<DBusWatch *> WatchList;
+    typedef struct {
+        DBusTimeout *timeout;
+        long long start;
+    } TIMEOUT;
+    typedef std::list<TIMEOUT> TimeoutList;
+
+    // Signals, used by the thread reading them only
     DBusConnection *mConnSystem;
+    // Method calls of all threads
+    DBusConnection *mConnCalls;
+    // Protects the connections, the disk service, the property cache and
+    // the drives of the block devices. Not held during a call on the bus.
+    std::mutex mMutex;
+    // The signals are read, from now on the thread reading them connects
+    // to the bus and finds the disk service.
+    std::atomic<bool> mReading;
+    // Keeps a connection made by an early call apart from the first
+    // connection of the thread reading the signals
+    std::mutex mConnectMutex;
+    // Delay in ms before the next attempt to connect to the bus
+    static const int MIN_BUS_BACKOFF = 1000;
+    static const int MAX_BUS_BACKOFF = 30000;
+    int mBusBackoff;
+    long long mNextBusAttempt;
+    // Time limit of a call in ms, 0 for the default of libdbus
+    int mCallTimeout;
+    std::map<int, WatchList> mWatches;
+    TimeoutList mTimeouts;
+    // Errors of connecting and finding the service, calls use their own
     DBusError mErr;
-    cLogger *mLogger;
     bool mUDisk2;
 
     static const char *DBUS_NAME;
@@ -90,58 +279,140 @@ public:
     static const std::string UDISKS_SERVICE2;
     static const std::string UDISKS_OBJECT2;
     static const std::string UDISKS_OBJECT2_DEV;
+    static const char *OBJECTMANAGER_INTERFACE;
+    static const char *PROPERTIES_INTERFACE;
 
 
     std::string mService;
     std::string mObjectPath;
+    // Match rules for the signals of the service
+    stringList mServiceRules;
+    // Probe for a disk service on the next WaitConn
+    bool mProbeService;
+    // The service disappeared, devices are compared when it is back
+    bool mServiceLost;
+    std::map<std::string, DEVICE_PROPERTIES> mLostDevices;
+    std::list<DEVICE_EVENT> mServiceEvents;
 
-    std::string GetString(DBusMessageIter &subiter)
-                                        throw (cDeviceKitException);
-    DBusMessage *CallDbusProperty (const std::string &path,
-                                     const std::string &name,
-                                     DBusMessageIter *iter,
-                                     const std::string &udisk_interface)
-                                     throw (cDeviceKitException);
+    // Property cache per object path, updated by PropertiesChanged signals
+    typedef struct {
+        InterfaceMap interfaces; // Properties of the available interfaces
+        stringSet missing;       // Interfaces not available for the object
+        bool complete;           // All interfaces of the object are known
+    } CACHEENTRY;
+    typedef std::map<std::string, CACHEENTRY> CacheMap;
+    CacheMap mPropertyCache;
+
+    // Drive object of the UDisks2 block devices
+    typedef std::map<std::string, std::string> DriveMap;
+    DriveMap mBlockDrive;
 
     // Property string (or array of byte)
-    std::string GetDbusPropertyS (const std::string &path,
+    std::string GetDbusPropertyS (const cDbusService &svc,
+                                    const std::string &path,
                                     const std::string &name,
-                                    const std::string &udisk_interface)
-                                    throw (cDeviceKitException);
+                                    const std::string &udisk_interface);
     // Property as (String Array)
-    stringList GetDbusPropertyAS (const std::string &path,
+    stringList GetDbusPropertyAS (const cDbusService &svc,
+                                     const std::string &path,
                                      const std::string &name,
-                                     const std::string &udisk_interface)
-                                     throw (cDeviceKitException);
+                                     const std::string &udisk_interface);
     // Property integer
-    dbus_int32_t GetDbusPropertyU (const std::string &path,
+    dbus_int32_t GetDbusPropertyU (const cDbusService &svc,
+                                     const std::string &path,
                                      const std::string &name,
                                      const std::string &udisk_interface,
-                                     int defaultval = -1)
-                                     throw (cDeviceKitException);
+                                     int defaultval = -1);
     // Property boolean
-    bool GetDbusPropertyB (const std::string &path,
+    bool GetDbusPropertyB (const cDbusService &svc,
+                              const std::string &path,
                               const std::string &name,
                               const std::string &udisk_interface,
-                              bool defaultval = false)
-                              throw (cDeviceKitException);
-    bool WaitConn (void) throw (cDeviceKitException);
+                              bool defaultval = false);
+    // All properties of an interface
+    cDbusStatus GetAllProperties (const cDbusService &svc,
+                                    const std::string &path,
+                                    const std::string &udisk_interface,
+                                    PropertyMap &props);
+    void DecodeProperty (DBusMessageIter &iter, cDbusProperty &prop);
+    void DecodePropertyDict (DBusMessageIter &iter, PropertyMap &props);
+    void DecodeInterfaceDict (DBusMessageIter &iter, const std::string &service,
+                                CACHEENTRY &entry);
+    // The cache may be changed by another thread, so the properties are
+    // returned as copy.
+    cDbusResult<PropertyMap> LookupProperties (const cDbusService &svc,
+                                                 const std::string &path,
+                                                 const std::string &udisk_interface);
+    // Cached properties, false if the interface is not available. Throws
+    // only on a failed dbus call.
+    bool GetCachedProperties (const cDbusService &svc,
+                                const std::string &path,
+                                const std::string &udisk_interface,
+                                PropertyMap &props);
+    cDbusResult<cDbusProperty> FindProperty (const cDbusService &svc,
+                                               const std::string &path,
+                                               const std::string &name,
+                                               const std::string &udisk_interface);
+    void CheckStatus (const cDbusStatus &status);
+    static const cDbusProperty &GetProperty (const PropertyMap *props,
+                                               const std::string &name);
+    // Properties already in the cache, NULL if not cached. Makes no call,
+    // mMutex must be held.
+    const PropertyMap *PeekProperties (const std::string &path,
+                                         const std::string &udisk_interface);
+    static void DescribeDevice (bool udisks2, const PropertyMap *block,
+                                  const PropertyMap *fs,
+                                  const PropertyMap *drive,
+                                  DEVICE_PROPERTIES &props);
+    bool IsCached (const std::string &path, const std::string &udisk_interface);
+    // mMutex must be held
+    void StoreDrive (const std::string &path, const CACHEENTRY &entry);
+    std::string GetDrive (const cDbusService &svc, const std::string &path);
+    // mMutex must be held
+    void StoreProperties (const std::string &path,
+                            const std::string &udisk_interface,
+                            bool available, PropertyMap &props);
+    void ForgetDevice (const std::string &path);
+    int CallTimeout (void);
+    cDbusPendingCall *CallAsync (const cDbusService &svc, DBusMessage *getmsg);
+    // Connection and disk service for the calls of a method, throws if
+    // no disk service is available.
+    void Service (cDbusService &svc);
+    // Call a method and wait for the reply, which must be unreferenced
+    // by the caller. Throws if the call failed.
+    DBusMessage *Call (const cDbusService &svc, DBusMessage *getmsg);
+    void UpdatePropertyCache (const char *path, DBusMessage *msg);
+    DEVICE_SIGNAL DecodeInterfaceSignal (DBusMessage *msg, bool added,
+                                           DEVICE_EVENT &event);
+    bool WaitIo (int timeout);
+    bool UpdateWatch (int fd);
+    static dbus_bool_t AddWatch (DBusWatch *watch, void *data);
+    static void RemoveWatch (DBusWatch *watch, void *data);
+    static void ToggleWatch (DBusWatch *watch, void *data);
+    static dbus_bool_t AddTimeout (DBusTimeout *timeout, void *data);
+    static void RemoveTimeout (DBusTimeout *timeout, void *data);
+    static void ToggleTimeout (DBusTimeout *timeout, void *data);
+    bool WaitConn (void);
+    bool ConnectBus (void);
+    void DisconnectBus (void);
+    bool FindService (void);
+    void ServiceLost (void);
+    void ServiceRestarted (void);
+    void NameOwnerChanged (DBusMessage *msg);
+    bool AddMatch (const std::string &rule);
 
 
     // Call an interface method which does not return a value
-    void CallInterfaceV(const std::string &path,
+    void CallInterfaceV(const cDbusService &svc,
+                        const std::string &path,
                         const std::string &name,
-                        const std::string &interface)
-                           throw (cDeviceKitException);
+                        const std::string &interface);
 
     // Start a dbus service
     bool StartService(const std::string &name);
 
     // Udisks2 stuff
-    // Optimistic ;-) xml parser
-    char *getXML(char **val, const char *tag);
-
-    stringList EnumerateDevices2 (void) throw (cDeviceKitException);
+    stringList EnumerateDevices2 (const cDbusService &svc);
 };
 
 #endif /* DBUSDEVKIT_H_ */
@@ -0,0 +1,313 @@
+/*
+ * detectionpool.cc: Worker threads detecting the media of several devices
+ *                   in parallel.
+ *
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * This code is distributed under the terms and conditions of the
+ * GNU GENERAL PUBLIC LICENSE. See the file COPYING for details.
+ */
+
+#include "detectionpool.h"
+
+using namespace std;
+
+cDetectionPool::cDetectionPool(cLogger *logger, cDetectionHandler *handler)
+{
+    mLogger = logger;
+    mHandler = handler;
+    mStopping = false;
+    mNextSeq = 0;
+    mNextGroup = 0;
+    for (int i = 0; i < cCancelToken::STAGE_COUNT; i++) {
+        mTimeouts.stage[i] = 0;
+    }
+}
+
+cDetectionPool::~cDetectionPool()
+{
+    Stop();
+}
+
+void cDetectionPool::Start(int workers)
+{
+    if (workers < 1) {
+        workers = 1;
+    }
+    mStopping = false;
+    for (int i = 0; i < workers; i++) {
+        mWorkers.push_back(thread(&cDetectionPool::Worker, this));
+    }
+}
+
+void cDetectionPool::Stop(void)
+{
+    {
+        lock_guard<mutex> lock(mMutex);
+        mStopping = true;
+        mJobs.clear();
+        map<DEVICE_ID, shared_ptr<cCancelToken> >::iterator rt;
+        for (rt = mRunning.begin(); rt != mRunning.end(); rt++) {
+            rt->second->Cancel();
+        }
+    }
+    mJobsChanged.notify_all();
+    mResultsChanged.notify_all();
+    vector<thread>::iterator it;
+    for (it = mWorkers.begin(); it != mWorkers.end(); it++) {
+        it->join();
+    }
+    mWorkers.clear();
+}
+
+unsigned int cDetectionPool::NewGroup(void)
+{
+    lock_guard<mutex> lock(mMutex);
+    return mNextGroup++;
+}
+
+void cDetectionPool::Submit(const cMediaHandle &mediainfo, JOB_TYPE type,
+                               unsigned int group)
+{
+    JOB job;
+    job.type = type;
+    job.result.group = group;
+    job.token = make_shared<cCancelToken>(mTimeouts);
+    job.result.mediainfo = mediainfo;
+    job.result.mediainfo.SetCancelToken(job.token);
+    job.result.found = false;
+    {
+        lock_guard<mutex> lock(mMutex);
+        job.seq = mNextSeq++;
+        OPEN &open = mOpen[job.seq];
+        open.id = mediainfo.GetId();
+        open.group = group;
+        open.type = type;
+        mGroupJobs[group]++;
+        mJobs.push_back(job);
+    }
+    mJobsChanged.notify_all();
+}
+
+void cDetectionPool::Detect(const cMediaHandle &mediainfo, unsigned int group)
+{
+    Submit(mediainfo, JOB_DETECT, group);
+}
+
+void cDetectionPool::Revalidate(const cMediaHandle &mediainfo)
+{
+    Submit(mediainfo, JOB_REVALIDATE, NewGroup());
+}
+
+void cDetectionPool::Remove(const cMediaHandle &mediainfo)
+{
+    DEVICE_ID id = mediainfo.GetId();
+    {
+        lock_guard<mutex> lock(mMutex);
+        JobQueue::iterator it = mJobs.begin();
+        while (it != mJobs.end()) {
+            if ((it->type != JOB_REMOVE) &&
+                (it->result.mediainfo.GetId() == id)) {
+                mDone[it->seq] = *it;
+                it = mJobs.erase(it);
+            }
+            else {
+                it++;
+            }
+        }
+        map<DEVICE_ID, shared_ptr<cCancelToken> >::iterator rt;
+        rt = mRunning.find(id);
+        if (rt != mRunning.end()) {
+            rt->second->Cancel();
+        }
+    }
+    mResultsChanged.notify_all();
+    Submit(mediainfo, JOB_REMOVE, NewGroup());
+}
+
+// Only groups with jobs left are remembered, a group is forgotten with the
+// result of its last job.
+void cDetectionPool::Discard(unsigned int group)
+{
+    lock_guard<mutex> lock(mMutex);
+    if (mGroupJobs.find(group) != mGroupJobs.end()) {
+        mDiscarded.insert(group);
+    }
+}
+
+bool cDetectionPool::HasJobs(DEVICE_ID id)
+{
+    lock_guard<mutex> lock(mMutex);
+    map<unsigned long, OPEN>::iterator it;
+    for (it = mOpen.begin(); it != mOpen.end(); it++) {
+        if (it->second.id == id) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * Take the first job of a device without a running job. Jobs of discarded
+ * groups are finished without running them. Must be called with the mutex
+ * held.
+ */
+bool cDetectionPool::TakeJob(JOB &job)
+{
+    cDeviceSet skipped;
+    JobQueue::iterator it = mJobs.begin();
+    while (it != mJobs.end()) {
+        DEVICE_ID id = it->result.mediainfo.GetId();
+        if ((it->type != JOB_REMOVE) &&
+            (mDiscarded.find(it->result.group) != mDiscarded.end())) {
+            mDone[it->seq] = *it;
+            it = mJobs.erase(it);
+            continue;
+        }
+        // Keep the order of the jobs of one device
+        if (mBusy.Contains(id) || skipped.Contains(id)) {
+            skipped.Insert(id);
+            it++;
+            continue;
+        }
+        job = *it;
+        mJobs.erase(it);
+        mBusy.Insert(id);
+        if (job.type != JOB_REMOVE) {
+            mRunning[id] = job.token;
+        }
+        return true;
+    }
+    return false;
+}
+
+/*
+ * Find the next result to return. A result waits for the results of the
+ * earlier jobs of its device and of its group, e.g. the devices of a manual
+ * scan are reported in the order of the scan. Revalidations neither wait
+ * nor hold back other results. Must be called with the mutex held.
+ */
+bool cDetectionPool::NextResult(map<unsigned long, JOB>::iterator &next)
+{
+    cDeviceSet devices;
+    set<unsigned int> groups;
+    map<unsigned long, OPEN>::iterator it;
+
+    for (it = mOpen.begin(); it != mOpen.end(); it++) {
+        const OPEN &open = it->second;
+        bool ordered = (open.type != JOB_REVALIDATE);
+        if ((!ordered) ||
+            ((!devices.Contains(open.id)) &&
+             (groups.find(open.group) == groups.end()))) {
+            next = mDone.find(it->first);
+            if (next != mDone.end()) {
+                return true;
+            }
+        }
+        if (ordered) {
+            devices.Insert(open.id);
+            groups.insert(open.group);
+        }
+    }
+    return false;
+}
+
+bool cDetectionPool::ResultAvailable(void)
+{
+    map<unsigned long, JOB>::iterator next;
+    return NextResult(next);
+}
+
+// Forget a job whose result was taken. Must be called with the mutex held.
+void cDetectionPool::Taken(map<unsigned long, JOB>::iterator done)
+{
+    unsigned int group = done->second.result.group;
+    mOpen.erase(done->first);
+    mDone.erase(done);
+    map<unsigned int, unsigned int>::iterator it = mGroupJobs.find(group);
+    if ((it != mGroupJobs.end()) && (--it->second == 0)) {
+        mGroupJobs.erase(it);
+        mDiscarded.erase(group);
+    }
+}
+
+void cDetectionPool::Worker(void)
+{
+    JOB job;
+
+    for (;;) {
+        {
+            unique_lock<mutex> lock(mMutex);
+            while ((!mStopping) && (!TakeJob(job))) {
+                mJobsChanged.wait(lock);
+            }
+            if (mStopping) {
+                return;
+            }
+        }
+        try {
+            // Lets the backend calls of the job check the token
+            cCancelStage detection(job.token.get());
+            if (job.type == JOB_REMOVE) {
+                mHandler->RemoveMedia(job.result.mediainfo);
+            }
+            else {
+                job.result.found = mHandler->DetectMedia(job.result.mediainfo,
+                                                         job.result.description,
+                                                         job.result.keylist,
+                                                         job.type == JOB_REVALIDATE);
+            }
+        } catch (cDeviceKitException &e) {
+            mLogger->logmsg(LOGLEVEL_WARNING, "DeviceKit Error %s", e.what());
+            job.result.found = false;
+        }
+        bool ready;
+        {
+            lock_guard<mutex> lock(mMutex);
+            DEVICE_ID id = job.result.mediainfo.GetId();
+            mBusy.Erase(id);
+            if ((job.type != JOB_REMOVE) && job.token->IsCancelled()) {
+                job.result.found = false;
+            }
+            if (job.type != JOB_REMOVE) {
+                mRunning.erase(id);
+            }
+            mDone[job.seq] = job;
+            ready = ResultAvailable();
+        }
+        // The device is free for its next job
+        mJobsChanged.notify_all();
+        mResultsChanged.notify_all();
+        if (ready) {
+            mHandler->ResultReady();
+        }
+    }
+}
+
+bool cDetectionPool::GetResult(RESULT &result)
+{
+    lock_guard<mutex> lock(mMutex);
+    map<unsigned long, JOB>::iterator it;
+    while (NextResult(it)) {
+        JOB &job = it->second;
+        bool found = (job.type != JOB_REMOVE) && job.result.found &&
+                     (mDiscarded.find(job.result.group) == mDiscarded.end());
+        if (found) {
+            result = job.result;
+        }
+        Taken(it);
+        if (found) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool cDetectionPool::WaitResult(void)
+{
+    unique_lock<mutex> lock(mMutex);
+    while ((!mStopping) && (!ResultAvailable()) && (!mOpen.empty())) {
+        mResultsChanged.wait(lock);
+    }
+    return ResultAvailable();
+}
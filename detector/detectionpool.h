@@ -0,0 +1,144 @@
+/*
+ * detectionpool.h: Worker threads detecting the media of several devices in
+ *                  parallel.
+ *
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * This code is distributed under the terms and conditions of the
+ * GNU GENERAL PUBLIC LICENSE. See the file COPYING for details.
+ */
+
+#ifndef DETECTIONPOOL_H_
+#define DETECTIONPOOL_H_
+
+#include <string>
+#include <deque>
+#include <map>
+#include <set>
+#include <memory>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include "mediatester.h"
+#include "deviceregistry.h"
+#include "canceltoken.h"
+#include "logger.h"
+#include "stdtypes.h"
+
+// Work done by the pool, implemented by the detector. DetectMedia and
+// RemoveMedia are called from the workers, never for the same device at
+// the same time. ResultReady is called when the next result can be taken.
+// A revalidation checks a result detected before, e.g. taken from a cache.
+class cDetectionHandler {
+public:
+    virtual ~cDetectionHandler() {};
+    virtual bool DetectMedia(cMediaHandle &mediainfo, std::string &description,
+                               stringList &keylist, bool revalidate) = 0;
+    virtual void RemoveMedia(const cMediaHandle &mediainfo) = 0;
+    virtual void ResultReady(void) = 0;
+};
+
+// The jobs of different devices run in parallel, the jobs of one device in
+// the order of submission. The results of one device and of one group are
+// returned in the order of submission as well, regardless which job
+// finished first. Results of other devices are not held back by a long
+// detection. Revalidations are not ordered, their result is returned as
+// soon as they finished.
+class cDetectionPool {
+public:
+    typedef struct {
+        unsigned int group;
+        cMediaHandle mediainfo;
+        std::string description;
+        stringList keylist;
+        bool found;
+    } RESULT;
+
+    static const int DEFAULT_WORKERS = 4;
+
+    cDetectionPool(cLogger *logger, cDetectionHandler *handler);
+    ~cDetectionPool();
+    // Time limits of the stages of the detections started afterwards
+    void SetTimeouts(const cCancelToken::TIMEOUTS &timeouts) {
+        mTimeouts = timeouts;
+    }
+    void Start(int workers);
+    // Cancel and wait for the running jobs, jobs not started yet are dropped
+    void Stop(void);
+    // Jobs of one group can be discarded together, e.g. the devices of a
+    // manual scan after the first media was found.
+    unsigned int NewGroup(void);
+    void Detect(const cMediaHandle &mediainfo, unsigned int group);
+    void Revalidate(const cMediaHandle &mediainfo);
+    // The detections of the device not started yet are dropped, a running
+    // one is cancelled and its result is ignored.
+    void Remove(const cMediaHandle &mediainfo);
+    void Discard(unsigned int group);
+    // The device has jobs, which are not finished or whose result is not
+    // taken yet
+    bool HasJobs(DEVICE_ID id);
+    // Next result, false if it is not available yet
+    bool GetResult(RESULT &result);
+    // Wait until the next result is available or no job is left, false if
+    // no job is left.
+    bool WaitResult(void);
+
+private:
+    typedef enum {
+        JOB_DETECT,
+        JOB_REVALIDATE,
+        JOB_REMOVE
+    } JOB_TYPE;
+    typedef struct {
+        unsigned long seq;
+        JOB_TYPE type;
+        RESULT result;
+        // Also set in the media handle of the result
+        std::shared_ptr<cCancelToken> token;
+    } JOB;
+    typedef std::deque<JOB> JobQueue;
+    // A job whose result is not taken yet
+    typedef struct {
+        DEVICE_ID id;
+        unsigned int group;
+        JOB_TYPE type;
+    } OPEN;
+
+    cLogger *mLogger;
+    cDetectionHandler *mHandler;
+    std::vector<std::thread> mWorkers;
+    std::mutex mMutex;
+    std::condition_variable mJobsChanged;
+    std::condition_variable mResultsChanged;
+    bool mStopping;
+    JobQueue mJobs;
+    // Devices with a running job
+    cDeviceSet mBusy;
+    // Tokens of the running detections
+    std::map<DEVICE_ID, std::shared_ptr<cCancelToken> > mRunning;
+    cCancelToken::TIMEOUTS mTimeouts;
+    // Finished jobs by sequence number
+    std::map<unsigned long, JOB> mDone;
+    // Jobs whose result is not taken yet by sequence number, and their
+    // number in each group
+    std::map<unsigned long, OPEN> mOpen;
+    std::map<unsigned int, unsigned int> mGroupJobs;
+    unsigned long mNextSeq;
+    unsigned int mNextGroup;
+    // Groups with jobs left, whose results are ignored
+    std::set<unsigned int> mDiscarded;
+
+    void Submit(const cMediaHandle &mediainfo, JOB_TYPE type,
+                  unsigned int group);
+    bool TakeJob(JOB &job);
+    bool NextResult(std::map<unsigned long, JOB>::iterator &next);
+    bool ResultAvailable(void);
+    void Taken(std::map<unsigned long, JOB>::iterator done);
+    void Worker(void);
+
+    cDetectionPool(const cDetectionPool &);
+    cDetectionPool &operator=(const cDetectionPool &);
+};
+
+#endif /* DETECTIONPOOL_H_ */
@@ -27,21 +27,75 @@ void logkeylist(stringList vl)
         log.logmsg(LOGLEVEL_ERROR, "   %s", it->c_str());
     }
 }
-int main(int argc, const char* argv[])
+
+/*
+ * Usage: detectortest [-c configfile] [-n count] [-p tracefile [-s speed]]
+ *
+ * Without -p the media of the running system are detected count times.
+ * With -p the events of a trace recorded with the TRACE keyword are
+ * replayed until the end of the trace. The timing of the trace is divided
+ * by speed, 0 replays without delays.
+ */
+int main(int argc, char* argv[])
 {
     cLogger log;
     cMediaDetector detector(&log);
     stringList vl;
     string descr;
     cMediaHandle ha;
+    string config = "/tmp/test.conf";
+    string trace;
+    double speed = 1.0;
+    int count = 3;
     int i;
+    int opt;
 
-    if (!detector.InitDetector(&log, "/tmp/test.conf")) {
+    while ((opt = getopt(argc, argv, "c:n:p:s:")) != -1) {
+        switch (opt) {
+        case 'c':
+            config = optarg;
+            break;
+        case 'n':
+            count = atoi(optarg);
+            break;
+        case 'p':
+            trace = optarg;
+            break;
+        case 's':
+            speed = atof(optarg);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-c configfile] [-n count] "
+                    "[-p tracefile [-s speed]]\n", argv[0]);
+            exit(-1);
+        }
+    }
+
+    if (!trace.empty()) {
+        cReplayBackend *replay = new cReplayBackend(&log, speed);
+        if (!replay->Load(trace)) {
+            delete replay;
+            exit(-1);
+        }
+        detector.SetBackend(replay);
+        count = -1;
+    }
+    if (!detector.InitDetector(&log, config)) {
         exit(-1);
     }
-    for (i=0; i < 3; i++) {
+    long long start = cDeviceBackend::Now();
+    for (i = 0; (count < 0) || (i < count); i++) {
+        long long detectstart = cDeviceBackend::Now();
         vl = detector.Detect(descr, ha);
-        log.logmsg(LOGLEVEL_ERROR, "\n%s Keylist : ", descr.c_str());
+        if (vl.empty() && (count < 0)) {
+            break; // End of trace
+        }
+        log.logmsg(LOGLEVEL_ERROR, "\n%s Keylist (%lld ms): ", descr.c_str(),
+                   cDeviceBackend::Now() - detectstart);
         logkeylist(vl);
     }
+    if (!trace.empty()) {
+        log.logmsg(LOGLEVEL_ERROR, "Replayed %d detections in %lld ms", i,
+                   cDeviceBackend::Now() - start);
+    }
 }
@@ -0,0 +1,171 @@
+/*
+ * devicebackend.cc: Interface to the source of device events and device
+ *                   properties (udisks via dbus or kernel uevents)
+ *
+ *
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * This code is distributed under the terms and conditions of the
+ * GNU GENERAL PUBLIC LICENSE. See the file COPYING for details.
+ */
+
+#include <stdio.h>
+#include <time.h>
+#include <algorithm>
+#include "devicebackend.h"
+#include "dbusdevkit.h"
+#include "netlinkbackend.h"
+#include "stringtools.h"
+
+using namespace std;
+
+cDeviceKitException::cDeviceKitException (const char *file, int line,
+                                                const std::string errtxt)
+{
+    char buf[40];
+    sprintf(buf, ", %d, ", line);
+    std::string fn = file;
+    mErrTxt = fn + buf + errtxt;
+}
+
+cDeviceBackend::cDeviceBackend(cLogger *logger) : mEventLoop(logger)
+{
+    mLogger = logger;
+    mEventWindow = DEFAULT_EVENT_WINDOW;
+    mBurstStart = 0;
+    mLastSignal = 0;
+}
+
+cDeviceBackend *cDeviceBackend::Create(const string &name, cLogger *logger)
+{
+    string n = StringTools::ToUpper(name);
+    if ((n == "UDISKS") || (n == "DBUS")) {
+        return new cDbusDevkit(logger);
+    }
+    if (n == "NETLINK") {
+        return new cNetlinkBackend(logger);
+    }
+    return NULL;
+}
+
+// Monotonic time in milliseconds
+long long cDeviceBackend::Now(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/*
+ * Merge a signal into the list of pending events. Several signals for the
+ * same object are combined into one event, a removal overrides an earlier
+ * add or change and an add after a removal reports the new device.
+ */
+void cDeviceBackend::CoalesceEvent(const DEVICE_EVENT &event)
+{
+    EventList::iterator it;
+    for (it = mPendingEvents.begin(); it != mPendingEvents.end(); it++) {
+        if (it->path == event.path) {
+            break;
+        }
+    }
+    if (it == mPendingEvents.end()) {
+        mPendingEvents.push_back(event);
+        return;
+    }
+    if ((event.signal == DeviceRemoved) || (event.signal == DeviceAdded)) {
+        it->signal = event.signal;
+        it->properties = event.properties;
+    }
+    else if (it->signal == DeviceRemoved) {
+        return; // A change of a removed device is meaningless
+    }
+    stringList::const_iterator iit;
+    for (iit = event.interfaces.begin(); iit != event.interfaces.end(); iit++) {
+        if (find(it->interfaces.begin(), it->interfaces.end(), *iit) ==
+            it->interfaces.end()) {
+            it->interfaces.push_back(*iit);
+        }
+    }
+}
+
+/*
+ * Remaining time of the current burst: until the event window after the
+ * last signal ends, but not more than MAX_EVENT_WINDOWS windows after the
+ * first signal.
+ */
+int cDeviceBackend::WindowLeft(void)
+{
+    long long end = min(mLastSignal + mEventWindow,
+                        mBurstStart + mEventWindow * MAX_EVENT_WINDOWS);
+    long long left = end - Now();
+    return (left > 0) ? (int)left : 0;
+}
+
+/*
+ * Wait for a device event. The signals are collected until no new signal
+ * arrived for the event window, then one consolidated event is returned
+ * per device. A Wakeup or the timeout during the window returns false and
+ * keeps the collected signals, the next call continues the window.
+ * timout : timeout in miliseconds
+ */
+bool cDeviceBackend::WaitDevkit(int timeout, DEVICE_EVENT &event)
+{
+    DEVICE_EVENT ev;
+
+    if (!Connect()) {
+        return false;
+    }
+
+    if (mReadyEvents.empty()) {
+        int wait = timeout;
+        if (!mPendingEvents.empty()) {
+            wait = WindowLeft();
+            if ((timeout >= 0) && (timeout < wait)) {
+                wait = timeout;
+            }
+        }
+        while (ReadSignal(wait, ev)) {
+            long long now = Now();
+            // The wait for the first signal is not part of the burst
+            if (mPendingEvents.empty()) {
+                mBurstStart = now;
+            }
+            mLastSignal = now;
+            CoalesceEvent(ev);
+            // Continue until the bus is quiet, but do not delay the events
+            // for more than MAX_EVENT_WINDOWS windows on a continuous stream
+            // of signals.
+            if (now - mBurstStart > mEventWindow * MAX_EVENT_WINDOWS) {
+                break;
+            }
+            wait = WindowLeft();
+        }
+        if ((!mPendingEvents.empty()) && (WindowLeft() > 0)) {
+            event.path = "";
+            return false;
+        }
+        mReadyEvents.splice(mReadyEvents.end(), mPendingEvents);
+    }
+
+    while (!mReadyEvents.empty()) {
+        event = mReadyEvents.front();
+        mReadyEvents.pop_front();
+#ifdef DEBUG
+        mLogger->logmsg(LOGLEVEL_INFO, "Event %d for %s", event.signal,
+                        event.path.c_str());
+#endif
+        if (event.signal == DeviceRemoved) {
+            return true;
+        }
+        try {
+            // Properties are taken after the last signal of the burst
+            GetDeviceProperties(event.path, event.properties);
+            return true;
+        } catch (cDeviceKitException &e) {
+            mLogger->logmsg(LOGLEVEL_WARNING, "DeviceKit Error %s", e.what());
+        }
+    }
+    event.path = "";
+    return false;
+}
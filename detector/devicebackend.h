@@ -0,0 +1,150 @@
+/*
+ * devicebackend.h: Interface to the source of device events and device
+ *                  properties (udisks via dbus or kernel uevents)
+ *
+ *
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * This code is distributed under the terms and conditions of the
+ * GNU GENERAL PUBLIC LICENSE. See the file COPYING for details.
+ */
+
+#ifndef DEVICEBACKEND_H_
+#define DEVICEBACKEND_H_
+
+#include <string>
+#include <list>
+#include <exception>
+#include "logger.h"
+#include "stdtypes.h"
+#include "eventloop.h"
+
+#define DEVKITEXCEPTION(t) throw cDeviceKitException(__FILE__, __LINE__,(t))
+
+class cDeviceKitException : private std::exception
+{
+private:
+    std::string mErrTxt;
+
+public:
+    cDeviceKitException (const char *errtxt) : mErrTxt(errtxt) {};
+    cDeviceKitException (const std::string errtxt) : mErrTxt(errtxt) {};
+    cDeviceKitException (const char *file, int line, const std::string errtxt);
+
+    virtual ~cDeviceKitException () noexcept {};
+    virtual const char *what(void) const noexcept {
+        return (mErrTxt.c_str());
+    }
+};
+
+// Properties of a device needed to describe an inserted media
+typedef struct {
+    std::string nativePath;
+    std::string deviceFile;
+    std::string type;
+    // File system identity, empty if unknown
+    std::string uuid;
+    std::string label;
+    // Size of the media in bytes
+    unsigned long long size;
+    stringList mountPaths;
+    bool isOptical;
+    bool isMounted;
+    bool isPartition;
+    bool isMediaAvailable;
+} DEVICE_PROPERTIES;
+
+// Base class for all device backends. A device is identified by a path,
+// which is specific for the backend (e.g. the udisks object path).
+class cDeviceBackend {
+public:
+    typedef enum {
+        DeviceAdded,
+        DeviceRemoved,
+        DeviceChanged,
+        Unkown
+    } DEVICE_SIGNAL;
+
+    // Device change with the interfaces added or removed and the
+    // properties of the device
+    typedef struct {
+        std::string path;
+        DEVICE_SIGNAL signal;
+        stringList interfaces;
+        DEVICE_PROPERTIES properties;
+    } DEVICE_EVENT;
+
+    cDeviceBackend(cLogger *logger);
+    virtual ~cDeviceBackend() {};
+    // Create the backend with the given name (udisks or netlink), NULL
+    // if the name is unknown.
+    static cDeviceBackend *Create(const std::string &name, cLogger *logger);
+
+    // Wait for the next device event
+    virtual bool WaitDevkit(int timeout, DEVICE_EVENT &event);
+    // Time in ms without signals, after which the collected signals are
+    // reported as events.
+    virtual void SetEventWindow(int window) { mEventWindow = window; }
+    // Time limit in ms of a call to the device service, 0 for the default
+    // of the service. A stage of a detection sets its own limit.
+    virtual void SetCallTimeout(int timeout) {};
+    // Interrupt a WaitDevkit from another thread
+    virtual void Wakeup(void) { mEventLoop.Wakeup(); }
+    // True if no more events will be delivered, e.g. at the end of a
+    // replayed trace.
+    virtual bool Finished(void) { return false; }
+
+    virtual std::string FindDeviceByDeviceFile (const std::string device) = 0;
+    virtual stringList EnumerateDevices (void) = 0;
+    // Do automount and return mount path
+    virtual std::string AutoMount(const std::string path) = 0;
+    virtual void UnMount (const std::string &path) = 0;
+    virtual std::string GetNativePath (const std::string &path) = 0;
+    virtual std::string GetType (const std::string &path) = 0;
+    virtual std::string GetDeviceFile (const std::string &path) = 0;
+    virtual stringList GetDeviceFileById (const std::string &path) = 0;
+    virtual stringList GetDeviceFileByPath (const std::string &path) = 0;
+    virtual stringList GetMountPaths (const std::string &path) = 0;
+    virtual bool IsMounted(const std::string &path) = 0;
+    virtual bool IsOpticalDisk(const std::string &path) = 0;
+    virtual bool IsPartition(const std::string &path) = 0;
+    virtual bool IsMediaAvailable(const std::string &path) = 0;
+    // Fetch all properties needed for a media description
+    virtual void GetDeviceProperties(const std::string &path,
+                                       DEVICE_PROPERTIES &props) = 0;
+    // Hint that the properties of several devices are needed soon
+    virtual void PrefetchProperties(const stringList &paths) {};
+
+    // Monotonic time in milliseconds
+    static long long Now (void);
+
+protected:
+    cEventLoop mEventLoop;
+    cLogger *mLogger;
+
+    // Connect to the event source, false if it is not available
+    virtual bool Connect (void) = 0;
+    // Read the next device signal, false on timeout or Wakeup
+    virtual bool ReadSignal (int timeout, DEVICE_EVENT &event) = 0;
+
+private:
+    // Signals waiting for the end of the event window and consolidated
+    // events not yet returned by WaitDevkit.
+    typedef std::list<DEVICE_EVENT> EventList;
+    static const int DEFAULT_EVENT_WINDOW = 200;
+    static const int MAX_EVENT_WINDOWS = 10;
+    int mEventWindow;
+    EventList mPendingEvents;
+    EventList mReadyEvents;
+    // Time of the first and the last signal of the pending events
+    long long mBurstStart;
+    long long mLastSignal;
+
+    void CoalesceEvent (const DEVICE_EVENT &event);
+    int WindowLeft (void);
+
+    cDeviceBackend(const cDeviceBackend &);
+    cDeviceBackend &operator=(const cDeviceBackend &);
+};
+
+#endif /* DEVICEBACKEND_H_ */
@@ -0,0 +1,219 @@
+/*
+ * devicefilter.cc: Devices excluded from media detection, resolved to
+ *                  device numbers.
+ *
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * This code is distributed under the terms and conditions of the
+ * GNU GENERAL PUBLIC LICENSE. See the file COPYING for details.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <fstream>
+#include "devicefilter.h"
+
+using namespace std;
+
+const char *cDeviceFilter::SYSFS_CLASS_BLOCK = "/sys/class/block";
+
+cDeviceFilter::cDeviceFilter(cLogger *logger)
+{
+    mLogger = logger;
+    mValid = false;
+}
+
+void cDeviceFilter::AddPattern(const string &pattern)
+{
+    mPatterns.insert(pattern);
+    mValid = false;
+}
+
+void cDeviceFilter::AddDevice(const string &spec)
+{
+    mDevices.insert(spec);
+    mValid = false;
+}
+
+bool cDeviceFilter::Contains(dev_t devnum)
+{
+    if (!mValid) {
+        Resolve();
+    }
+    return mDevNums.find(devnum) != mDevNums.end();
+}
+
+bool cDeviceFilter::MatchPattern(const string &nativepath) const
+{
+    stringSet::const_iterator it;
+    for (it = mPatterns.begin(); it != mPatterns.end(); it++) {
+        if (nativepath.find(*it) != string::npos) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool cDeviceFilter::MatchDevice(const string &devicefile) const
+{
+    return (!devicefile.empty()) &&
+           (mDevices.find(devicefile) != mDevices.end());
+}
+
+/*
+ * Build the set of device numbers. A pattern matches a block device if it
+ * is contained in its device file or its sysfs path, which are the native
+ * paths of the backends.
+ */
+void cDeviceFilter::Resolve(void)
+{
+    DIR *dir;
+    struct dirent *entry;
+    char buf[PATH_MAX];
+    dev_t devnum;
+
+    mDevNums.clear();
+    mValid = true;
+    if (!mPatterns.empty()) {
+        dir = opendir(SYSFS_CLASS_BLOCK);
+        if (dir == NULL) {
+            mLogger->logmsg(LOGLEVEL_ERROR, "Can not open %s", SYSFS_CLASS_BLOCK);
+        }
+        else {
+            while ((entry = readdir(dir)) != NULL) {
+                if (entry->d_name[0] == '.') {
+                    continue;
+                }
+                string name = entry->d_name;
+                string syspath = string(SYSFS_CLASS_BLOCK) + "/" + name;
+                if (realpath(syspath.c_str(), buf) != NULL) {
+                    syspath = buf;
+                }
+                if ((MatchPattern("/dev/" + name) || MatchPattern(syspath)) &&
+                    ReadDevNum(name, devnum)) {
+                    mDevNums.insert(devnum);
+                }
+            }
+            closedir(dir);
+        }
+    }
+    stringSet::iterator it;
+    for (it = mDevices.begin(); it != mDevices.end(); it++) {
+        if (ResolveDevice(*it, devnum)) {
+            mDevNums.insert(devnum);
+        }
+    }
+#ifdef DEBUG
+    mLogger->logmsg(LOGLEVEL_INFO, "Device filter resolved to %d devices",
+                    (int)mDevNums.size());
+#endif
+}
+
+// Read the device number of a block device from sysfs ("major:minor")
+bool cDeviceFilter::ReadDevNum(const string &name, dev_t &devnum)
+{
+    ifstream file;
+    string line;
+    unsigned int major;
+    unsigned int minor;
+
+    file.open((string(SYSFS_CLASS_BLOCK) + "/" + name + "/dev").c_str());
+    if (!file.is_open()) {
+        return false;
+    }
+    getline(file, line);
+    if (sscanf(line.c_str(), "%u:%u", &major, &minor) != 2) {
+        return false;
+    }
+    devnum = makedev(major, minor);
+    return true;
+}
+
+/*
+ * Resolve an fstab device to its device number. Tags are looked up in the
+ * links created by udev, entries like "proc" or "tmpfs" and devices not
+ * present are not resolved.
+ */
+bool cDeviceFilter::ResolveDevice(const string &spec, dev_t &devnum)
+{
+    static const struct {
+        const char *tag;
+        const char *dir;
+    } tags[] = {
+        { "UUID=", "/dev/disk/by-uuid/" },
+        { "LABEL=", "/dev/disk/by-label/" },
+        { "PARTUUID=", "/dev/disk/by-partuuid/" },
+        { "PARTLABEL=", "/dev/disk/by-partlabel/" },
+    };
+    struct stat st;
+    string path;
+
+    if ((!spec.empty()) && (spec[0] == '/')) {
+        path = UnescapeFstab(spec);
+    }
+    for (size_t i = 0; i < sizeof(tags) / sizeof(tags[0]); i++) {
+        string tag = tags[i].tag;
+        if (spec.compare(0, tag.length(), tag) == 0) {
+            string value = UnescapeFstab(spec.substr(tag.length()));
+            // The value may be quoted
+            if ((value.length() >= 2) && (value[0] == '"') &&
+                (value[value.length() - 1] == '"')) {
+                value = value.substr(1, value.length() - 2);
+            }
+            path = tags[i].dir + EncodeUdev(value);
+            break;
+        }
+    }
+    if (path.empty() || (stat(path.c_str(), &st) != 0) ||
+        (!S_ISBLK(st.st_mode))) {
+        return false;
+    }
+    devnum = st.st_rdev;
+    return true;
+}
+
+// fstab escapes blanks as octal numbers, e.g. \040
+string cDeviceFilter::UnescapeFstab(const string &str)
+{
+    string retval;
+    for (size_t i = 0; i < str.length(); i++) {
+        if ((str[i] == '\\') && (i + 3 < str.length()) &&
+            (str[i + 1] >= '0') && (str[i + 1] <= '3') &&
+            (str[i + 2] >= '0') && (str[i + 2] <= '7') &&
+            (str[i + 3] >= '0') && (str[i + 3] <= '7')) {
+            retval += (char)(((str[i + 1] - '0') << 6) |
+                             ((str[i + 2] - '0') << 3) | (str[i + 3] - '0'));
+            i += 3;
+        }
+        else {
+            retval += str[i];
+        }
+    }
+    return retval;
+}
+
+// udev encodes unsafe characters in link names as \xNN
+string cDeviceFilter::EncodeUdev(const string &str)
+{
+    static const char *safe = "#+-.:=@_";
+    string retval;
+    char buf[8];
+    for (size_t i = 0; i < str.length(); i++) {
+        unsigned char c = str[i];
+        if (((c >= '0') && (c <= '9')) || ((c >= 'a') && (c <= 'z')) ||
+            ((c >= 'A') && (c <= 'Z')) || (c >= 0x80) ||
+            ((c != 0) && (strchr(safe, c) != NULL))) {
+            retval += c;
+        }
+        else {
+            snprintf(buf, sizeof(buf), "\\x%02x", c);
+            retval += buf;
+        }
+    }
+    return retval;
+}
@@ -0,0 +1,58 @@
+/*
+ * devicefilter.h: Devices excluded from media detection, resolved to
+ *                 device numbers.
+ *
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * This code is distributed under the terms and conditions of the
+ * GNU GENERAL PUBLIC LICENSE. See the file COPYING for details.
+ */
+
+#ifndef DEVICEFILTER_H_
+#define DEVICEFILTER_H_
+
+#include <sys/types.h>
+#include <string>
+#include <unordered_set>
+#include "logger.h"
+#include "stdtypes.h"
+
+// The filter entries are resolved with sysfs and the /dev/disk links into
+// the numbers of the matching block devices, so a device is checked without
+// asking the device backend. The resolution is repeated after devices were
+// added or removed, e.g. for an fstab entry of a device not plugged in yet.
+class cDeviceFilter {
+public:
+    cDeviceFilter(cLogger *logger);
+
+    // Substring of the device name or the native path (FILTERDEV)
+    void AddPattern(const std::string &pattern);
+    // Device as given in /etc/fstab: device file, UUID=, LABEL=, PARTUUID=
+    // or PARTLABEL=
+    void AddDevice(const std::string &spec);
+    bool Empty(void) const { return mPatterns.empty() && mDevices.empty(); }
+    // Resolve the entries again before the next check
+    void Invalidate(void) { mValid = false; }
+    bool Contains(dev_t devnum);
+
+    // String matching for devices without a known device number
+    bool MatchPattern(const std::string &nativepath) const;
+    bool MatchDevice(const std::string &devicefile) const;
+
+private:
+    static const char *SYSFS_CLASS_BLOCK;
+
+    cLogger *mLogger;
+    stringSet mPatterns;
+    stringSet mDevices;
+    std::unordered_set<dev_t> mDevNums;
+    bool mValid;
+
+    void Resolve(void);
+    static bool ReadDevNum(const std::string &name, dev_t &devnum);
+    static bool ResolveDevice(const std::string &spec, dev_t &devnum);
+    static std::string UnescapeFstab(const std::string &str);
+    static std::string EncodeUdev(const std::string &str);
+};
+
+#endif /* DEVICEFILTER_H_ */
@@ -0,0 +1,125 @@
+/*
+ * deviceregistry.cc: Interning of devices into small integer ids, which are
+ *                    used instead of the backend paths in the device sets
+ *                    of the detector and the testers.
+ *
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * This code is distributed under the terms and conditions of the
+ * GNU GENERAL PUBLIC LICENSE. See the file COPYING for details.
+ */
+
+#include <sys/stat.h>
+#include "deviceregistry.h"
+
+using namespace std;
+
+void cDeviceSet::Insert(DEVICE_ID id)
+{
+    if (id == NO_DEVICE) {
+        return;
+    }
+    if (id >= mBits.size()) {
+        mBits.resize(id + 1, false);
+    }
+    if (!mBits[id]) {
+        mBits[id] = true;
+        mCount++;
+    }
+}
+
+void cDeviceSet::Erase(DEVICE_ID id)
+{
+    if (Contains(id)) {
+        mBits[id] = false;
+        mCount--;
+    }
+}
+
+cDeviceSet::IdList cDeviceSet::GetIds(void) const
+{
+    IdList ids;
+    ids.reserve(mCount);
+    for (DEVICE_ID id = 1; id < mBits.size(); id++) {
+        if (mBits[id]) {
+            ids.push_back(id);
+        }
+    }
+    return ids;
+}
+
+cDeviceRegistry::cDeviceRegistry()
+{
+    DEVICE_ENTRY none;
+    none.devNum = 0;
+    mDevices.push_back(none);
+}
+
+DEVICE_ID cDeviceRegistry::Intern(const string &path)
+{
+    if (path.empty()) {
+        return NO_DEVICE;
+    }
+    IdMap::iterator it = mPaths.find(path);
+    if (it != mPaths.end()) {
+        return it->second;
+    }
+    DEVICE_ID id;
+    DEVICE_ENTRY entry;
+    entry.path = path;
+    entry.devNum = 0;
+    if (mFree.empty()) {
+        id = mDevices.size();
+        mDevices.push_back(entry);
+    }
+    else {
+        id = mFree.back();
+        mFree.pop_back();
+        mDevices[id] = entry;
+    }
+    mPaths[path] = id;
+    return id;
+}
+
+void cDeviceRegistry::SetDeviceFile(DEVICE_ID id, const string &devicefile)
+{
+    struct stat st;
+
+    if ((id == NO_DEVICE) || (id >= mDevices.size()) || devicefile.empty()) {
+        return;
+    }
+    DEVICE_ENTRY &entry = mDevices[id];
+    // The device number is read only when the device file changes
+    if (entry.deviceFile == devicefile) {
+        return;
+    }
+    entry.deviceFile = devicefile;
+    entry.devNum = 0;
+    if ((stat(devicefile.c_str(), &st) == 0) && S_ISBLK(st.st_mode)) {
+        entry.devNum = st.st_rdev;
+    }
+}
+
+void cDeviceRegistry::Release(DEVICE_ID id)
+{
+    if ((id == NO_DEVICE) || (id >= mDevices.size()) ||
+        mDevices[id].path.empty()) {
+        return;
+    }
+    DEVICE_ENTRY &entry = mDevices[id];
+    mPaths.erase(entry.path);
+    entry.path.clear();
+    entry.deviceFile.clear();
+    entry.devNum = 0;
+    mFree.push_back(id);
+}
+
+const string &cDeviceRegistry::GetPath(DEVICE_ID id) const
+{
+    return Entry(id).path;
+}
+
+dev_t cDeviceRegistry::GetDevNum(DEVICE_ID id) const
+{
+    return Entry(id).devNum;
+}
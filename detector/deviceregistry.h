@@ -0,0 +1,87 @@
+/*
+ * deviceregistry.h: Interning of devices into small integer ids, which are
+ *                   used instead of the backend paths in the device sets of
+ *                   the detector and the testers.
+ *
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * This code is distributed under the terms and conditions of the
+ * GNU GENERAL PUBLIC LICENSE. See the file COPYING for details.
+ */
+
+#ifndef DEVICEREGISTRY_H_
+#define DEVICEREGISTRY_H_
+
+#include <sys/types.h>
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+typedef unsigned int DEVICE_ID;
+
+// Id of no device, valid ids start with 1
+static const DEVICE_ID NO_DEVICE = 0;
+
+// Set of device ids. The ids are dense, so a bit per registered device is
+// sufficient and the membership test is a simple index.
+class cDeviceSet {
+public:
+    typedef std::vector<DEVICE_ID> IdList;
+
+    cDeviceSet() : mCount(0) {};
+    bool Contains(DEVICE_ID id) const {
+        return (id < mBits.size()) && mBits[id];
+    }
+    void Insert(DEVICE_ID id);
+    void Erase(DEVICE_ID id);
+    void Clear(void) { mBits.clear(); mCount = 0; }
+    bool Empty(void) const { return mCount == 0; }
+    // Members in ascending order of the ids
+    IdList GetIds(void) const;
+
+private:
+    std::vector<bool> mBits;
+    size_t mCount;
+};
+
+// Each device seen by the detector is registered once with its backend path
+// and gets an id, which stays valid until the device is released. The ids of
+// released devices are reused, so the ids stay dense when devices come and
+// go, e.g. loop devices or partitions. Device file and device number are
+// updated when they become known.
+class cDeviceRegistry {
+public:
+    cDeviceRegistry();
+
+    // Id of the device with the given backend path, registers the device
+    // if it is not known yet.
+    DEVICE_ID Intern(const std::string &path);
+    // Record the device file, its device number is read with stat
+    void SetDeviceFile(DEVICE_ID id, const std::string &devicefile);
+    // Forget a removed device. The id must not be used in a device set
+    // any more, it is given to the next new device.
+    void Release(DEVICE_ID id);
+
+    const std::string &GetPath(DEVICE_ID id) const;
+    dev_t GetDevNum(DEVICE_ID id) const;
+
+private:
+    typedef struct {
+        std::string path;
+        std::string deviceFile;
+        dev_t devNum;
+    } DEVICE_ENTRY;
+    typedef std::unordered_map<std::string, DEVICE_ID> IdMap;
+
+    // Indexed by id, entry 0 is the empty entry of NO_DEVICE
+    std::vector<DEVICE_ENTRY> mDevices;
+    // Released ids
+    std::vector<DEVICE_ID> mFree;
+    IdMap mPaths;
+
+    const DEVICE_ENTRY &Entry(DEVICE_ID id) const {
+        return (id < mDevices.size()) ? mDevices[id] : mDevices[NO_DEVICE];
+    }
+};
+
+#endif /* DEVICEREGISTRY_H_ */
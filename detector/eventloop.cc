@@ -0,0 +1,138 @@
+/*
+ * eventloop.cc: File descriptor based event loop for the detector thread,
+ *               using epoll and an eventfd for waking up the thread.
+ *
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * This code is distributed under the terms and conditions of the
+ * GNU GENERAL PUBLIC LICENSE. See the file COPYING for details.
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include "eventloop.h"
+
+using namespace std;
+
+cEventLoop::cEventLoop(cLogger *logger)
+{
+    struct epoll_event ev;
+
+    mLogger = logger;
+    mEpollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (mEpollFd < 0) {
+        mLogger->logmsg(LOGLEVEL_ERROR, "epoll_create failed: %s",
+                        strerror(errno));
+    }
+    mWakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (mWakeFd < 0) {
+        mLogger->logmsg(LOGLEVEL_ERROR, "eventfd failed: %s", strerror(errno));
+    }
+    if ((mEpollFd >= 0) && (mWakeFd >= 0)) {
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.fd = mWakeFd;
+        epoll_ctl(mEpollFd, EPOLL_CTL_ADD, mWakeFd, &ev);
+    }
+}
+
+cEventLoop::~cEventLoop()
+{
+    if (mWakeFd >= 0) {
+        close(mWakeFd);
+    }
+    if (mEpollFd >= 0) {
+        close(mEpollFd);
+    }
+}
+
+bool cEventLoop::SetFd(int fd, uint32_t events)
+{
+    struct epoll_event ev;
+    int op;
+
+    map<int, uint32_t>::iterator it = mFds.find(fd);
+    if (it == mFds.end()) {
+        if (events == 0) {
+            return true;
+        }
+        op = EPOLL_CTL_ADD;
+    }
+    else if (events == 0) {
+        op = EPOLL_CTL_DEL;
+    }
+    else {
+        op = EPOLL_CTL_MOD;
+    }
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.fd = fd;
+    if ((epoll_ctl(mEpollFd, op, fd, &ev) != 0) && (op != EPOLL_CTL_DEL)) {
+        mLogger->logmsg(LOGLEVEL_ERROR, "epoll_ctl %d failed: %s", fd,
+                        strerror(errno));
+        return false;
+    }
+    if (events == 0) {
+        mFds.erase(fd);
+    }
+    else {
+        mFds[fd] = events;
+    }
+    return true;
+}
+
+int cEventLoop::Wait(int timeout, FDEVENT *events, int maxevents, bool &woken)
+{
+    struct epoll_event ev[MAX_EVENTS];
+    uint64_t cnt;
+    int n;
+    int ret = 0;
+
+    woken = false;
+    if (mEpollFd < 0) {
+        if (timeout > 0) {
+            usleep(timeout * 1000);
+        }
+        return 0;
+    }
+    if (maxevents > MAX_EVENTS) {
+        maxevents = MAX_EVENTS;
+    }
+    n = epoll_wait(mEpollFd, ev, maxevents, timeout);
+    if (n < 0) {
+        if (errno != EINTR) {
+            mLogger->logmsg(LOGLEVEL_ERROR, "epoll_wait failed: %s",
+                            strerror(errno));
+        }
+        return 0;
+    }
+    for (int i = 0; i < n; i++) {
+        if (ev[i].data.fd == mWakeFd) {
+            // Reset the counter of the eventfd
+            if (read(mWakeFd, &cnt, sizeof(cnt)) < 0) {
+                cnt = 0;
+            }
+            woken = true;
+        }
+        else {
+            events[ret].fd = ev[i].data.fd;
+            events[ret].events = ev[i].events;
+            ret++;
+        }
+    }
+    return ret;
+}
+
+void cEventLoop::Wakeup(void)
+{
+    uint64_t cnt = 1;
+    if (mWakeFd >= 0) {
+        if (write(mWakeFd, &cnt, sizeof(cnt)) < 0) {
+            mLogger->logmsg(LOGLEVEL_ERROR, "Wakeup failed: %s", strerror(errno));
+        }
+    }
+}
@@ -0,0 +1,49 @@
+/*
+ * eventloop.h: File descriptor based event loop for the detector thread,
+ *              using epoll and an eventfd for waking up the thread.
+ *
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * This code is distributed under the terms and conditions of the
+ * GNU GENERAL PUBLIC LICENSE. See the file COPYING for details.
+ */
+
+#ifndef EVENTLOOP_H_
+#define EVENTLOOP_H_
+
+#include <stdint.h>
+#include <map>
+#include "logger.h"
+
+class cEventLoop {
+public:
+    typedef struct {
+        int fd;
+        uint32_t events;   // EPOLLIN, EPOLLOUT, ...
+    } FDEVENT;
+
+    static const int MAX_EVENTS = 8;
+
+    cEventLoop(cLogger *logger);
+    ~cEventLoop();
+    // Watch a file descriptor for the given epoll events, 0 removes the
+    // file descriptor from the loop.
+    bool SetFd(int fd, uint32_t events);
+    // Wait until one of the file descriptors is ready, the timeout (ms)
+    // expires or Wakeup is called. Returns the number of ready file
+    // descriptors, woken is set if Wakeup was called.
+    int Wait(int timeout, FDEVENT *events, int maxevents, bool &woken);
+    // Wake up a thread waiting in Wait. May be called from any thread.
+    void Wakeup(void);
+
+private:
+    int mEpollFd;
+    int mWakeFd;
+    std::map<int, uint32_t> mFds;
+    cLogger *mLogger;
+
+    cEventLoop(const cEventLoop &);
+    cEventLoop &operator=(const cEventLoop &);
+};
+
+#endif /* EVENTLOOP_H_ */
@@ -19,10 +19,15 @@
 
 using namespace std;
 
-cFileTester::stringSet cFileTester::mDetectedSuffixCache;
+thread_local cFileTester::stringSet cFileTester::mDetectedSuffixCache;
+thread_local string cFileTester::mLinkPath;
+thread_local string cFileTester::mMountPath;
+thread_local bool cFileTester::mAutoMount = true;
+thread_local bool cFileTester::mMountError = false;
+thread_local bool cFileTester::mRevalidationMount = false;
+thread_local cDeviceBackend *cFileTester::mDevKit = NULL;
 cFileTester::DevMap cFileTester::mDeviceMap;
-string cFileTester::mLinkPath;
-bool cFileTester::mAutoMount = true;
+mutex cFileTester::mDeviceMapMutex;
 
 bool cFileTester::RmLink(const string ln)
 {
@@ -87,15 +92,18 @@ string cFileTester::GetSuffix (const string str) {
     return str.substr(pos+1);
 }
 
-void cFileTester::BuildSuffixCache (string path) {
+// Collect the suffixes of all files below path, false if the scan was
+// cancelled. The suffixes found until then are kept.
+bool cFileTester::BuildSuffixCache (string path, const cCancelStage &stage) {
     DIR *dp;
     struct dirent *ep;
     struct stat st;
     string file;
+    bool complete = true;
 
     if (path.empty()) {
         mLogger->logmsg(LOGLEVEL_ERROR, "cFileTester: No mount path");
-        return;
+        return true;
     }
 
     if (path.back() != '/') {
@@ -108,10 +116,14 @@ void cFileTester::BuildSuffixCache (string path) {
     if (dp == NULL) {
         mLogger->logmsg(LOGLEVEL_ERROR, "cFileTester: Could not open %s : %s",
                        path.c_str(), strerror (errno));
-        return;
+        return true;
     }
 
     while ((ep = readdir(dp)) != NULL) {
+        if (stage.IsCancelled()) {
+            complete = false;
+            break;
+        }
         if (ep->d_name[0] != '.') {
             file = path + ep->d_name;
 
@@ -121,8 +133,10 @@ void cFileTester::BuildSuffixCache (string path) {
                 break;
             }
             if (S_ISDIR(st.st_mode)) {
-                BuildSuffixCache(file);
-
+                if (!BuildSuffixCache(file, stage)) {
+                    complete = false;
+                    break;
+                }
             } else if (S_ISREG(st.st_mode)) {
                 string suf = GetSuffix(ep->d_name);
                 mDetectedSuffixCache.insert(suf);
@@ -130,9 +144,21 @@ void cFileTester::BuildSuffixCache (string path) {
         }
     }
     (void)closedir(dp);
+    return complete;
 }
 
-bool cFileTester::isMedia (cMediaHandle d, stringList &keylist)
+// Build the cache of the mounted media within the time limit of the scan
+void cFileTester::ScanMedia (const cMediaHandle &d)
+{
+    cCancelStage stage(d.GetCancelToken(), cCancelToken::STAGE_SCAN);
+    if (!BuildSuffixCache(GetMountPath(), stage)) {
+        mLogger->logmsg(LOGLEVEL_WARNING, "cFileTester: Scan of %s %s",
+                        d.GetDeviceFile().c_str(),
+                        stage.IsExpired() ? "timed out" : "cancelled");
+    }
+}
+
+bool cFileTester::isMedia (const cMediaHandle &d, stringList &keylist)
 {
     bool found = false;
     string mountpath;
@@ -201,12 +227,13 @@ bool cFileTester::loadConfig (cConfigFileParser config,
     return true;
 }
 
-void cFileTester::startScan (cMediaHandle &d, cDbusDevkit *devkit)
+void cFileTester::startScan (cMediaHandle &d, cDeviceBackend *devkit)
 {
     MEDIA_MASK_T m = d.GetMediaMask();
-    string dev = d.GetDeviceFile();
+    const string &dev = d.GetDeviceFile();
 
     mDevKit = devkit;
+    mMountError = false;
     mLinkPath.clear();
     mDetectedSuffixCache.clear();
     if (!(m & MEDIA_AVAILABLE))
@@ -216,28 +243,28 @@ void cFileTester::startScan (cMediaHandle &d, cDbusDevkit *devkit)
         return;
     }
 
-    if (inDeviceSet(dev)) {
+    if (inDeviceSet(d.GetId())) {
         mLogger->logmsg(LOGLEVEL_INFO, "cFileTester: startScan Device already in device set");
         return;
     }
-    if (!AutoMount(d.GetPath())) {
+    if (!AutoMount(d)) {
         mLogger->logmsg(LOGLEVEL_INFO, "cFileTester: Automount failed");
         mMountError = true;
         return;
     }
     mLogger->logmsg(LOGLEVEL_INFO, "cFileTester: Build cache for device %s", dev.c_str());
-    BuildSuffixCache(GetMountPath());
+    ScanMedia(d);
 }
 
 void cFileTester::endScan (cMediaHandle &d)
 {
-    string dev = d.GetDeviceFile();
+    const string &dev = d.GetDeviceFile();
 
     if (hasMountError()) {
         mLogger->logmsg(LOGLEVEL_INFO, "cFileTester:: error on scan");
         return;
     }
-    if (inDeviceSet(dev)) {
+    if (inDeviceSet(d.GetId())) {
         mLogger->logmsg(LOGLEVEL_INFO, "cFileTester: endScan Device already in device set");
         return;
     }
@@ -249,43 +276,105 @@ void cFileTester::endScan (cMediaHandle &d)
         Umount(dev);
     }
     DEVINFO devinfo;
-    devinfo.devPath = d.GetPath();
+    devinfo.deviceFile = dev;
     devinfo.linkPath = mLinkPath;
-    mDeviceMap[dev] = devinfo;
+    {
+        lock_guard<mutex> lock(mDeviceMapMutex);
+        mDeviceMap[d.GetId()] = devinfo;
+    }
     mLogger->logmsg(LOGLEVEL_INFO, "cFileTester: Add Device %s to device set", dev.c_str());
 }
 
-void cFileTester::removeDevice (cMediaHandle d)
+// Mount and link the media as after a match, without building the cache
+bool cFileTester::applyCached (cMediaHandle &d, cDeviceBackend *devkit)
 {
-    string path = d.GetPath();
-    mLogger->logmsg(LOGLEVEL_INFO, "cFileTester: Removing %s", path.c_str());
-    DevMap::iterator it;
-    string s;
-    for (it = mDeviceMap.begin(); it != mDeviceMap.end(); it++) {
-        DEVINFO dev = it->second;
-        if (dev.devPath == path) {
-            mLogger->logmsg(LOGLEVEL_INFO, "Found %s", it->first.c_str());
-            RmLink(dev.linkPath);
-            mDeviceMap.erase (it);
+    mDevKit = devkit;
+    mMountError = false;
+    mLinkPath.clear();
+    mDetectedSuffixCache.clear();
+    if (!inDeviceSet(d.GetId())) {
+        if (!AutoMount(d)) {
+            mLogger->logmsg(LOGLEVEL_INFO, "cFileTester: Automount failed");
+            return false;
+        }
+        mLinkPath = mConfiguredLinkPath;
+        mAutoMount = mConfiguredAutoMount;
+        endScan(d);
+    }
+    return true;
+}
+
+// Build the cache of a media set up by applyCached. The device stays in
+// the device set and a media not mounted before is unmounted again.
+void cFileTester::startRevalidation (cMediaHandle &d, cDeviceBackend *devkit)
+{
+    mDevKit = devkit;
+    mMountError = false;
+    mLinkPath.clear();
+    mDetectedSuffixCache.clear();
+    try {
+        cCancelStage query(d.GetCancelToken(), cCancelToken::STAGE_PROPERTIES);
+        mRevalidationMount = !mDevKit->IsMounted(d.GetPath());
+    } catch (cDeviceKitException &e) {
+        mRevalidationMount = false;
+    }
+    if (!AutoMount(d)) {
+        mMountError = true;
+        return;
+    }
+    ScanMedia(d);
+}
+
+void cFileTester::endRevalidation (cMediaHandle &d)
+{
+    if ((!hasMountError()) && mRevalidationMount) {
+        Umount(d.GetPath());
+    }
+    mRevalidationMount = false;
+}
+
+void cFileTester::removeDevice (const cMediaHandle &d)
+{
+    mLogger->logmsg(LOGLEVEL_INFO, "cFileTester: Removing %s",
+                    d.GetPath().c_str());
+    DEVINFO devinfo;
+    {
+        lock_guard<mutex> lock(mDeviceMapMutex);
+        DevMap::iterator it = mDeviceMap.find(d.GetId());
+        if (it == mDeviceMap.end()) {
             return;
         }
+        devinfo = it->second;
+        mDeviceMap.erase (it);
     }
+    mLogger->logmsg(LOGLEVEL_INFO, "Found %s", devinfo.deviceFile.c_str());
+    RmLink(devinfo.linkPath);
 }
 
-// Try to auto mount the media
-bool cFileTester::AutoMount(string devpath)
+// Try to auto mount the media within the time limit of the mount
+bool cFileTester::AutoMount(const cMediaHandle &d)
 {
     int i;
+    const string &devpath = d.GetPath();
+    cCancelStage stage(d.GetCancelToken(), cCancelToken::STAGE_MOUNT);
     mMountPath.clear();
     // We will try several times since other tasks, for example
     // other window managers may also try to automount.
     for(i = 0; i < 3; i++)
     {
         try {
-            if (!mDevKit->IsMounted(devpath)) {
+            bool mounted;
+            {
+                cCancelStage query(d.GetCancelToken(),
+                                   cCancelToken::STAGE_PROPERTIES);
+                mounted = mDevKit->IsMounted(devpath);
+            }
+            if (!mounted) {
                 mLogger->logmsg(LOGLEVEL_INFO, "cFileTester: Try to AutoMount : %s",
                         mDevKit->AutoMount(devpath).c_str());
             }
+            cCancelStage query(d.GetCancelToken(),
+                               cCancelToken::STAGE_PROPERTIES);
             mMountPath = mDevKit->GetMountPaths(devpath).front();
 #ifdef DEBUG
             mLogger->logmsg(LOGLEVEL_INFO, "cFileTester: Mount Path >%s< %d",
@@ -302,7 +391,12 @@ bool cFileTester::AutoMount(string devpath)
 #endif
             return false;
         }
-        sleep(1);
+        if (!stage.Sleep(1000)) {
+            mLogger->logmsg(LOGLEVEL_INFO, "cFileTester: Mount of %s %s",
+                            d.GetDeviceFile().c_str(),
+                            stage.IsExpired() ? "timed out" : "cancelled");
+            return false;
+        }
     }
     return false;
 }
@@ -14,7 +14,8 @@
 #include <unistd.h>
 #include <string>
 #include <set>
-#include <map>
+#include <unordered_map>
+#include <mutex>
 #include "mediatester.h"
 #include "stringtools.h"
 
@@ -23,20 +24,25 @@ class cFileTester : public cMediaTester
 {
 private:
     typedef struct {
-        std::string devPath;
+        std::string deviceFile;
         std::string linkPath;
     } DEVINFO;
     typedef std::set<std::string> stringSet;
-    typedef std::map<std::string, DEVINFO> DevMap;
+    typedef std::unordered_map<DEVICE_ID, DEVINFO> DevMap;
 
-    static stringSet mDetectedSuffixCache;
+    // State of the scan running in this thread, the workers of the
+    // detection pool scan different devices at the same time.
+    static thread_local stringSet mDetectedSuffixCache;
+    static thread_local std::string mLinkPath;
+    static thread_local std::string mMountPath;
+    static thread_local bool mAutoMount;
+    static thread_local bool mMountError;
+    // The revalidation mounted the media, which was not mounted before
+    static thread_local bool mRevalidationMount;
+    static thread_local cDeviceBackend *mDevKit;
     // Devices which are already processed
     static DevMap mDeviceMap;
-    static std::string mLinkPath;
-    std::string mMountPath;
-    static bool mAutoMount;
-    bool mMountError;
-    cDbusDevkit *mDevKit;
+    static std::mutex mDeviceMapMutex;
 
     stringSet mSuffix;
     std::string mConfiguredLinkPath;
@@ -46,14 +52,16 @@ private:
     void ClearSuffixCache (void) {mDetectedSuffixCache.clear();}
     bool FindSuffix (const std::string str);
     std::string GetSuffix (const std::string str);
-    void BuildSuffixCache (std::string path);
-    bool inDeviceSet(const std::string dev) {
-        return (mDeviceMap.find(dev) != mDeviceMap.end());
+    bool BuildSuffixCache (std::string path, const cCancelStage &stage);
+    void ScanMedia (const cMediaHandle &d);
+    bool inDeviceSet(DEVICE_ID id) {
+        std::lock_guard<std::mutex> lock(mDeviceMapMutex);
+        return (mDeviceMap.find(id) != mDeviceMap.end());
     }
     bool RmLink(const std::string ln);
     void Link(const std::string ln);
     void Umount(const std::string devpath);
-    bool AutoMount(const std::string devpath);
+    bool AutoMount(const cMediaHandle &d);
     bool isAutoMounted (void) {return (!mMountPath.empty());}
     std::string GetMountPath (void) {return mMountPath;}
 
@@ -64,20 +72,23 @@ public:
         mRequiredKeys.insert("FILES");
         mOptionalKeys.insert("LINKPATH");
         mOptionalKeys.insert("AUTOMOUNT");
-        mMountError = false;
-        mMountPath.clear();
-        mDevKit = NULL;
     }
 
-    bool isMedia (const cMediaHandle d, stringList &keylist);
+    bool isMedia (const cMediaHandle &d, stringList &keylist);
+    // Media without a known file system, e.g. audio CDs, can not be mounted
+    MEDIA_MASK_T requiredMask (void) const { return MEDIA_AVAILABLE; }
+    MEDIA_MASK_T excludedMask (void) const { return MEDIA_FS_UNKNOWN; }
     cMediaTester *create(cLogger *l) const {
         return new cFileTester(l, mDescription, mExt);
     }
     bool loadConfig (cConfigFileParser config,
                        const std::string sectionname);
-    void startScan (cMediaHandle &d, cDbusDevkit *devkit);
+    void startScan (cMediaHandle &d, cDeviceBackend *devkit);
     void endScan (cMediaHandle &d);
-    void removeDevice (cMediaHandle d);
+    void removeDevice (const cMediaHandle &d);
+    bool applyCached (cMediaHandle &d, cDeviceBackend *devkit);
+    void startRevalidation (cMediaHandle &d, cDeviceBackend *devkit);
+    void endRevalidation (cMediaHandle &d);
     bool hasMountError(void) {return mMountError; }
 };
 
@@ -0,0 +1,204 @@
+/*
+ * mediacache.cc: Persistent cache of the detection results, indexed by the
+ *                identity of the media.
+ *
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * This code is distributed under the terms and conditions of the
+ * GNU GENERAL PUBLIC LICENSE. See the file COPYING for details.
+ */
+
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "mediacache.h"
+
+using namespace std;
+
+const char cMediaCache::MAGIC[8] = { 'A', 'S', 'M', 'C', 'A', 'C', 'H', 'E' };
+
+cMediaCache::cMediaCache(cLogger *logger)
+{
+    mLogger = logger;
+    mHeader = NULL;
+    mEntries = NULL;
+    mSize = 0;
+}
+
+cMediaCache::~cMediaCache()
+{
+    Close();
+}
+
+/*
+ * Map the cache file, a missing file or a file of another format or size
+ * is initialized empty.
+ */
+bool cMediaCache::Open(const string &filename, uint32_t entries)
+{
+    struct stat st;
+    void *map;
+
+    Close();
+    int fd = open(filename.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        mLogger->logmsg(LOGLEVEL_ERROR, "Can not open media cache %s: %s",
+                        filename.c_str(), strerror(errno));
+        return false;
+    }
+    size_t size = sizeof(HEADER) + entries * sizeof(ENTRY);
+    if ((fstat(fd, &st) != 0) ||
+        (((size_t)st.st_size != size) && (ftruncate(fd, size) != 0))) {
+        mLogger->logmsg(LOGLEVEL_ERROR, "Can not resize media cache %s: %s",
+                        filename.c_str(), strerror(errno));
+        close(fd);
+        return false;
+    }
+    map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        mLogger->logmsg(LOGLEVEL_ERROR, "Can not map media cache %s: %s",
+                        filename.c_str(), strerror(errno));
+        return false;
+    }
+
+    lock_guard<mutex> lock(mMutex);
+    mSize = size;
+    mHeader = (HEADER *)map;
+    mEntries = (ENTRY *)(mHeader + 1);
+    if ((memcmp(mHeader->magic, MAGIC, sizeof(MAGIC)) != 0) ||
+        (mHeader->version != VERSION) || (mHeader->entries != entries)) {
+        mLogger->logmsg(LOGLEVEL_INFO, "Initialize media cache %s",
+                        filename.c_str());
+        memset(map, 0, size);
+        memcpy(mHeader->magic, MAGIC, sizeof(MAGIC));
+        mHeader->version = VERSION;
+        mHeader->entries = entries;
+    }
+    return true;
+}
+
+void cMediaCache::Close(void)
+{
+    lock_guard<mutex> lock(mMutex);
+    if (mHeader != NULL) {
+        msync(mHeader, mSize, MS_SYNC);
+        munmap(mHeader, mSize);
+    }
+    mHeader = NULL;
+    mEntries = NULL;
+    mSize = 0;
+}
+
+// FNV-1a, 0 is reserved for free entries
+uint64_t cMediaCache::Hash(const string &identity)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    string::const_iterator it;
+    for (it = identity.begin(); it != identity.end(); it++) {
+        hash ^= (unsigned char)*it;
+        hash *= 1099511628211ULL;
+    }
+    return (hash == 0) ? 1 : hash;
+}
+
+// Must be called with the mutex held
+cMediaCache::ENTRY *cMediaCache::Find(uint64_t hash)
+{
+    for (uint32_t i = 0; i < mHeader->entries; i++) {
+        if (mEntries[i].hash == hash) {
+            return &mEntries[i];
+        }
+    }
+    return NULL;
+}
+
+bool cMediaCache::Copy(char *dest, size_t size, const string &src)
+{
+    if (src.length() >= size) {
+        return false;
+    }
+    memset(dest, 0, size);
+    memcpy(dest, src.data(), src.length());
+    return true;
+}
+
+bool cMediaCache::Lookup(const string &identity, RESULT &result)
+{
+    lock_guard<mutex> lock(mMutex);
+    if (mHeader == NULL) {
+        return false;
+    }
+    ENTRY *entry = Find(Hash(identity));
+    if (entry == NULL) {
+        return false;
+    }
+    entry->used = ++mHeader->clock;
+    result.section.assign(entry->section, strnlen(entry->section, MAX_SECTION));
+    result.description.assign(entry->description,
+                              strnlen(entry->description, MAX_DESCRIPTION));
+    result.keylist.clear();
+    string keys(entry->keys, strnlen(entry->keys, MAX_KEYS));
+    string::size_type start = 0;
+    string::size_type pos;
+    while ((pos = keys.find('\n', start)) != string::npos) {
+        result.keylist.push_back(keys.substr(start, pos - start));
+        start = pos + 1;
+    }
+    return true;
+}
+
+bool cMediaCache::Store(const string &identity, const RESULT &result)
+{
+    string keys;
+    stringList::const_iterator it;
+    for (it = result.keylist.begin(); it != result.keylist.end(); it++) {
+        keys += *it + '\n';
+    }
+    if ((result.section.length() >= MAX_SECTION) ||
+        (result.description.length() >= MAX_DESCRIPTION) ||
+        (keys.length() >= MAX_KEYS)) {
+        return false;
+    }
+
+    lock_guard<mutex> lock(mMutex);
+    if (mHeader == NULL) {
+        return false;
+    }
+    uint64_t hash = Hash(identity);
+    ENTRY *entry = Find(hash);
+    if (entry == NULL) {
+        // Free or least recently used entry
+        entry = &mEntries[0];
+        for (uint32_t i = 0; (i < mHeader->entries) && (entry->hash != 0); i++) {
+            if ((mEntries[i].hash == 0) || (mEntries[i].used < entry->used)) {
+                entry = &mEntries[i];
+            }
+        }
+    }
+    // An entry written only partially is never found
+    entry->hash = 0;
+    Copy(entry->section, MAX_SECTION, result.section);
+    Copy(entry->description, MAX_DESCRIPTION, result.description);
+    Copy(entry->keys, MAX_KEYS, keys);
+    entry->used = ++mHeader->clock;
+    entry->hash = hash;
+    msync(mHeader, mSize, MS_ASYNC);
+    return true;
+}
+
+void cMediaCache::Erase(const string &identity)
+{
+    lock_guard<mutex> lock(mMutex);
+    if (mHeader == NULL) {
+        return;
+    }
+    ENTRY *entry = Find(Hash(identity));
+    if (entry != NULL) {
+        entry->hash = 0;
+        msync(mHeader, mSize, MS_ASYNC);
+    }
+}
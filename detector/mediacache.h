@@ -0,0 +1,85 @@
+/*
+ * mediacache.h: Persistent cache of the detection results, indexed by the
+ *               identity of the media.
+ *
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * This code is distributed under the terms and conditions of the
+ * GNU GENERAL PUBLIC LICENSE. See the file COPYING for details.
+ */
+
+#ifndef MEDIACACHE_H_
+#define MEDIACACHE_H_
+
+#include <stdint.h>
+#include <string>
+#include <mutex>
+#include "logger.h"
+#include "stdtypes.h"
+
+// The cache file is mapped into memory, so a result is found without
+// reading the file and stored results survive a restart. The entries have
+// a fixed size, the least recently used entry is replaced when the cache
+// is full.
+class cMediaCache {
+public:
+    typedef struct {
+        // Section of the config file of the matching tester
+        std::string section;
+        std::string description;
+        stringList keylist;
+    } RESULT;
+
+    static const uint32_t DEFAULT_ENTRIES = 256;
+
+    cMediaCache(cLogger *logger);
+    ~cMediaCache();
+    bool Open(const std::string &filename, uint32_t entries = DEFAULT_ENTRIES);
+    void Close(void);
+    bool IsOpen(void) const { return mHeader != NULL; }
+    bool Lookup(const std::string &identity, RESULT &result);
+    // False if the result is too large for an entry
+    bool Store(const std::string &identity, const RESULT &result);
+    void Erase(const std::string &identity);
+
+private:
+    static const char MAGIC[8];
+    static const uint32_t VERSION = 1;
+    static const size_t MAX_SECTION = 64;
+    static const size_t MAX_DESCRIPTION = 64;
+    static const size_t MAX_KEYS = 512;
+
+    typedef struct {
+        char magic[8];
+        uint32_t version;
+        uint32_t entries;
+        // Incremented on each access, for the replacement
+        uint32_t clock;
+        uint32_t reserved;
+    } HEADER;
+    typedef struct {
+        // Hash of the identity, 0 for a free entry
+        uint64_t hash;
+        uint32_t used;
+        uint32_t reserved;
+        char section[MAX_SECTION];
+        char description[MAX_DESCRIPTION];
+        // Keys separated by newlines
+        char keys[MAX_KEYS];
+    } ENTRY;
+
+    cLogger *mLogger;
+    std::mutex mMutex;
+    HEADER *mHeader;
+    ENTRY *mEntries;
+    size_t mSize;
+
+    static uint64_t Hash(const std::string &identity);
+    ENTRY *Find(uint64_t hash);
+    static bool Copy(char *dest, size_t size, const std::string &src);
+
+    cMediaCache(const cMediaCache &);
+    cMediaCache &operator=(const cMediaCache &);
+};
+
+#endif /* MEDIACACHE_H_ */
@@ -10,67 +10,87 @@
  */
 #include <string>
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/inotify.h>
 #include "mediadetector.h"
 #include <assert.h>
+#include <algorithm>
+#include <chrono>
 #include <fstream>
 #include <iostream>
 #include <sstream>
 
 using namespace std;
 
+const int cMediaDetector::PROBE_SHUTDOWN_WAIT;
+
 cMediaDetector::~cMediaDetector()
 {
     MediaTesterList::iterator it;
+    map<string, TESTERSTATS>::iterator st;
+    if (mWatcher.joinable()) {
+        mWatchStop = true;
+        mWatchLoop.Wakeup();
+        mWatcher.join();
+    }
+    if (mIntake.joinable()) {
+        mIntakeStop = true;
+        mDevkit->Wakeup();
+        mIntake.join();
+    }
+    // The workers use the testers and the backend
+    mPool.Stop();
+    {
+        // A probe hanging on a drive is left behind after a while
+        unique_lock<mutex> lock(mProbeThreads->mutex);
+        if (!mProbeThreads->done.wait_for(lock,
+                chrono::milliseconds(PROBE_SHUTDOWN_WAIT),
+                [this] { return mProbeThreads->running == 0; })) {
+            mLogger->logmsg(LOGLEVEL_WARNING, "%d probes still running",
+                            mProbeThreads->running);
+        }
+    }
+    for (st = mStats.begin(); st != mStats.end(); st++) {
+        const TESTERSTATS &stats = st->second;
+        if (stats.probes > 0) {
+            mLogger->logmsg(LOGLEVEL_INFO, "[%s] %lu hits in %lu probes, %lld us per probe",
+                            st->first.c_str(), stats.hits,
+                            stats.probes, stats.cost / (long long)stats.probes);
+        }
+    }
+    // The registered testers are created from the known testers
+    mTesters.reset();
     for (it = mMediaTesters.begin(); it != mMediaTesters.end(); it++) {
         delete *it;
     }
-    for (it = mRegisteredMediaTesters.begin(); it != mRegisteredMediaTesters.end(); it++) {
-        delete *it;
+    // The logger of the detector is gone with it
+    if (mProbeThreads->logger) {
+        mProbeThreads->logger->Detach();
     }
+    delete mDevkit;
 }
 
-// Create a new instance for a tester, initialize this instance with the contens
-// of the config file and register this tester, for example
-// the file detector reads in the suffix list associated with a file detector
-// instance.
-void cMediaDetector::RegisterTester(const cMediaTester *tester,
-                                    const cConfigFileParser &config,
-                                    const string sectionname)
+void cMediaDetector::cProbeLogger::logmsg (LOG_LEVEL severity,
+                                            const char *format, ...)
 {
-    cMediaTester *t = tester->create(mLogger);
-    if (!t->loadConfig (mConfigFileParser, sectionname)) {
-        mLogger->logmsg(LOGLEVEL_ERROR, "Error on parsing %s", sectionname.c_str());
-        exit(-1);
+    char buf[1024];
+    va_list ap;
+    va_start(ap, format);
+    vsnprintf(buf, sizeof(buf), format, ap);
+    va_end(ap);
+    lock_guard<mutex> lock(mMutex);
+    if (mTarget != NULL) {
+        mTarget->logmsg(severity, "%s", buf);
     }
-    mRegisteredMediaTesters.push_back(t);
 }
 
-// Search the corresponding tester for the given TYPE keyword in the
-// config file and register an instance of this detector.
-bool cMediaDetector::AddDetector (const string section)
+void cMediaDetector::cProbeLogger::Detach(void)
 {
-    bool found = false;
-    stringList vals;
-    mLogger->logmsg(LOGLEVEL_INFO, "Section %s", section.c_str());
-    string type;
-    if (!mConfigFileParser.GetSingleValue(section, "TYPE", type)) {
-        mLogger->logmsg(LOGLEVEL_ERROR, "No type specified for section %s", section.c_str());
-        return false;
-    }
-
-    MediaTesterList::iterator it;
-    for (it = mMediaTesters.begin(); it != mMediaTesters.end(); it++) {
-        cMediaTester *te = *it;
-        if (te->typeMatches(type)) {
-            RegisterTester(te, mConfigFileParser, section);
-            found = true;
-        }
-    }
-
-    if (!found) {
-        mLogger->logmsg(LOGLEVEL_ERROR, "Invalid type %s", type.c_str());
-    }
-    return found;
+    lock_guard<mutex> lock(mMutex);
+    mTarget = NULL;
 }
 
 void cMediaDetector::ParseFstab (stringList &values)
@@ -108,7 +128,8 @@ void cMediaDetector::ParseFstab (stringList &values)
     }
 }
 
-// Read global options for the plugin
+// Read the global options of the plugin, which are not reloaded. The
+// options of the testers are read by the tester set.
 bool cMediaDetector::AddGlobalOptions (const string sectionname)
 {
     stringList vals;
@@ -127,17 +148,97 @@ bool cMediaDetector::AddGlobalOptions (const string sectionname)
                 autokeyword = true;
             }
             else {
-                mFilterDevices.insert(dev);
+                mDeviceFilter.AddPattern(dev);
             }
             mLogger->logmsg(LOGLEVEL_INFO, "Filter dev %s", dev.c_str());
         }
     }
+    if ((!mFixedBackend) && mConfigFileParser.HasKey(sectionname, "BACKEND")) {
+        if (mConfigFileParser.GetSingleValue(sectionname, "BACKEND", dev)) {
+            cDeviceBackend *backend = cDeviceBackend::Create(dev, mLogger);
+            if (backend == NULL) {
+                mLogger->logmsg(LOGLEVEL_ERROR, "Invalid backend %s", dev.c_str());
+            }
+            else {
+                delete mDevkit;
+                mDevkit = backend;
+                mLogger->logmsg(LOGLEVEL_INFO, "Backend %s", dev.c_str());
+            }
+        }
+    }
+    if ((!mFixedBackend) && mConfigFileParser.HasKey(sectionname, "TRACE")) {
+        if (mConfigFileParser.GetSingleValue(sectionname, "TRACE", dev)) {
+            cRecordingBackend *recorder = new cRecordingBackend(mLogger,
+                                                                mDevkit, dev);
+            mDevkit = recorder;
+            if (recorder->IsOpen()) {
+                mLogger->logmsg(LOGLEVEL_INFO, "Record trace %s", dev.c_str());
+            }
+        }
+    }
+    if (mConfigFileParser.HasKey(sectionname, "WORKERS")) {
+        if (mConfigFileParser.GetSingleValue(sectionname, "WORKERS", dev)) {
+            int workers = atoi(dev.c_str());
+            if (workers < 1) {
+                mLogger->logmsg(LOGLEVEL_ERROR, "Invalid number of workers %s",
+                                dev.c_str());
+            }
+            else {
+                mWorkers = workers;
+                mLogger->logmsg(LOGLEVEL_INFO, "Workers %d", workers);
+            }
+        }
+    }
+    if (mConfigFileParser.HasKey(sectionname, "MEDIACACHE")) {
+        if (mConfigFileParser.GetSingleValue(sectionname, "MEDIACACHE", dev)) {
+            if (mMediaCache.Open(dev)) {
+                mLogger->logmsg(LOGLEVEL_INFO, "Media cache %s", dev.c_str());
+            }
+        }
+    }
+    static const struct {
+        const char *key;
+        cCancelToken::STAGE stage;
+    } timeouts[] = {
+        { "PROPERTYTIMEOUT", cCancelToken::STAGE_PROPERTIES },
+        { "MOUNTTIMEOUT", cCancelToken::STAGE_MOUNT },
+        { "SCANTIMEOUT", cCancelToken::STAGE_SCAN },
+        { "PROBETIMEOUT", cCancelToken::STAGE_PROBE }
+    };
+    for (size_t i = 0; i < sizeof(timeouts) / sizeof(timeouts[0]); i++) {
+        if (mConfigFileParser.HasKey(sectionname, timeouts[i].key)) {
+            if (mConfigFileParser.GetSingleValue(sectionname, timeouts[i].key, dev)) {
+                int timeout = atoi(dev.c_str());
+                if (timeout < 0) {
+                    mLogger->logmsg(LOGLEVEL_ERROR, "Invalid %s %s",
+                                    timeouts[i].key, dev.c_str());
+                }
+                else {
+                    mTimeouts.stage[timeouts[i].stage] = timeout * 1000;
+                    mLogger->logmsg(LOGLEVEL_INFO, "%s %d s", timeouts[i].key,
+                                    timeout);
+                }
+            }
+        }
+    }
+    if (mConfigFileParser.HasKey(sectionname, "EVENTWINDOW")) {
+        if (mConfigFileParser.GetSingleValue(sectionname, "EVENTWINDOW", dev)) {
+            int window = atoi(dev.c_str());
+            if (window < 0) {
+                mLogger->logmsg(LOGLEVEL_ERROR, "Invalid event window %s", dev.c_str());
+            }
+            else {
+                mDevkit->SetEventWindow(window);
+                mLogger->logmsg(LOGLEVEL_INFO, "Event window %d ms", window);
+            }
+        }
+    }
     if (autokeyword) {
         vals.clear();
         ParseFstab (vals);
         for (it = vals.begin(); it != vals.end(); it++) {
             dev = *it;
-            mAutoFilterDevices.insert(dev);
+            mDeviceFilter.AddDevice(dev);
             mLogger->logmsg(LOGLEVEL_INFO, "Auto Filter dev %s", dev.c_str());
         }
     }
@@ -156,13 +257,16 @@ bool cMediaDetector::InitDetector(cLogger *logger,
     stringList::iterator it;
 
     mLogger = logger;
+    mConfigFile = initfile;
+    // The testers may still log in a probe thread left behind at the end
+    mProbeThreads->logger = make_shared<cProbeLogger>(logger);
+    cLogger *testerlog = mProbeThreads->logger.get();
 
     // Initialize known media testers
-    mRegisteredMediaTesters.clear();
     mMediaTesters.clear();
-    mMediaTesters.push_back(new cCdioTester(logger, "Audio CD", "CD"));
-    mMediaTesters.push_back(new cVideoDVDTester(logger, "Video DVD", "DVD"));
-    mMediaTesters.push_back(new cFileTester(logger, "Files", "FILE"));
+    mMediaTesters.push_back(new cCdioTester(testerlog, "Audio CD", "CD"));
+    mMediaTesters.push_back(new cVideoDVDTester(testerlog, "Video DVD", "DVD"));
+    mMediaTesters.push_back(new cFileTester(testerlog, "Files", "FILE"));
 
     if (!mConfigFileParser.Parse(initfile)) {
         return false;
@@ -173,97 +277,367 @@ bool cMediaDetector::InitDetector(cLogger *logger,
         return false;
     }
 
-    if (!AddGlobalOptions(sectionname)) {
-        if (!AddDetector(sectionname)) {
-            return false;
-        }
-    }
+    do {
+        AddGlobalOptions(sectionname);
+    } while (mConfigFileParser.GetNextSection(iter, sectionname));
 
-    while (mConfigFileParser.GetNextSection(iter, sectionname)) {
-        if (!AddGlobalOptions(sectionname)) {
-            if (!AddDetector(sectionname)) {
-                return false;
-            }
-        }
+    // An invalid tester section does not stop VDR, the detector starts
+    // without testers and waits for a corrected config file.
+    TesterSetPtr testers = LoadTesters(mConfigFileParser);
+    if (!testers) {
+        mLogger->logmsg(LOGLEVEL_ERROR, "No media testers until %s is corrected",
+                        initfile.c_str());
+        testers = make_shared<cTesterSet>(mProbeThreads->logger.get(),
+                                          mMediaTesters);
     }
+    atomic_store(&mTesters, testers);
 
     // Detect available devices for use in manual scan
 
     try {
-        vals = mDevkit.EnumerateDevices();
+        vals = mDevkit->EnumerateDevices();
         for (it = vals.begin(); it != vals.end(); it++) {
-            string dev = *it;
-            if (!mDevkit.IsPartition(dev) && (!InDeviceFilter(dev))) {
+            const string &dev = *it;
+            DEVICE_ID id = mRegistry.Intern(dev);
+            mRegistry.SetDeviceFile(id, mDevkit->GetDeviceFile(dev));
+            if (!mDevkit->IsPartition(dev) && (!InDeviceFilter(id))) {
                 mLogger->logmsg(LOGLEVEL_INFO, "Enumerate dev %s", dev.c_str());
-                mScanDevices.insert(dev);
+                mScanDevices.Insert(id);
             }
         }
     } catch (cDeviceKitException &e) {
         mLogger->logmsg(LOGLEVEL_ERROR, "Enumeration failed %s", e.what());
     }
+    mDevkit->SetCallTimeout(mTimeouts.stage[cCancelToken::STAGE_PROPERTIES]);
+    mPool.SetTimeouts(mTimeouts);
+    mPool.Start(mWorkers);
+    mIntake = thread(&cMediaDetector::Intake, this);
+    mWatcher = thread(&cMediaDetector::Watch, this);
     return true;
 }
 
-// Helper function to check if a device is in the exclude filters
-bool cMediaDetector::InDeviceFilter(const string dev)
+// Build the testers of a parsed config file, NULL if a section is invalid
+cMediaDetector::TesterSetPtr cMediaDetector::LoadTesters(cConfigFileParser &config)
 {
-    stringSet::iterator it;
-    string devalias;
+    shared_ptr<cTesterSet> testers = make_shared<cTesterSet>(
+                                        mProbeThreads->logger.get(),
+                                        mMediaTesters);
+    if (!testers->Load(config)) {
+        return TesterSetPtr();
+    }
+    return testers;
+}
 
-    // Perform a substring match for manually entered filter devices
-    for (it = mFilterDevices.begin(); it != mFilterDevices.end(); it++) {
-        string s = *it;
-        devalias = mDevkit.GetNativePath(dev);
-#ifdef DEBUG
-    mLogger->logmsg(LOGLEVEL_INFO, "GetNativePath %s",
-            devalias.c_str());
-#endif
-        if (devalias.find(s) != string::npos) {
-            return true;
+/*
+ * Watcher thread, reloads the config file when it was written. The
+ * directory is watched, since editors often replace the file by renaming
+ * a new one. The reload waits until the file was not changed for
+ * RELOAD_DELAY ms, so a file written in several steps is read once.
+ */
+void cMediaDetector::Watch(void)
+{
+    cEventLoop::FDEVENT events[cEventLoop::MAX_EVENTS];
+    char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    string dir = ".";
+    string name = mConfigFile;
+    string::size_type pos = mConfigFile.rfind('/');
+    int timeout = -1;
+    bool woken;
+
+    if (pos != string::npos) {
+        dir = mConfigFile.substr(0, pos + 1);
+        name = mConfigFile.substr(pos + 1);
+    }
+    int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (fd < 0) {
+        mLogger->logmsg(LOGLEVEL_ERROR, "inotify_init failed: %s", strerror(errno));
+        return;
+    }
+    if (inotify_add_watch(fd, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+        mLogger->logmsg(LOGLEVEL_ERROR, "Can not watch %s: %s", dir.c_str(),
+                        strerror(errno));
+        close(fd);
+        return;
+    }
+    mWatchLoop.SetFd(fd, EPOLLIN);
+
+    while (!mWatchStop) {
+        int n = mWatchLoop.Wait(timeout, events, cEventLoop::MAX_EVENTS, woken);
+        if (n > 0) {
+            ssize_t len;
+            while ((len = read(fd, buf, sizeof(buf))) > 0) {
+                for (char *p = buf; p < buf + len;) {
+                    struct inotify_event *ev = (struct inotify_event *)p;
+                    if ((ev->len > 0) && (name == ev->name)) {
+                        timeout = RELOAD_DELAY;
+                    }
+                    p += sizeof(struct inotify_event) + ev->len;
+                }
+            }
+        }
+        else if ((!woken) && (timeout >= 0)) {
+            timeout = -1;
+            Reload();
         }
     }
+    mWatchLoop.SetFd(fd, 0);
+    close(fd);
+}
 
-    // Perform exact match for automatic detected devices
-    for (it = mAutoFilterDevices.begin(); it != mAutoFilterDevices.end();
-         it++) {
-        string s = *it;
-        devalias = mDevkit.GetNativePath(dev);
-#ifdef DEBUG
-    mLogger->logmsg(LOGLEVEL_INFO, "GetNativePath %s",
-            devalias.c_str());
-#endif
-        if (devalias == s) {
+/*
+ * Parse the config file and replace the tester set. Detections in progress
+ * finish with the former set, which is deleted with its last user. An
+ * invalid file is rejected and the former set stays in use.
+ */
+bool cMediaDetector::Reload(void)
+{
+    cConfigFileParser config(mLogger);
+
+    mLogger->logmsg(LOGLEVEL_INFO, "Reload %s", mConfigFile.c_str());
+    if (!config.Parse(mConfigFile)) {
+        mLogger->logmsg(LOGLEVEL_ERROR, "Can not parse %s, keep the former configuration",
+                        mConfigFile.c_str());
+        return false;
+    }
+    TesterSetPtr testers = LoadTesters(config);
+    if (!testers) {
+        mLogger->logmsg(LOGLEVEL_ERROR, "Invalid %s, keep the former configuration",
+                        mConfigFile.c_str());
+        return false;
+    }
+    {
+        // Media which did not match may match the new testers
+        lock_guard<mutex> lock(mNegativeMutex);
+        atomic_store(&mTesters, testers);
+        mNegative.clear();
+    }
+    mLogger->logmsg(LOGLEVEL_INFO, "Reloaded %s", mConfigFile.c_str());
+    return true;
+}
+
+/*
+ * Intake thread, reads the device events from the backend while the
+ * detector thread handles the events before, so the events do not pile up
+ * in the backend.
+ */
+void cMediaDetector::Intake(void)
+{
+    QUEUED_EVENT queued;
+    queued.seq = 0;
+    while (!mIntakeStop) {
+        if (mDevkit->WaitDevkit(-1, queued.event)) {
+            queued.seq++;
+            if (queued.event.signal == cDeviceBackend::DeviceRemoved) {
+                lock_guard<mutex> lock(mRemovalMutex);
+                mRemovals[queued.event.path] = queued.seq;
+            }
+            while ((!mEvents.Push(queued)) && (!mIntakeStop)) {
+                // Full, wait until the detector thread takes an event
+                unique_lock<mutex> lock(mWakeMutex);
+                mEventTaken.wait_for(lock, chrono::milliseconds(100));
+            }
+            Wakeup();
+        }
+        else if (mDevkit->Finished()) {
+            mIntakeFinished = true;
+            Wakeup();
+            return;
+        }
+    }
+}
+
+void cMediaDetector::Wakeup(void)
+{
+    lock_guard<mutex> lock(mWakeMutex);
+    mWoken = true;
+    mWake.notify_all();
+}
+
+// Take the next device event, false if the detector was woken up for
+// something else.
+bool cMediaDetector::WaitEvent(cDeviceBackend::DEVICE_EVENT &event)
+{
+    QUEUED_EVENT queued;
+    bool dropped = false;
+    for (;;) {
+        if (!mEvents.Pop(queued)) {
+            // The wakeup may have been for a result, do not wait again
+            if (dropped) {
+                return false;
+            }
+            unique_lock<mutex> lock(mWakeMutex);
+            mWake.wait(lock, [this] { return mWoken || mIntakeFinished; });
+            mWoken = false;
+            lock.unlock();
+            if (!mEvents.Pop(queued)) {
+                return false;
+            }
+        }
+        mEventTaken.notify_all();
+        if (!Superseded(queued)) {
+            event = queued.event;
             return true;
         }
-        devalias = mDevkit.GetDeviceFileById(dev).front();
+        dropped = true;
+    }
+}
+
+// True if the device was removed after the event was queued, the removal
+// follows in the queue.
+bool cMediaDetector::Superseded(const QUEUED_EVENT &queued)
+{
+    lock_guard<mutex> lock(mRemovalMutex);
+    unordered_map<string, unsigned long>::iterator it =
+                                        mRemovals.find(queued.event.path);
+    if (it == mRemovals.end()) {
+        return false;
+    }
+    if (queued.event.signal == cDeviceBackend::DeviceRemoved) {
+        if (it->second == queued.seq) {
+            mRemovals.erase(it);
+        }
+        return false;
+    }
+    if (queued.seq > it->second) {
+        return false;
+    }
 #ifdef DEBUG
-    mLogger->logmsg(LOGLEVEL_INFO, "GetDeviceFileById %s",
-            devalias.c_str());
+    mLogger->logmsg(LOGLEVEL_INFO, "Drop event %d for removed %s",
+                    queued.event.signal, queued.event.path.c_str());
 #endif
-        if (devalias == s) {
-            return true;
+    return true;
+}
+
+// Register the device of a media handle and store its id in the handle
+void cMediaDetector::RegisterDevice(cMediaHandle &mediainfo)
+{
+    DEVICE_ID id = mRegistry.Intern(mediainfo.GetPath());
+    mRegistry.SetDeviceFile(id, mediainfo.GetDeviceFile());
+    mediainfo.SetId(id);
+    // The device is back before its id was released
+    mReleasing.Erase(id);
+}
+
+// Release the ids of removed devices, which are not used by the detection
+// pool any more. The devices to scan keep their ids, they are scanned even
+// when they are not present.
+void cMediaDetector::ReleaseDevices(void)
+{
+    cDeviceSet::IdList::iterator it;
+    cDeviceSet::IdList ids = mReleasing.GetIds();
+    for (it = ids.begin(); it != ids.end(); it++) {
+        if (!mPool.HasJobs(*it)) {
+            mReleasing.Erase(*it);
+            mRegistry.Release(*it);
         }
-        devalias = mDevkit.GetDeviceFileByPath(dev).front();
+    }
+}
+
+// Check if a device is in the exclude filters. The filters are resolved to
+// device numbers, so only devices without a device number known to the
+// registry (e.g. replayed from a trace) need queries to the backend.
+bool cMediaDetector::InDeviceFilter(DEVICE_ID id)
+{
+    if (mDeviceFilter.Empty()) {
+        return false;
+    }
+    dev_t devnum = mRegistry.GetDevNum(id);
+    if (devnum != 0) {
+        return mDeviceFilter.Contains(devnum);
+    }
+    return MatchDeviceFilter(mRegistry.GetPath(id));
+}
+
+// Helper function to check if a device is in the exclude filters
+bool cMediaDetector::MatchDeviceFilter(const string &dev)
+{
+    stringList vals;
+    string nativepath = mDevkit->GetNativePath(dev);
 #ifdef DEBUG
-    mLogger->logmsg(LOGLEVEL_INFO, "GetDeviceFileByPath %s",
-            devalias.c_str());
+    mLogger->logmsg(LOGLEVEL_INFO, "GetNativePath %s", nativepath.c_str());
 #endif
-        if (devalias == s) {
-            return true;
-        }
+    // Perform a substring match for manually entered filter devices and
+    // an exact match for automatic detected devices
+    if (mDeviceFilter.MatchPattern(nativepath) ||
+        mDeviceFilter.MatchDevice(nativepath)) {
+        return true;
+    }
+    vals = mDevkit->GetDeviceFileById(dev);
+    if ((!vals.empty()) && mDeviceFilter.MatchDevice(vals.front())) {
+        return true;
+    }
+    vals = mDevkit->GetDeviceFileByPath(dev);
+    if ((!vals.empty()) && mDeviceFilter.MatchDevice(vals.front())) {
+        return true;
     }
     return false;
 }
 
 // Handle when a device is removed
-void cMediaDetector::DoDeviceRemoved(cMediaHandle mediainfo)
+void cMediaDetector::DoDeviceRemoved(const cMediaHandle &mediainfo)
 {
-    MediaTesterList::iterator it;
 #ifdef DEBUG
     mLogger->logmsg(LOGLEVEL_INFO, "Device Remove %s",
                    mediainfo.GetDeviceFile().c_str());
 #endif
-    // Cleanup device caches for each detector
+    // Cleanup device caches for each detector after a running detection
+    // of the device
+    mPool.Remove(mediainfo);
+    mKnownDevices.Erase(mediainfo.GetId());
+    lock_guard<mutex> lock(mNegativeMutex);
+    mNegative.erase(mediainfo.GetId());
+}
+
+// Hash of the properties, which change with the inserted media
+size_t cMediaDetector::MediaGeneration(const cMediaHandle &mediainfo)
+{
+    return hash<string>()(to_string(mediainfo.GetMediaMask()) + '\t' +
+                          mediainfo.GetDeviceFile() + '\t' +
+                          mediainfo.GetType() + '\t' +
+                          mediainfo.GetUuid() + '\t' +
+                          mediainfo.GetLabel() + '\t' +
+                          to_string(mediainfo.GetSize()));
+}
+
+// Check if the media of the device did not match before
+bool cMediaDetector::IsNegative(const cMediaHandle &mediainfo)
+{
+    lock_guard<mutex> lock(mNegativeMutex);
+    unordered_map<DEVICE_ID, NEGATIVE>::iterator it;
+    it = mNegative.find(mediainfo.GetId());
+    if (it == mNegative.end()) {
+        return false;
+    }
+    if ((it->second.generation != MediaGeneration(mediainfo)) ||
+        (cDeviceBackend::Now() >= it->second.expires)) {
+        mNegative.erase(it);
+        return false;
+    }
+    return true;
+}
+
+// The testers may have been reloaded during the detection, the media may
+// match the new testers.
+void cMediaDetector::AddNegative(const cMediaHandle &mediainfo,
+                                 const TesterSetPtr &testers)
+{
+    // A detection cancelled by the removal of the device has not tested
+    // the media
+    if ((testers->GetNegativeTTL() == 0) || mediainfo.IsCancelled()) {
+        return;
+    }
+    NEGATIVE entry;
+    entry.generation = MediaGeneration(mediainfo);
+    entry.expires = cDeviceBackend::Now() + testers->GetNegativeTTL() * 1000LL;
+    lock_guard<mutex> lock(mNegativeMutex);
+    if (atomic_load(&mTesters) == testers) {
+        mNegative[mediainfo.GetId()] = entry;
+    }
+}
+
+void cMediaDetector::RemoveMedia(const cMediaHandle &mediainfo)
+{
+    MediaTesterList::iterator it;
     for (it = mMediaTesters.begin(); it != mMediaTesters.end(); it++) {
         cMediaTester *t = *it;
         try {
@@ -272,171 +646,741 @@ void cMediaDetector::DoDeviceRemoved(cMediaHandle mediainfo)
             mLogger->logmsg(LOGLEVEL_INFO, "DeviceKit Error %s", e.what());
         }
     }
-    mKnownDevices.erase(mediainfo.GetDeviceFile());
 }
 
-bool cMediaDetector::DoManualScan(cMediaHandle &mediainfo,
-                                  string &description,  stringList &vl)
+// Start the detection of all known devices and all devices to scan. Only
+// the first media found is reported.
+void cMediaDetector::DoManualScan(cMediaHandle &mediainfo)
 {
-    stringSet::iterator it;
-    for (it = mKnownDevices.begin(); it != mKnownDevices.end(); it++) {
-        string path = *it;
+    cDeviceSet::IdList::iterator it;
+    cDeviceSet::IdList ids = mKnownDevices.GetIds();
+    cDeviceSet::IdList scanids = mScanDevices.GetIds();
+    stringList paths;
+    unsigned int group = mPool.NewGroup();
+
+    // Known devices first, then the devices to always scan
+    ids.insert(ids.end(), scanids.begin(), scanids.end());
+    // Fetch the properties of all devices with pipelined calls
+    for (it = ids.begin(); it != ids.end(); it++) {
+        paths.push_back(mRegistry.GetPath(*it));
+    }
+    try {
+        mDevkit->PrefetchProperties(paths);
+    } catch (cDeviceKitException &e) {
+        mLogger->logmsg(LOGLEVEL_INFO, "DeviceKit Error %s", e.what());
+    }
+    for (it = ids.begin(); it != ids.end(); it++) {
+        const string &path = mRegistry.GetPath(*it);
         mLogger->logmsg(LOGLEVEL_INFO, "Manual Scan %s", path.c_str());
-        try {
-            mediainfo.GetDescription(mDevkit, path);
-            if (DoDetect (mediainfo, description, vl)) {
-                return true;
+        if (mediainfo.GetDescription(*mDevkit, path)) {
+            RegisterDevice(mediainfo);
+            if (IsNegative(mediainfo)) {
+                mLogger->logmsg(LOGLEVEL_INFO, "No media known on %s",
+                                path.c_str());
+                continue;
             }
-        } catch (cDeviceKitException &e) {
-            mLogger->logmsg(LOGLEVEL_INFO, "DeviceKit Error %s", e.what());
+            mPool.Detect(mediainfo, group);
         }
     }
-    for (it = mScanDevices.begin(); it != mScanDevices.end(); it++) {
-        string path = *it;
-        mLogger->logmsg(LOGLEVEL_INFO, "Manual Scan %s", path.c_str());
+}
+
+// Remember the device for manual scans and start the detection
+void cMediaDetector::DoDetect(const cMediaHandle &mediainfo)
+{
+    DEVICE_ID id = mediainfo.GetId();
+    if (!mScanDevices.Contains(id)) {
+        mKnownDevices.Insert(id);
+    }
+    if (mWorkingMode == MANUAL_START) {
+        return;
+    }
+    if (IsNegative(mediainfo)) {
+#ifdef DEBUG
+        mLogger->logmsg(LOGLEVEL_INFO, "No media known on %s",
+                        mediainfo.GetDeviceFile().c_str());
+#endif
+        return;
+    }
+    mPool.Detect(mediainfo, mPool.NewGroup());
+}
+
+/*
+ * Detect the media, called by the workers of the pool. A media detected
+ * before is taken from the media cache without a scan, the result is
+ * revalidated by a scan in the background afterwards. The revalidation
+ * reports a result only if it corrects the cached one.
+ */
+bool cMediaDetector::DetectMedia(cMediaHandle &mediainfo,
+                                     string &description, stringList &vl,
+                                     bool revalidate)
+{
+    stringList keylist;
+    cMediaTester *match;
+    MEDIA_MASK_T m = mediainfo.GetMediaMask();
+    // Keep the testers of this detection alive during a reload
+    TesterSetPtr testers = atomic_load(&mTesters);
+    const DISPATCH &entry = testers->GetDispatch(m);
+    CACHE_STATE cache;
+
+    // A manual scan may find a device without media, forget its former
+    // media
+    if (!(m & MEDIA_AVAILABLE)) {
+        RemoveMedia(mediainfo);
+    }
+    if (entry.testers.empty()) {
+        AddNegative(mediainfo, testers);
+        return false;
+    }
+
+    // A media without a file system identity is identified by the probes
+    cache.hit = false;
+    cache.applied = false;
+    cache.revalidate = revalidate;
+    cache.failed = false;
+    if (mMediaCache.IsOpen()) {
+        cache.identity = MediaIdentity(mediainfo);
+        cache.hit = (!cache.identity.empty()) &&
+                    mMediaCache.Lookup(cache.identity, cache.cached);
+    }
+    if (cache.hit && (!revalidate)) {
+        match = ApplyCached(entry, mediainfo, cache.cached.section, false);
+        if (match != NULL) {
+            mLogger->logmsg(LOGLEVEL_INFO, "Found %s in media cache",
+                            cache.cached.description.c_str());
+            description = cache.cached.description;
+            vl = cache.cached.keylist;
+            mPool.Revalidate(mediainfo);
+            return true;
+        }
+    }
+
+    match = ScanMedia(testers, mediainfo, description, keylist, cache);
+    if (cache.applied) {
+        mLogger->logmsg(LOGLEVEL_INFO, "Found %s in media cache",
+                        description.c_str());
+        vl = keylist;
+        mPool.Revalidate(mediainfo);
+        return true;
+    }
+    // A time limit or an error may have hidden a match, the media is tried
+    // again with the next signal
+    if ((mediainfo.GetCancelToken() != NULL) &&
+        mediainfo.GetCancelToken()->HasExpired()) {
+        cache.failed = true;
+    }
+    if ((match == NULL) && (!revalidate) && (!cache.failed)) {
+        AddNegative(mediainfo, testers);
+    }
+    if (cache.identity.empty()) {
+        if (match != NULL) {
+            vl = keylist;
+        }
+        return (match != NULL);
+    }
+    if (match == NULL) {
+        // The device may have been removed during the revalidation
         try {
-            mediainfo.GetDescription(mDevkit, path);
-            if (DoDetect (mediainfo, description, vl)) {
-                return true;
+            cCancelStage query(mediainfo.GetCancelToken(),
+                               cCancelToken::STAGE_PROPERTIES);
+            if (cache.hit && mDevkit->IsMediaAvailable(mediainfo.GetPath())) {
+                mMediaCache.Erase(cache.identity);
             }
         } catch (cDeviceKitException &e) {
             mLogger->logmsg(LOGLEVEL_INFO, "DeviceKit Error %s", e.what());
         }
+        return false;
     }
+    cMediaCache::RESULT result;
+    result.section = match->GetSection();
+    result.description = description;
+    result.keylist = keylist;
+    mMediaCache.Store(cache.identity, result);
+    if (revalidate) {
+        if ((!cache.hit) || ((cache.cached.section == result.section) &&
+                             (cache.cached.keylist == result.keylist))) {
+            return false;
+        }
+        mLogger->logmsg(LOGLEVEL_INFO, "Media cache corrected to [%s]",
+                        result.section.c_str());
+        if (cache.cached.section != result.section) {
+            // Undo the setup of the cached tester, e.g. its link
+            RemoveMedia(mediainfo);
+            if (!match->applyCached(mediainfo, mDevkit)) {
+                return false;
+            }
+        }
+    }
+    vl = keylist;
+    return true;
+}
 
-    return false;
+// Identity of the media from its file system, empty if it has none
+string cMediaDetector::MediaIdentity(const cMediaHandle &mediainfo)
+{
+    if (mediainfo.GetUuid().empty()) {
+        return "";
+    }
+    return "FS:" + mediainfo.GetUuid() + ":" + mediainfo.GetLabel() +
+           ":" + to_string(mediainfo.GetSize());
 }
 
-bool cMediaDetector::DoDetect(cMediaHandle &mediainfo,
-                                  string &description,  stringList &vl)
+/*
+ * A probe returned the identity of a media without a file system identity.
+ * The first identity returned is the identity of the media in the cache.
+ * True if it is found in the cache and the cached result may replace the
+ * remaining probes.
+ */
+bool cMediaDetector::ProbedIdentity(const string &identity, CACHE_STATE &cache)
 {
-    stringList keylist;
-    bool found = false;
-    MediaTesterList::iterator it;
-    string dev = mediainfo.GetDeviceFile();
-    if (!mManualScan) {
-        if (mScanDevices.find(dev) == mScanDevices.end()) {
-            mKnownDevices.insert(dev);
-        }
-        if (mWorkingMode == MANUAL_START) {
-            return (false);
+    if (identity.empty() || (!cache.identity.empty()) ||
+        (!mMediaCache.IsOpen())) {
+        return false;
+    }
+    cache.identity = identity;
+    cache.hit = mMediaCache.Lookup(identity, cache.cached);
+    return cache.hit && (!cache.revalidate);
+}
+
+// Set up the media for the cached tester, NULL if the tester is no longer
+// configured or can not be applied. During a scan only the cached result of
+// an independent tester is applied, the scan hooks of the other testers are
+// running.
+cMediaTester *cMediaDetector::ApplyCached(const DISPATCH &entry,
+                                              cMediaHandle &mediainfo,
+                                              const string &section,
+                                              bool scanning)
+{
+    MediaTesterVector::const_iterator it;
+    for (it = entry.testers.begin(); it != entry.testers.end(); it++) {
+        cMediaTester *t = *it;
+        if (t->GetSection() == section) {
+            if (scanning && (!t->isIndependent())) {
+                return NULL;
+            }
+            try {
+                return t->applyCached(mediainfo, mDevkit) ? t : NULL;
+            } catch (cDeviceKitException &e) {
+                mLogger->logmsg(LOGLEVEL_INFO, "DeviceKit Error %s", e.what());
+                return NULL;
+            }
         }
     }
+    return NULL;
+}
+
+// Take the cached result found by ProbedIdentity, NULL if it can not be
+// applied
+cMediaTester *cMediaDetector::ApplyProbed(const TesterSetPtr &testerset,
+                                              cMediaHandle &mediainfo,
+                                              CACHE_STATE &cache,
+                                              string &description,
+                                              stringList &keylist)
+{
+    const DISPATCH &entry = testerset->GetDispatch(mediainfo.GetMediaMask());
+    cMediaTester *match = ApplyCached(entry, mediainfo, cache.cached.section,
+                                      true);
+    if (match != NULL) {
+        description = cache.cached.description;
+        keylist = cache.cached.keylist;
+        cache.applied = true;
+    }
+    return match;
+}
+
+// Run the testers of a media mask, NULL if no tester matches
+cMediaTester *cMediaDetector::ScanMedia(const TesterSetPtr &testerset,
+                                            cMediaHandle &mediainfo,
+                                            string &description,
+                                            stringList &keylist,
+                                            CACHE_STATE &cache)
+{
+    const DISPATCH &entry = testerset->GetDispatch(mediainfo.GetMediaMask());
+    cMediaTester *match;
+    MediaTesterVector::const_iterator it;
+    bool revalidate = cache.revalidate;
+
     // Initialize scan for each detector, e.g. the file detector will
     // build its cache.
-    for (it = mMediaTesters.begin(); it != mMediaTesters.end(); it++) {
+    for (it = entry.scanners.begin(); it != entry.scanners.end(); it++) {
         cMediaTester *t = *it;
         try {
-            t->startScan(mediainfo, &mDevkit);
+            if (revalidate) {
+                t->startRevalidation(mediainfo, mDevkit);
+            }
+            else {
+                t->startScan(mediainfo, mDevkit);
+            }
         } catch (cDeviceKitException &e) {
             mLogger->logmsg(LOGLEVEL_INFO, "DeviceKit Error %s", e.what());
+            cache.failed = true;
         }
     }
 
     // Do scan
-    for (it = mRegisteredMediaTesters.begin();
-         it != mRegisteredMediaTesters.end(); it++) {
+    MediaTesterVector testers = testerset->GetAdaptiveOrder() ?
+                                OrderTesters(entry.testers) : entry.testers;
+    if (testerset->GetParallelTesters()) {
+        match = RunTestersParallel(testerset, testers, mediainfo, description,
+                                   keylist, cache);
+    }
+    else {
+        match = RunTesters(testerset, testers, mediainfo, description,
+                           keylist, cache);
+    }
+
+    // Cleanup caches for each detector
+    for (it = entry.scanners.begin(); it != entry.scanners.end(); it++) {
         cMediaTester *t = *it;
         try {
-            if (t->isMedia(mediainfo, keylist)) {
-                mLogger->logmsg(LOGLEVEL_INFO, "Found %s",
-                        t->GetDescription().c_str());
-#ifdef DEBUG
-                logkeylist(keylist);
-#endif
-                description = t->GetDescription();
-                found = true;
-                break;
+            if (revalidate) {
+                t->endRevalidation(mediainfo);
+            }
+            else {
+                t->endScan(mediainfo);
             }
         } catch (cDeviceKitException &e) {
             mLogger->logmsg(LOGLEVEL_INFO, "DeviceKit Error %s", e.what());
         }
     }
+    return match;
+}
 
-    // Cleanup caches for each detector
-    for (it = mMediaTesters.begin(); it != mMediaTesters.end(); it++) {
-        cMediaTester *t = *it;
-        try {
-            t->endScan(mediainfo);
-        } catch (cDeviceKitException &e) {
-            mLogger->logmsg(LOGLEVEL_INFO, "DeviceKit Error %s", e.what());
+/*
+ * Order the testers of each priority by the expected cost to find the
+ * match: the average probe time divided by the hit rate. Testers without
+ * statistics yet are tried first.
+ */
+cMediaDetector::MediaTesterVector cMediaDetector::OrderTesters(
+                                        const MediaTesterVector &testers)
+{
+    MediaTesterVector retval = testers;
+    map<cMediaTester *, double> score;
+    MediaTesterVector::const_iterator it;
+    {
+        lock_guard<mutex> lock(mStatsMutex);
+        for (it = testers.begin(); it != testers.end(); it++) {
+            const TESTERSTATS &stats = mStats[(*it)->GetSection()];
+            double cost = (stats.probes == 0) ? 0 :
+                          (double)stats.cost / stats.probes;
+            double hitrate = (stats.hits + 1.0) / (stats.probes + 2.0);
+            score[*it] = (cost + 1.0) / hitrate;
         }
     }
+    stable_sort(retval.begin(), retval.end(),
+                [&score](cMediaTester *a, cMediaTester *b) {
+                    if (a->GetPriority() != b->GetPriority()) {
+                        return a->GetPriority() > b->GetPriority();
+                    }
+                    return score[a] < score[b];
+                });
+    return retval;
+}
 
-    if (found) {
-        vl = keylist;
+// Run one tester and measure its time in us. Touches no state of the
+// detector, so it may run in a probe thread.
+bool cMediaDetector::ProbeMedia(cMediaTester *tester,
+                                    const cMediaHandle &mediainfo,
+                                    stringList &keylist, string &identity,
+                                    string &error, long long &cost)
+{
+    bool found = false;
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    try {
+        found = tester->probeMedia(mediainfo, keylist, identity);
+    } catch (cDeviceKitException &e) {
+        error = e.what();
     }
+    cost = chrono::duration_cast<chrono::microseconds>(
+                            chrono::steady_clock::now() - start).count();
     return found;
 }
 
+// Record the hit and time of a tester
+void cMediaDetector::RecordProbe(cMediaTester *tester, bool found,
+                                     long long cost, const string &error)
+{
+    if (!error.empty()) {
+        mLogger->logmsg(LOGLEVEL_INFO, "DeviceKit Error %s", error.c_str());
+    }
+    lock_guard<mutex> lock(mStatsMutex);
+    TESTERSTATS &stats = mStats[tester->GetSection()];
+    stats.probes++;
+    stats.cost += cost;
+    if (found) {
+        stats.hits++;
+    }
+}
+
+// Run one tester in this thread and record its hit and time
+cMediaDetector::PROBE_STATUS cMediaDetector::ProbeTester(cMediaTester *tester,
+                                                             const cMediaHandle &mediainfo,
+                                                             stringList &keylist,
+                                                             string &identity)
+{
+    string error;
+    long long cost;
+    bool found = ProbeMedia(tester, mediainfo, keylist, identity, error, cost);
+    RecordProbe(tester, found, cost, error);
+    if (!error.empty()) {
+        return PROBE_FAILED;
+    }
+    return found ? PROBE_MATCH : PROBE_NOMATCH;
+}
+
+// Run the testers one after another in the order of their priority
+cMediaTester *cMediaDetector::RunTesters(const TesterSetPtr &testerset,
+                                    const MediaTesterVector &testers,
+                                    cMediaHandle &mediainfo,
+                                    string &description, stringList &keylist,
+                                    CACHE_STATE &cache)
+{
+    MediaTesterVector::const_iterator it;
+    for (it = testers.begin(); it != testers.end(); it++) {
+        cMediaTester *t = *it;
+        string identity;
+        PROBE_STATUS status;
+        // The device was removed or the detector stops
+        if (mediainfo.IsCancelled()) {
+            return NULL;
+        }
+        if (t->isIndependent()) {
+            status = ProbeDetached(testerset, t, mediainfo, keylist, identity);
+        }
+        else {
+            status = ProbeTester(t, mediainfo, keylist, identity);
+        }
+        bool found = (status == PROBE_MATCH);
+        if (Failed(status)) {
+            cache.failed = true;
+        }
+        if (ProbedIdentity(identity, cache) && (!found)) {
+            cMediaTester *match = ApplyProbed(testerset, mediainfo, cache,
+                                              description, keylist);
+            if (match != NULL) {
+                return match;
+            }
+        }
+        if (found) {
+            mLogger->logmsg(LOGLEVEL_INFO, "Found %s",
+                    t->GetDescription().c_str());
+#ifdef DEBUG
+            logkeylist(keylist);
+#endif
+            description = t->GetDescription();
+            return t;
+        }
+    }
+    return NULL;
+}
+
+// Results of the probe threads of one media with count testers
+shared_ptr<cMediaDetector::PROBES> cMediaDetector::NewProbes(
+                                        const TesterSetPtr &testerset,
+                                        const cMediaHandle &mediainfo,
+                                        size_t count)
+{
+    shared_ptr<PROBES> probes = make_shared<PROBES>();
+    probes->testers = testerset;
+    probes->mediainfo = mediainfo;
+    probes->status.assign(count, PROBE_PENDING);
+    probes->keylists.resize(count);
+    probes->identities.resize(count);
+    probes->errors.resize(count);
+    probes->costs.assign(count, 0);
+    probes->running = 0;
+    probes->decided = false;
+    return probes;
+}
+
+/*
+ * Start the probe thread of a tester, false if no thread is started. At
+ * most MAX_PROBE_THREADS threads run at the same time, a probe waits for
+ * a free thread within its stage. A device still read by a probe of an
+ * earlier detection, e.g. a hanging drive, is not probed again.
+ */
+bool cMediaDetector::StartProbe(const shared_ptr<PROBES> &probes,
+                                    cMediaTester *tester, size_t index,
+                                    const cCancelStage &stage)
+{
+    PROBE_THREADS &threads = *mProbeThreads;
+    const string &device = probes->mediainfo.GetDeviceFile();
+    unique_lock<mutex> lock(threads.mutex);
+    while ((threads.running >= MAX_PROBE_THREADS) && (!stage.IsCancelled())) {
+        threads.done.wait_for(lock, chrono::milliseconds(cCancelToken::POLL_INTERVAL));
+    }
+    map<string, const PROBES *>::iterator it = threads.devices.find(device);
+    if ((it != threads.devices.end()) && (it->second != probes.get())) {
+        mLogger->logmsg(LOGLEVEL_WARNING, "Probe of %s still running",
+                        device.c_str());
+        probes->status[index] = PROBE_FAILED;
+        return false;
+    }
+    if (threads.running >= MAX_PROBE_THREADS) {
+        return false;
+    }
+    threads.running++;
+    probes->running++;
+    threads.devices[device] = probes.get();
+    thread(&cMediaDetector::Probe, mProbeThreads, probes, tester, index).detach();
+    return true;
+}
+
+// Probe thread of an independent tester, uses only the shared state, as
+// the detector may be gone when the tester returns.
+void cMediaDetector::Probe(shared_ptr<PROBE_THREADS> threads,
+                              shared_ptr<PROBES> probes, cMediaTester *tester,
+                              size_t index)
+{
+    stringList keylist;
+    string identity;
+    string error;
+    long long cost = 0;
+    bool found = false;
+    bool cancelled;
+    {
+        lock_guard<mutex> lock(threads->mutex);
+        cancelled = probes->decided;
+    }
+    // A tester with higher priority may have matched in the meantime or
+    // the detection was cancelled
+    if ((!cancelled) && (!probes->mediainfo.IsCancelled())) {
+        found = ProbeMedia(tester, probes->mediainfo, keylist, identity,
+                           error, cost);
+    }
+    {
+        lock_guard<mutex> lock(threads->mutex);
+        probes->status[index] = found ? PROBE_MATCH : PROBE_NOMATCH;
+        probes->keylists[index] = keylist;
+        probes->identities[index] = identity;
+        probes->errors[index] = error;
+        probes->costs[index] = cost;
+        threads->running--;
+        if (--probes->running == 0) {
+            threads->devices.erase(probes->mediainfo.GetDeviceFile());
+        }
+    }
+    threads->done.notify_all();
+}
+
+/*
+ * Wait for the result of a probe thread and take its key list and identity,
+ * PROBE_PENDING if the stage is cancelled before. A tester not started is
+ * not recorded.
+ */
+cMediaDetector::PROBE_STATUS cMediaDetector::WaitProbe(const PROBES &probes,
+                                                           size_t index,
+                                                           cMediaTester *tester,
+                                                           const cCancelStage &stage,
+                                                           stringList &keylist,
+                                                           string &identity)
+{
+    PROBE_THREADS &threads = *mProbeThreads;
+    unique_lock<mutex> lock(threads.mutex);
+    while ((probes.status[index] == PROBE_PENDING) && (!stage.IsCancelled())) {
+        threads.done.wait_for(lock, chrono::milliseconds(cCancelToken::POLL_INTERVAL));
+    }
+    PROBE_STATUS status = probes.status[index];
+    if (status == PROBE_PENDING) {
+        mLogger->logmsg(LOGLEVEL_WARNING, "Probe of %s %s",
+                        probes.mediainfo.GetDeviceFile().c_str(),
+                        stage.IsExpired() ? "timed out" : "cancelled");
+        return status;
+    }
+    if (status == PROBE_MATCH) {
+        keylist = probes.keylists[index];
+    }
+    identity = probes.identities[index];
+    string error = probes.errors[index];
+    long long cost = probes.costs[index];
+    lock.unlock();
+    if (cost > 0) {
+        RecordProbe(tester, status == PROBE_MATCH, cost, error);
+    }
+    return error.empty() ? status : PROBE_FAILED;
+}
+
+/*
+ * Run an independent tester, e.g. of an optical disc, in a probe thread.
+ * A read of a scratched disc or of a removed device can not be interrupted,
+ * so the detection does not wait for the tester when it is cancelled or
+ * the time limit of the probe has passed. The tester finishes in the
+ * background, its result is ignored.
+ */
+cMediaDetector::PROBE_STATUS cMediaDetector::ProbeDetached(const TesterSetPtr &testerset,
+                                                               cMediaTester *tester,
+                                                               cMediaHandle &mediainfo,
+                                                               stringList &keylist,
+                                                               string &identity)
+{
+    shared_ptr<PROBES> probes = NewProbes(testerset, mediainfo, 1);
+    cCancelStage stage(mediainfo.GetCancelToken(), cCancelToken::STAGE_PROBE);
+    StartProbe(probes, tester, 0, stage);
+    PROBE_STATUS status = WaitProbe(*probes, 0, tester, stage, keylist,
+                                    identity);
+    lock_guard<mutex> lock(mProbeThreads->mutex);
+    probes->decided = true;
+    return status;
+}
+
+/*
+ * Start all independent testers at once and resolve the results in the
+ * order of the testers. The first matching tester wins, so only the
+ * results of the testers before it are waited for. Testers depending on the
+ * scan state of this thread (e.g. the file testers) run in this thread.
+ */
+cMediaTester *cMediaDetector::RunTestersParallel(const TesterSetPtr &testerset,
+                                            const MediaTesterVector &testers,
+                                            cMediaHandle &mediainfo,
+                                            string &description,
+                                            stringList &keylist,
+                                            CACHE_STATE &cache)
+{
+    MediaTesterVector::const_iterator it;
+    size_t index;
+    shared_ptr<PROBES> probes = NewProbes(testerset, mediainfo,
+                                          testers.size());
+    // One time limit for all probes, they run at the same time
+    cCancelStage stage(mediainfo.GetCancelToken(), cCancelToken::STAGE_PROBE);
+
+    for (it = testers.begin(), index = 0; it != testers.end();
+         it++, index++) {
+        if ((*it)->isIndependent()) {
+            StartProbe(probes, *it, index, stage);
+        }
+    }
+
+    bool found = false;
+    cMediaTester *match = NULL;
+    for (it = testers.begin(), index = 0; it != testers.end();
+         it++, index++) {
+        cMediaTester *t = *it;
+        string identity;
+        if (mediainfo.IsCancelled()) {
+            break;
+        }
+        PROBE_STATUS status;
+        if (t->isIndependent()) {
+            status = WaitProbe(*probes, index, t, stage, keylist, identity);
+        }
+        else {
+            status = ProbeTester(t, mediainfo, keylist, identity);
+        }
+        found = (status == PROBE_MATCH);
+        if (Failed(status)) {
+            cache.failed = true;
+        }
+        if (ProbedIdentity(identity, cache) && (!found)) {
+            match = ApplyProbed(testerset, mediainfo, cache, description,
+                                keylist);
+            if (match != NULL) {
+                break;
+            }
+        }
+        if (found) {
+            mLogger->logmsg(LOGLEVEL_INFO, "Found %s",
+                    t->GetDescription().c_str());
+#ifdef DEBUG
+            logkeylist(keylist);
+#endif
+            description = t->GetDescription();
+            match = t;
+            break;
+        }
+    }
+    // Cancel the testers with lower priority, which are not started yet.
+    // Running testers finish in the background, their result is ignored.
+    lock_guard<mutex> lock(mProbeThreads->mutex);
+    probes->decided = true;
+    return match;
+}
+
 stringList cMediaDetector::Detect(string &description,
                                   cMediaHandle &mediainfo)
 {
-    string path;
     cMediaHandle descr(mLogger);
     stringList keylist;
-    cDbusDevkit::DEVICE_SIGNAL signal;
+    cDeviceBackend::DEVICE_EVENT event;
+    cDetectionPool::RESULT result;
     mRunning = true;
     mManualScan = false;
     while (mRunning) {
-        // Wait until device kit detects a media change
-        if (mDevkit.WaitDevkit(1000, path, signal)) {
+        // Results of the workers in the order the detections were started
+        if (mPool.GetResult(result)) {
+            // Only the first media of a manual scan is reported
+            mPool.Discard(result.group);
+            description = result.description;
+            mediainfo = result.mediainfo;
+            return (result.keylist);
+        }
+        if (!mReleasing.Empty()) {
+            ReleaseDevices();
+        }
+        // Wait until device kit detects a media change or the detector
+        // is woken up for a result, a manual scan or stop.
+        if (WaitEvent(event)) {
+            // The properties are delivered with the event, so no further
+            // queries are necessary.
+            descr.SetDescription(*mDevkit, event.path, event.properties);
+            RegisterDevice(descr);
+            // A device named in the filters may have appeared or vanished
+            if ((event.signal == cDeviceBackend::DeviceAdded) ||
+                (event.signal == cDeviceBackend::DeviceRemoved)) {
+                mDeviceFilter.Invalidate();
+            }
             // A removed device needs special handling
-            if (signal == cDbusDevkit::DeviceRemoved) {
-                DoDeviceRemoved (mediainfo);
+            if (event.signal == cDeviceBackend::DeviceRemoved) {
+                DoDeviceRemoved (descr);
+                if (!mScanDevices.Contains(descr.GetId())) {
+                    mReleasing.Insert(descr.GetId());
+                }
             } else {
                 try {
-                    descr.GetDescription(mDevkit, path);
-
 #ifdef DEBUG
                     mLogger->logmsg(LOGLEVEL_INFO, "Path       : %s",
-                            path.c_str());
+                            event.path.c_str());
                     mLogger->logmsg(LOGLEVEL_INFO, "NativePath : %s",
-                            mDevkit.GetNativePath(path).c_str());
+                            descr.GetNativePath().c_str());
                     mLogger->logmsg(LOGLEVEL_INFO, "Type       : %s",
-                            mDevkit.GetType(path).c_str());
+                            descr.GetType().c_str());
                     mLogger->logmsg(LOGLEVEL_INFO, "Device File: %s",
-                            mDevkit.GetDeviceFile(path).c_str());
+                            descr.GetDeviceFile().c_str());
 
-                    if (mDevkit.IsMounted(path)) {
+                    if (!event.properties.mountPaths.empty()) {
                         mLogger->logmsg(LOGLEVEL_INFO, "Mounted -----> %s",
-                                mDevkit.GetMountPaths(path).front().c_str());
+                                event.properties.mountPaths.front().c_str());
                     }
-                    if (mDevkit.IsOpticalDisk(path)) {
+                    if (event.properties.isOptical) {
                         mLogger->logmsg(LOGLEVEL_INFO, "Optical Disk ");
                     }
-                    if (mDevkit.IsPartition(path)) {
+                    if (event.properties.isPartition) {
                         mLogger->logmsg(LOGLEVEL_INFO, "Partition ");
                     }
-                    if (mDevkit.IsMediaAvailable(path)) {
+                    if (event.properties.isMediaAvailable) {
                         mLogger->logmsg(LOGLEVEL_INFO, "Media Available ");
                     }
 #endif
-                    if (InDeviceFilter(path)) {
+                    if (InDeviceFilter(descr.GetId())) {
                         mLogger->logmsg(LOGLEVEL_INFO,
                                 "Device %s in device filter",
                                 descr.GetDeviceFile().c_str());
                     } else {
-                        if (mDevkit.IsMediaAvailable(path)) {
+                        if (descr.GetMediaMask() & MEDIA_AVAILABLE) {
 #ifdef DEBUG
                             mLogger->logmsg(LOGLEVEL_INFO,
                                 "  ******** Add/Detect ********");
 #endif
-                            // Detect media and return keylist if detection was
-                            // successful
-                            if (DoDetect(descr, description, keylist)) {
-                                mediainfo = descr;
-                                return (keylist);
-                            }
+                            // Detect media in the pool, the keylist is
+                            // returned with the result
+                            DoDetect(descr);
                         }
                         else {
 #ifdef DEBUG
                             mLogger->logmsg(LOGLEVEL_INFO,
                                 "  ******** Remove ********");
                             mLogger->logmsg(LOGLEVEL_INFO, "Path       : %s",
-                                                        path.c_str());
+                                                        event.path.c_str());
 #endif
-                            DoDeviceRemoved (mediainfo);
+                            DoDeviceRemoved (descr);
                         }
                     }
                 } catch (cDeviceKitException &e) {
@@ -448,11 +1392,11 @@ stringList cMediaDetector::Detect(string &description,
         }
         else { // Start manual scan
             if (mManualScan) {
-                if (DoManualScan(descr, description, keylist)) {
-                    mediainfo = descr;
-                    return (keylist);
-                }
                 mManualScan = false;
+                DoManualScan(descr);
+            }
+            else if (mIntakeFinished && (!mPool.WaitResult())) {
+                break; // End of trace and all detections done
             }
         }
     }
@@ -16,11 +16,28 @@
 #include "filetester.h"
 #include "cdiotester.h"
 #include "videodvdtester.h"
+#include "dbusdevkit.h"
+#include "tracebackend.h"
+#include "deviceregistry.h"
+#include "devicefilter.h"
+#include "detectionpool.h"
+#include "mediacache.h"
+#include "testerset.h"
+#include "eventloop.h"
+#include "boundedqueue.h"
 #include "logger.h"
 #include "stdtypes.h"
+#include <vector>
+#include <map>
+#include <unordered_map>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <condition_variable>
 
 
-class cMediaDetector {
+class cMediaDetector : public cDetectionHandler {
 public:
     typedef enum {
         AUTO_START,
@@ -28,7 +45,22 @@ public:
         LAST_MODE
     } WORKING_MODE;
 
-    cMediaDetector(cLogger *l) : mConfigFileParser(l), mDevkit(l) {
+    cMediaDetector(cLogger *l) : mConfigFileParser(l), mDeviceFilter(l),
+                                 mPool(l, this), mMediaCache(l),
+                                 mEvents(EVENT_QUEUE_SIZE), mWatchLoop(l) {
+        mDevkit = new cDbusDevkit(l);
+        mWorkers = cDetectionPool::DEFAULT_WORKERS;
+        mProbeThreads = std::make_shared<PROBE_THREADS>();
+        mProbeThreads->running = 0;
+        mTimeouts.stage[cCancelToken::STAGE_PROPERTIES] = DEFAULT_PROPERTY_TIMEOUT;
+        mTimeouts.stage[cCancelToken::STAGE_MOUNT] = DEFAULT_MOUNT_TIMEOUT;
+        mTimeouts.stage[cCancelToken::STAGE_SCAN] = DEFAULT_SCAN_TIMEOUT;
+        mTimeouts.stage[cCancelToken::STAGE_PROBE] = DEFAULT_PROBE_TIMEOUT;
+        mIntakeStop = false;
+        mIntakeFinished = false;
+        mWoken = false;
+        mWatchStop = false;
+        mFixedBackend = false;
         mRunning = false;
         mWorkingMode = AUTO_START;
         mManualScan = false;
@@ -39,51 +71,252 @@ public:
     ~cMediaDetector();
     bool InitDetector(cLogger *logger, const std::string initfile);
     // Stop detector
-    void Stop(void) { mRunning = false; };
+    void Stop(void) {
+        mRunning = false;
+        Wakeup();
+    };
     // Wait for a media change, detect the media and return the associated
     // key list and media information.
     stringList Detect(std::string &description, cMediaHandle &mediainfo);
+    // Use the given backend instead of the configured one. Must be called
+    // before InitDetector, the detector takes the ownership.
+    void SetBackend (cDeviceBackend *backend) {
+        delete mDevkit;
+        mDevkit = backend;
+        mFixedBackend = true;
+    }
+    // Called by the workers of the detection pool
+    bool DetectMedia(cMediaHandle &mediainfo, std::string &description,
+                       stringList &keylist, bool revalidate);
+    void RemoveMedia(const cMediaHandle &mediainfo);
+    void ResultReady(void) { Wakeup(); }
     // Change working mode
     void SetWorkingMode (WORKING_MODE mode) {mWorkingMode = mode;}
-    void StartManualScan (void) { mManualScan = true; };
+    void StartManualScan (void) {
+        mManualScan = true;
+        Wakeup();
+    };
 
 private:
   //  typedef std::map<std::string, stringList> PluginMap;
-    typedef std::list<cMediaTester *> MediaTesterList;
+    typedef cTesterSet::MediaTesterList MediaTesterList;
     typedef std::set<std::string> stringSet;
+    typedef cTesterSet::MediaTesterVector MediaTesterVector;
+    typedef cTesterSet::DISPATCH DISPATCH;
+    typedef std::shared_ptr<const cTesterSet> TesterSetPtr;
+    typedef enum {
+        PROBE_PENDING,
+        PROBE_MATCH,
+        PROBE_NOMATCH,
+        PROBE_FAILED        // Error of the tester or not started
+    } PROBE_STATUS;
+    // Results of the testers of one media running in parallel, indexed by
+    // the position of the tester in the testers to run. Shared with the probe
+    // threads, which may outlive the detection and the tester set.
+    typedef struct {
+        TesterSetPtr testers;
+        cMediaHandle mediainfo;
+        std::vector<PROBE_STATUS> status;
+        std::vector<stringList> keylists;
+        std::vector<std::string> identities;
+        std::vector<std::string> errors;
+        // Time of each probe in us
+        std::vector<long long> costs;
+        // Probe threads of this media still running
+        int running;
+        bool decided;
+    } PROBES;
+    // Logger of the testers, passes the messages on until the detector
+    // is gone. A probe thread left behind at the end keeps it alive.
+    class cProbeLogger : public cLogger {
+    private:
+        std::mutex mMutex;
+        cLogger *mTarget;
+    public:
+        cProbeLogger(cLogger *l) : mTarget(l) {};
+        virtual void logmsg (LOG_LEVEL severity, const char *format, ...);
+        // Drop all further messages
+        void Detach(void);
+    };
+    // The probe threads, shared with the threads, which may outlive the
+    // detector. The mutex protects the PROBES as well.
+    typedef struct {
+        std::mutex mutex;
+        std::condition_variable done;
+        int running;
+        // The media probed on each device file
+        std::map<std::string, const PROBES *> devices;
+        // Logger of the testers run by the threads
+        std::shared_ptr<cProbeLogger> logger;
+    } PROBE_THREADS;
+    // Identity of the media and its result in the media cache during a
+    // detection
+    typedef struct {
+        std::string identity;
+        cMediaCache::RESULT cached;
+        bool hit;
+        // The cached result replaced the remaining probes
+        bool applied;
+        bool revalidate;
+        // A step failed, so the media is not known to match no tester
+        bool failed;
+    } CACHE_STATE;
+    // Media without a matching tester
+    typedef struct {
+        size_t generation;
+        long long expires;
+    } NEGATIVE;
+
+    static const int EVENT_QUEUE_SIZE = 64;
+    // Time limits of the stages of a detection in ms
+    static const int DEFAULT_PROPERTY_TIMEOUT = 25000;
+    static const int DEFAULT_MOUNT_TIMEOUT = 30000;
+    static const int DEFAULT_SCAN_TIMEOUT = 120000;
+    static const int DEFAULT_PROBE_TIMEOUT = 60000;
+    // Probe threads running at the same time
+    static const int MAX_PROBE_THREADS = 4;
+    // Time in ms to wait for the probe threads at the end
+    static const int PROBE_SHUTDOWN_WAIT = 5000;
+    // Time in ms to wait for further changes of the config file
+    static const int RELOAD_DELAY = 500;
+
+    // Probe statistics of a registered tester
+    typedef struct {
+        unsigned long probes;
+        unsigned long hits;
+        // Sum of the probe times in microseconds
+        long long cost;
+    } TESTERSTATS;
 
     cLogger *mLogger;
     cConfigFileParser mConfigFileParser;
+    std::string mConfigFile;
 
-    MediaTesterList mRegisteredMediaTesters;
     MediaTesterList mMediaTesters;
+    // Registered testers of the current configuration. Accessed with
+    // std::atomic_load and std::atomic_store only, a detection keeps the
+    // set it started with when the config file is reloaded.
+    TesterSetPtr mTesters;
    // PluginMap mPlugins;
 
-    cDbusDevkit mDevkit;
+    cDeviceBackend *mDevkit;
+    // Backend set by SetBackend, BACKEND and TRACE are ignored
+    bool mFixedBackend;
 
     WORKING_MODE mWorkingMode;
     // Devices in filter list
-    stringSet mFilterDevices;
-    stringSet mAutoFilterDevices;
+    cDeviceFilter mDeviceFilter;
 
+    // All devices seen by the detector
+    cDeviceRegistry mRegistry;
     // Devices which are known due to insertion of a removable media
-    stringSet mKnownDevices;
+    cDeviceSet mKnownDevices;
     // Devices to always scan, when manual scan is started
-    stringSet mScanDevices;
+    cDeviceSet mScanDevices;
+    // Removed devices, whose ids are released when their jobs are done
+    cDeviceSet mReleasing;
     // Filterdevices specified manually
     bool mManualFilterDevice;
+    // Detection of several devices in parallel
+    cDetectionPool mPool;
+    int mWorkers;
+    cCancelToken::TIMEOUTS mTimeouts;
+    std::shared_ptr<PROBE_THREADS> mProbeThreads;
+    // Results of media detected before (MEDIACACHE)
+    cMediaCache mMediaCache;
+    // Devices whose media did not match, not detected again until the
+    // media changes or the entry is older than NEGATIVETTL seconds.
+    std::mutex mNegativeMutex;
+    std::unordered_map<DEVICE_ID, NEGATIVE> mNegative;
+    // Statistics of the testers by section, kept over a reload
+    std::mutex mStatsMutex;
+    std::map<std::string, TESTERSTATS> mStats;
+
+    // Device events read by the intake thread, numbered in the order they
+    // are queued
+    typedef struct {
+        cDeviceBackend::DEVICE_EVENT event;
+        unsigned long seq;
+    } QUEUED_EVENT;
+    cBoundedQueue<QUEUED_EVENT> mEvents;
+    // Number of the last queued removal per device path, older events of
+    // the device still in the queue are dropped.
+    std::mutex mRemovalMutex;
+    std::unordered_map<std::string, unsigned long> mRemovals;
+    std::thread mIntake;
+    std::atomic<bool> mIntakeStop;
+    // The backend delivers no more events, e.g. at the end of a trace
+    std::atomic<bool> mIntakeFinished;
+    // Wakes the detector thread for an event, a result, a manual scan or
+    // stop, and the intake thread when an event was taken from a full queue.
+    std::mutex mWakeMutex;
+    std::condition_variable mWake;
+    std::condition_variable mEventTaken;
+    bool mWoken;
+
+    // Watches the config file for changes
+    cEventLoop mWatchLoop;
+    std::thread mWatcher;
+    std::atomic<bool> mWatchStop;
 
     volatile bool mRunning;
     volatile bool mManualScan;
 
-    bool AddDetector(const std::string plugin);
     bool AddGlobalOptions(const std::string sectionname);
-    void RegisterTester(const cMediaTester *, const cConfigFileParser &,
-                          const std::string);
-    bool InDeviceFilter(const std::string dev);
-    bool DoDetect(cMediaHandle &, std::string &, stringList &);
-    bool DoManualScan(cMediaHandle &, std::string &, stringList &);
-    void DoDeviceRemoved(cMediaHandle mediainfo);
+    TesterSetPtr LoadTesters(cConfigFileParser &config);
+    void Watch(void);
+    bool Reload(void);
+    bool InDeviceFilter(DEVICE_ID id);
+    bool MatchDeviceFilter(const std::string &dev);
+    void RegisterDevice(cMediaHandle &mediainfo);
+    void DoDetect(const cMediaHandle &);
+    std::string MediaIdentity(const cMediaHandle &);
+    bool ProbedIdentity(const std::string &, CACHE_STATE &);
+    cMediaTester *ApplyCached(const DISPATCH &, cMediaHandle &,
+                                const std::string &, bool);
+    cMediaTester *ApplyProbed(const TesterSetPtr &, cMediaHandle &,
+                                CACHE_STATE &, std::string &, stringList &);
+    cMediaTester *ScanMedia(const TesterSetPtr &, cMediaHandle &,
+                              std::string &, stringList &, CACHE_STATE &);
+    MediaTesterVector OrderTesters(const MediaTesterVector &);
+    static bool ProbeMedia(cMediaTester *, const cMediaHandle &, stringList &,
+                             std::string &, std::string &, long long &);
+    void RecordProbe(cMediaTester *, bool, long long, const std::string &);
+    PROBE_STATUS ProbeTester(cMediaTester *, const cMediaHandle &,
+                               stringList &, std::string &);
+    cMediaTester *RunTesters(const TesterSetPtr &,
+                               const MediaTesterVector &, cMediaHandle &,
+                               std::string &, stringList &, CACHE_STATE &);
+    cMediaTester *RunTestersParallel(const TesterSetPtr &,
+                                       const MediaTesterVector &, cMediaHandle &,
+                                       std::string &, stringList &,
+                                       CACHE_STATE &);
+    static std::shared_ptr<PROBES> NewProbes(const TesterSetPtr &,
+                                               const cMediaHandle &, size_t);
+    bool StartProbe(const std::shared_ptr<PROBES> &probes,
+                      cMediaTester *tester, size_t index,
+                      const cCancelStage &stage);
+    static void Probe(std::shared_ptr<PROBE_THREADS> threads,
+                        std::shared_ptr<PROBES> probes, cMediaTester *tester,
+                        size_t index);
+    PROBE_STATUS WaitProbe(const PROBES &probes, size_t index,
+                             cMediaTester *tester, const cCancelStage &stage,
+                             stringList &keylist, std::string &identity);
+    PROBE_STATUS ProbeDetached(const TesterSetPtr &, cMediaTester *,
+                                 cMediaHandle &, stringList &, std::string &);
+    static bool Failed(PROBE_STATUS status) {
+        return (status == PROBE_PENDING) || (status == PROBE_FAILED);
+    }
+    static size_t MediaGeneration(const cMediaHandle &);
+    bool IsNegative(const cMediaHandle &);
+    void AddNegative(const cMediaHandle &, const TesterSetPtr &);
+    void Intake(void);
+    void Wakeup(void);
+    bool WaitEvent(cDeviceBackend::DEVICE_EVENT &event);
+    bool Superseded(const QUEUED_EVENT &queued);
+    void DoManualScan(cMediaHandle &);
+    void DoDeviceRemoved(const cMediaHandle &mediainfo);
+    void ReleaseDevices(void);
 
     void ParseFstab (stringList &values);
 
@@ -8,6 +8,7 @@
  */
 
 #include "mediatester.h"
+#include <stdlib.h>
 #include <unistd.h>
 #ifndef _NOVDR_
 #include <vdr/plugin.h>
@@ -17,48 +18,69 @@
 
 using namespace std;
 
-// Read media information from devkit/udisk
-bool cMediaHandle::GetDescription (cDbusDevkit &d,
+// Read media information from the device backend
+bool cMediaHandle::GetDescription (cDeviceBackend &d,
                                        const string &path)
 {
-    bool success = true;
-    mPath = path;
-    mDevKit = &d;
+    DEVICE_PROPERTIES props;
     try {
-        mNativePath = d.GetNativePath(path);
-        mDeviceFile = d.GetDeviceFile(path);
-        mType = d.GetType(path);
-        mMediaMask = 0;
-        if (d.IsOpticalDisk(path)) {
-            mMediaMask |= MEDIA_OPTICAL;
-        }
-        if (d.IsMounted(path)) {
-            mMediaMask |= MEDIA_MOUNTED;
-        }
-        if (d.IsPartition(path)) {
-            mMediaMask |= MEDIA_PARTITON;
-        }
-        if (d.IsMediaAvailable((path))) {
-            mMediaMask |= MEDIA_AVAILABLE;
-        }
-        if (mType == "iso9660") {
-            mMediaMask |= MEDIA_FS_ISO9660;
-        }
-        else if (mType == "udf") {
-            mMediaMask |= MEDIA_FS_UDF;
-        }
-        else if (mType == "vfat") {
-            mMediaMask |= MEDIA_FS_VFAT;
-        }
-        else if (mType.empty()) {
-            mMediaMask |= MEDIA_FS_UNKNOWN;
-        }
+        d.GetDeviceProperties(path, props);
     }
     catch (cDeviceKitException &e) {
         mLogger->logmsg(LOGLEVEL_WARNING, "DeviceKit Error %s", e.what());
-        success = false;
+        return false;
     }
-    return (success);
+    SetDescription(d, path, props);
+    return true;
+}
+
+// Set media information from already known device properties, e.g. the
+// properties delivered with a device signal.
+void cMediaHandle::SetDescription (cDeviceBackend &d, const string &path,
+                                       const DEVICE_PROPERTIES &props)
+{
+    mPath = path;
+    mId = NO_DEVICE;
+    mDevKit = &d;
+    mNativePath = props.nativePath;
+    mDeviceFile = props.deviceFile;
+    mType = props.type;
+    mUuid = props.uuid;
+    mLabel = props.label;
+    mSize = props.size;
+    mMediaMask = 0;
+    if (props.isOptical) {
+        mMediaMask |= MEDIA_OPTICAL;
+    }
+    if (props.isMounted) {
+        mMediaMask |= MEDIA_MOUNTED;
+    }
+    if (props.isPartition) {
+        mMediaMask |= MEDIA_PARTITON;
+    }
+    if (props.isMediaAvailable) {
+        mMediaMask |= MEDIA_AVAILABLE;
+    }
+    if (mType == "iso9660") {
+        mMediaMask |= MEDIA_FS_ISO9660;
+    }
+    else if (mType == "udf") {
+        mMediaMask |= MEDIA_FS_UDF;
+    }
+    else if (mType == "vfat") {
+        mMediaMask |= MEDIA_FS_VFAT;
+    }
+    else if (mType.empty()) {
+        mMediaMask |= MEDIA_FS_UNKNOWN;
+    }
+}
+
+bool cMediaTester::canMatch (MEDIA_MASK_T m) const
+{
+    MEDIA_MASK_T any = anyMask();
+    return ((m & requiredMask()) == requiredMask()) &&
+           (!(m & excludedMask())) &&
+           ((any == 0) || (m & any));
 }
 
 stringList cMediaTester::getList(cConfigFileParser config,
@@ -69,7 +91,8 @@ stringList cMediaTester::getList(cConfigFileParser config,
     if (!config.GetValues(sectionname, key, vals)) {
         mLogger->logmsg(LOGLEVEL_ERROR, "No %s specified in section %s",
                 key.c_str(), sectionname.c_str());
-        exit(-1);
+        vals.clear();
+        return vals;
     }
 
     stringList::iterator it;
@@ -91,6 +114,21 @@ bool cMediaTester::loadConfig (cConfigFileParser config,
         mLogger->logmsg(LOGLEVEL_ERROR, "No KEYS defined\n");
         return false;
     }
+    mSection = sectionname;
+    if (config.HasKey(sectionname, "PRIORITY")) {
+        string priority;
+        char *end;
+        if (!config.GetSingleValue(sectionname, "PRIORITY", priority)) {
+            return false;
+        }
+        long val = strtol(priority.c_str(), &end, 10);
+        if (priority.empty() || (*end != '\0')) {
+            mLogger->logmsg(LOGLEVEL_ERROR, "Invalid PRIORITY %s in section %s",
+                            priority.c_str(), sectionname.c_str());
+            return false;
+        }
+        mPriority = (int)val;
+    }
     stringList::iterator it;
     // Check input string
 #ifndef _NOVDR_
@@ -10,10 +10,13 @@
 #ifndef MEDIATESTER_H_
 #define MEDIATESTER_H_
 
-#include "dbusdevkit.h"
+#include "devicebackend.h"
+#include "deviceregistry.h"
 #include "configfileparser.h"
 #include "stringtools.h"
+#include "canceltoken.h"
 #include "logger.h"
+#include <memory>
 
 typedef long MEDIA_MASK_T;
 
@@ -27,9 +30,11 @@ static const MEDIA_MASK_T MEDIA_FS_UDF     = 0x40;
 static const MEDIA_MASK_T MEDIA_FS_UNKNOWN = 0x80;
 static const MEDIA_MASK_T MEDIA_AVAILABLE  = 0x100;
 static const MEDIA_MASK_T MEDIA_FS_VFAT    = 0x200;
+// All bits of the media mask
+static const MEDIA_MASK_T MEDIA_MASK_ALL   = 0x3FF;
 
 // This class holds information about the changed media including a
-// reference to the dbus - devkit
+// reference to the device backend
 class cMediaHandle
 {
 private:
@@ -37,9 +42,15 @@ private:
     std::string mNativePath;
     std::string mDeviceFile;
     std::string mType;
+    std::string mUuid;
+    std::string mLabel;
+    unsigned long long mSize;
+    DEVICE_ID mId;
+    // Token of the detection, shared by the copies of the handle
+    std::shared_ptr<cCancelToken> mCancel;
 
     MEDIA_MASK_T mMediaMask;
-    cDbusDevkit *mDevKit;
+    cDeviceBackend *mDevKit;
     cLogger *mLogger;
 
 public:
@@ -47,18 +58,33 @@ public:
         mLogger = NULL;
         mDevKit = NULL;
         mMediaMask = 0;
+        mSize = 0;
+        mId = NO_DEVICE;
     }
     cMediaHandle(cLogger *l) {
         mLogger = l;
         mDevKit = NULL;
         mMediaMask = 0;
+        mSize = 0;
+        mId = NO_DEVICE;
     }
-    bool GetDescription(cDbusDevkit &d, const std::string &path);
-    std::string GetNativePath(void) {return mNativePath;}
-    std::string GetDeviceFile(void) {return mDeviceFile;}
-    std::string GetType(void) {return mType;}
-    std::string GetPath(void) {return mPath;}
-    MEDIA_MASK_T GetMediaMask(void) {return mMediaMask;}
+    bool GetDescription(cDeviceBackend &d, const std::string &path);
+    void SetDescription(cDeviceBackend &d, const std::string &path,
+                          const DEVICE_PROPERTIES &props);
+    const std::string &GetNativePath(void) const {return mNativePath;}
+    const std::string &GetDeviceFile(void) const {return mDeviceFile;}
+    const std::string &GetType(void) const {return mType;}
+    const std::string &GetPath(void) const {return mPath;}
+    const std::string &GetUuid(void) const {return mUuid;}
+    const std::string &GetLabel(void) const {return mLabel;}
+    unsigned long long GetSize(void) const {return mSize;}
+    MEDIA_MASK_T GetMediaMask(void) const {return mMediaMask;}
+    // Id of the device in the registry of the detector
+    DEVICE_ID GetId(void) const {return mId;}
+    void SetId(DEVICE_ID id) {mId = id;}
+    cCancelToken *GetCancelToken(void) const {return mCancel.get();}
+    void SetCancelToken(std::shared_ptr<cCancelToken> token) {mCancel = token;}
+    bool IsCancelled(void) const {return mCancel && mCancel->IsCancelled();}
 };
 
 // Base class for all testers.
@@ -71,6 +97,10 @@ protected:
     stringList mKeylist;
     std::string mDescription;
     std::string mExt;
+    // Section of the config file
+    std::string mSection;
+    // Testers with a higher priority are tried first
+    int mPriority;
     stringSet mRequiredKeys;
     stringSet mOptionalKeys;
 
@@ -83,9 +113,11 @@ public:
         mLogger = l;
         mDescription = descr;
         mExt = ext;
+        mPriority = 0;
         // Minimal required keywords for all media testers.
         mRequiredKeys.insert("KEYS");
         mRequiredKeys.insert("TYPE");
+        mOptionalKeys.insert("PRIORITY");
     }
     virtual ~cMediaTester() {};
 
@@ -96,18 +128,52 @@ public:
     virtual bool loadConfig (cConfigFileParser config,
                                 const std::string sectionname);
     // Return true if inserted media is suitable for testing
-    virtual bool isMedia (cMediaHandle d, stringList &keylist) = 0;
+    virtual bool isMedia (const cMediaHandle &d, stringList &keylist) = 0;
+    // Return true if isMedia depends only on the media handle, so it can
+    // run in another thread in parallel to the other testers.
+    virtual bool isIndependent (void) const { return false; }
+    // Media mask bits which must be set, which must not be set and of
+    // which at least one must be set, so that isMedia can match. The
+    // detector does not call the tester or its scan hooks for other media.
+    virtual MEDIA_MASK_T requiredMask (void) const { return 0; }
+    virtual MEDIA_MASK_T excludedMask (void) const { return 0; }
+    virtual MEDIA_MASK_T anyMask (void) const { return 0; }
+    // Return true if isMedia can match a media with the given mask
+    bool canMatch (MEDIA_MASK_T m) const;
     // Create a new instance copying mDescription and mExt and set
     // logger.
     virtual cMediaTester *create(cLogger *) const = 0;
     // Hook called before a scan starts
-    virtual void startScan (cMediaHandle &d, cDbusDevkit *devkit) {};
+    virtual void startScan (cMediaHandle &d, cDeviceBackend *devkit) {};
     // Hook called when scan ends
     virtual void endScan (cMediaHandle &d) {};
     // Hook called when the device is removed
-    virtual void removeDevice (cMediaHandle d) {};
+    virtual void removeDevice (const cMediaHandle &d) {};
+    // Test the media like isMedia and return an identity of the inserted
+    // media independent of the device, e.g. a hash of the table of contents
+    // read for the test. The identity is empty if the tester has none.
+    virtual bool probeMedia (const cMediaHandle &d, stringList &keylist,
+                               std::string &identity) {
+        identity.clear();
+        return isMedia(d, keylist);
+    }
+    // Hook called instead of a scan, when the media was detected by this
+    // tester before. Does what a scan with a match would have done without
+    // testing the media, false if this is not possible. The key list is
+    // taken from the cache.
+    virtual bool applyCached (cMediaHandle &d, cDeviceBackend *devkit) {
+        return true;
+    }
+    // Hooks called before and after the scan checking a cached result. The
+    // media is already set up by applyCached.
+    virtual void startRevalidation (cMediaHandle &d, cDeviceBackend *devkit) {
+        startScan(d, devkit);
+    }
+    virtual void endRevalidation (cMediaHandle &d) { endScan(d); }
     // Return a description for the tester
     std::string GetDescription(void) {return mDescription;}
+    const std::string &GetSection(void) const {return mSection;}
+    int GetPriority(void) const {return mPriority;}
 };
 
 #endif /* MEDIATESTER_H_ */
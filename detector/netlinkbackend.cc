@@ -0,0 +1,596 @@
+/*
+ * netlinkbackend.cc: Device backend reading kernel uevents from a netlink
+ *                    socket and the device properties from sysfs, for
+ *                    systems without udisks.
+ *
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * This code is distributed under the terms and conditions of the
+ * GNU GENERAL PUBLIC LICENSE. See the file COPYING for details.
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/socket.h>
+#include <sys/mount.h>
+#include <sys/epoll.h>
+#include <linux/netlink.h>
+#include <string>
+#include <fstream>
+#include <sstream>
+#include "netlinkbackend.h"
+
+using namespace std;
+
+const char *cNetlinkBackend::SYSFS_CLASS_BLOCK = "/sys/class/block";
+const char *cNetlinkBackend::MOUNT_BASE = "/media";
+
+// Resolve a path to its canonical form, empty if it does not exist
+static string RealPath (const string &path)
+{
+    char buf[PATH_MAX];
+    if (realpath(path.c_str(), buf) == NULL) {
+        return "";
+    }
+    return buf;
+}
+
+// Decode the octal escapes (e.g. \040 for space) in /proc/self/mounts
+static string Unescape (const string &str)
+{
+    string retval;
+    for (string::size_type i = 0; i < str.length(); i++) {
+        if ((str[i] == '\\') && (i + 3 < str.length())) {
+            retval += (char)strtol(str.substr(i + 1, 3).c_str(), NULL, 8);
+            i += 3;
+        }
+        else {
+            retval += str[i];
+        }
+    }
+    return retval;
+}
+
+// Name of the first udev link (e.g. in /dev/disk/by-uuid) to the device,
+// with the \xNN escapes of udev decoded
+static string LinkName (const stringList &links)
+{
+    string retval;
+    if (links.empty()) {
+        return retval;
+    }
+    string name = links.front().substr(links.front().rfind('/') + 1);
+    for (string::size_type i = 0; i < name.length(); i++) {
+        if ((name.compare(i, 2, "\\x") == 0) && (i + 3 < name.length())) {
+            retval += (char)strtol(name.substr(i + 2, 2).c_str(), NULL, 16);
+            i += 3;
+        }
+        else {
+            retval += name[i];
+        }
+    }
+    return retval;
+}
+
+static inline unsigned int GetLe16 (const unsigned char *p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+static inline unsigned long GetLe32 (const unsigned char *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned long)p[3] << 24);
+}
+
+cNetlinkBackend::cNetlinkBackend(cLogger *logger) : cDeviceBackend(logger)
+{
+    mSocket = -1;
+    mNextAttempt = 0;
+}
+
+cNetlinkBackend::~cNetlinkBackend()
+{
+    if (mSocket >= 0) {
+        mEventLoop.SetFd(mSocket, 0);
+        close(mSocket);
+    }
+}
+
+/*
+ * Open the netlink socket for the kernel uevents. After a failed attempt
+ * wait until the next attempt is due, the wait can be interrupted by
+ * Wakeup.
+ */
+bool cNetlinkBackend::Connect(void)
+{
+    struct sockaddr_nl addr;
+    int bufsize = 128 * 1024;
+
+    if (mSocket >= 0) {
+        return true;
+    }
+    long long wait = mNextAttempt - Now();
+    if (wait > 0) {
+        cEventLoop::FDEVENT events[cEventLoop::MAX_EVENTS];
+        bool woken;
+        mEventLoop.Wait(wait, events, cEventLoop::MAX_EVENTS, woken);
+        return false;
+    }
+    mSocket = socket(AF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                     NETLINK_KOBJECT_UEVENT);
+    if (mSocket < 0) {
+        mLogger->logmsg(LOGLEVEL_ERROR, "Can not open netlink socket %s",
+                        strerror(errno));
+        mNextAttempt = Now() + RETRY_DELAY; // Do not spin in the intake loop
+        return false;
+    }
+    // Survive the burst of events when a disk with many partitions is
+    // inserted.
+    setsockopt(mSocket, SOL_SOCKET, SO_RCVBUF, &bufsize, sizeof(bufsize));
+
+    memset(&addr, 0, sizeof(addr));
+    addr.nl_family = AF_NETLINK;
+    addr.nl_pid = 0;
+    addr.nl_groups = 1; // Kernel events
+    if ((bind(mSocket, (struct sockaddr *)&addr, sizeof(addr)) < 0) ||
+        (!mEventLoop.SetFd(mSocket, EPOLLIN))) {
+        mLogger->logmsg(LOGLEVEL_ERROR, "Can not bind netlink socket %s",
+                        strerror(errno));
+        close(mSocket);
+        mSocket = -1;
+        mNextAttempt = Now() + RETRY_DELAY;
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Read the next uevent of a block device. A uevent consists of
+ * "ACTION@DEVPATH" followed by KEY=VALUE pairs, all zero terminated.
+ * timout : timeout in miliseconds, if no message is queued
+ */
+bool cNetlinkBackend::ReadSignal(int timeout, DEVICE_EVENT &event)
+{
+    char buf[UEVENT_BUFFER_SIZE];
+    struct sockaddr_nl addr;
+    struct iovec iov;
+    struct msghdr msg;
+    bool waited = false;
+
+    for (;;) {
+        iov.iov_base = buf;
+        iov.iov_len = sizeof(buf) - 1;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_name = &addr;
+        msg.msg_namelen = sizeof(addr);
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+
+        ssize_t len = recvmsg(mSocket, &msg, 0);
+        if (len < 0) {
+            if ((errno != EAGAIN) && (errno != EWOULDBLOCK) &&
+                (errno != EINTR) && (errno != ENOBUFS)) {
+                mLogger->logmsg(LOGLEVEL_ERROR, "Netlink receive error %s",
+                                strerror(errno));
+                return false;
+            }
+            if (errno == ENOBUFS) {
+                mLogger->logmsg(LOGLEVEL_WARNING, "Netlink events lost");
+                continue;
+            }
+            if (waited) {
+                return false;
+            }
+            cEventLoop::FDEVENT events[cEventLoop::MAX_EVENTS];
+            bool woken;
+            mEventLoop.Wait(timeout, events, cEventLoop::MAX_EVENTS, woken);
+            if (woken) {
+                return false;
+            }
+            waited = true;
+            continue;
+        }
+        // Accept only messages from the kernel
+        if ((addr.nl_pid != 0) || (msg.msg_flags & MSG_TRUNC)) {
+            continue;
+        }
+        buf[len] = '\0';
+
+        string action;
+        string devpath;
+        string subsystem;
+        char *p = buf;
+        while (p < buf + len) {
+            string field = p;
+            p += field.length() + 1;
+            if (field.compare(0, 7, "ACTION=") == 0) {
+                action = field.substr(7);
+            }
+            else if (field.compare(0, 8, "DEVPATH=") == 0) {
+                devpath = field.substr(8);
+            }
+            else if (field.compare(0, 10, "SUBSYSTEM=") == 0) {
+                subsystem = field.substr(10);
+            }
+        }
+        if ((subsystem != "block") || devpath.empty()) {
+            continue;
+        }
+        event.path = "/sys" + devpath;
+        if (IsVirtual(event.path)) {
+            continue; // Loop, ram and device mapper devices
+        }
+        event.interfaces.clear();
+        if (action == "add") {
+            event.signal = DeviceAdded;
+        }
+        else if (action == "change") {
+            event.signal = DeviceChanged;
+        }
+        else if (action == "remove") {
+            // The device is already gone from sysfs, report the last
+            // known properties.
+            lock_guard<mutex> lock(mMutex);
+            map<string, DEVICE_PROPERTIES>::iterator it;
+            it = mDevices.find(event.path);
+            if (it != mDevices.end()) {
+                event.properties = it->second;
+                mDevices.erase(it);
+            }
+            else {
+                event.properties = DEVICE_PROPERTIES();
+                event.properties.nativePath = event.path;
+            }
+            event.signal = DeviceRemoved;
+        }
+        else {
+            continue;
+        }
+        mLogger->logmsg(LOGLEVEL_INFO, "DeviceChange Signal for %s",
+                        event.path.c_str());
+        return true;
+    }
+}
+
+bool cNetlinkBackend::IsVirtual (const string &path)
+{
+    return (path.find("/devices/virtual/") != string::npos);
+}
+
+void cNetlinkBackend::CheckDevice (const string &path)
+{
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0) {
+        DEVKITEXCEPTION("No such device " + path);
+    }
+}
+
+// Read the first line of a sysfs attribute
+string cNetlinkBackend::ReadSysfs (const string &path, const string &attr)
+{
+    ifstream file;
+    string line;
+
+    file.open((path + "/" + attr).c_str());
+    if (file.is_open()) {
+        getline(file, line);
+    }
+    return line;
+}
+
+stringList cNetlinkBackend::EnumerateDevices (void)
+{
+    stringList retval;
+    DIR *dir;
+    struct dirent *entry;
+
+    dir = opendir(SYSFS_CLASS_BLOCK);
+    if (dir == NULL) {
+        DEVKITEXCEPTION(string("Can not open ") + SYSFS_CLASS_BLOCK);
+    }
+    while ((entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] == '.') {
+            continue;
+        }
+        string path = RealPath(string(SYSFS_CLASS_BLOCK) + "/" + entry->d_name);
+        if ((!path.empty()) && (!IsVirtual(path))) {
+#ifdef DEBUG
+            mLogger->logmsg(LOGLEVEL_INFO, "Device %s", path.c_str());
+#endif
+            retval.push_back(path);
+        }
+    }
+    closedir(dir);
+    return retval;
+}
+
+string cNetlinkBackend::FindDeviceByDeviceFile (const string device)
+{
+    struct stat st;
+    char buf[64];
+
+    if ((stat(device.c_str(), &st) != 0) || (!S_ISBLK(st.st_mode))) {
+        DEVKITEXCEPTION("No block device " + device);
+    }
+    snprintf(buf, sizeof(buf), "/sys/dev/block/%u:%u", major(st.st_rdev),
+             minor(st.st_rdev));
+    string path = RealPath(buf);
+    if (path.empty()) {
+        DEVKITEXCEPTION("No sysfs entry for " + device);
+    }
+    return path;
+}
+
+string cNetlinkBackend::GetNativePath (const string &path)
+{
+    CheckDevice(path);
+    return path;
+}
+
+string cNetlinkBackend::GetDeviceFile (const string &path)
+{
+    ifstream file;
+    string line;
+
+    CheckDevice(path);
+    file.open((path + "/uevent").c_str());
+    while (getline(file, line)) {
+        if (line.compare(0, 8, "DEVNAME=") == 0) {
+            return "/dev/" + line.substr(8);
+        }
+    }
+    return "/dev/" + path.substr(path.rfind('/') + 1);
+}
+
+// Symbolic links created by udev for the device file
+stringList cNetlinkBackend::FindLinks (const string &dir,
+                                         const string &devicefile)
+{
+    stringList retval;
+    DIR *d;
+    struct dirent *entry;
+
+    d = opendir(dir.c_str());
+    if (d == NULL) {
+        return retval;
+    }
+    while ((entry = readdir(d)) != NULL) {
+        if (entry->d_name[0] == '.') {
+            continue;
+        }
+        string link = dir + "/" + entry->d_name;
+        if (RealPath(link) == devicefile) {
+            retval.push_back(link);
+        }
+    }
+    closedir(d);
+    return retval;
+}
+
+stringList cNetlinkBackend::GetDeviceFileById (const string &path)
+{
+    return FindLinks("/dev/disk/by-id", GetDeviceFile(path));
+}
+
+stringList cNetlinkBackend::GetDeviceFileByPath (const string &path)
+{
+    return FindLinks("/dev/disk/by-path", GetDeviceFile(path));
+}
+
+stringList cNetlinkBackend::GetMountPaths (const string &path)
+{
+    ifstream file;
+    string line;
+    stringList retval;
+    string devicefile = GetDeviceFile(path);
+
+    file.open("/proc/self/mounts");
+    if (!file.is_open()) {
+        DEVKITEXCEPTION("Can not open /proc/self/mounts");
+    }
+    while (getline(file, line)) {
+        istringstream buffer(line);
+        string device;
+        string mountpoint;
+        buffer >> device;
+        buffer >> mountpoint;
+        device = Unescape(device);
+        if ((device == devicefile) ||
+            ((device[0] == '/') && (RealPath(device) == devicefile))) {
+            retval.push_back(Unescape(mountpoint));
+        }
+    }
+    return retval;
+}
+
+bool cNetlinkBackend::IsMounted (const string &path)
+{
+    return !GetMountPaths(path).empty();
+}
+
+bool cNetlinkBackend::IsOpticalDisk (const string &path)
+{
+    CheckDevice(path);
+    // SCSI peripheral type 5 is a CD/DVD drive
+    return (ReadSysfs(path, "device/type") == "5");
+}
+
+bool cNetlinkBackend::IsPartition (const string &path)
+{
+    CheckDevice(path);
+    return !ReadSysfs(path, "partition").empty();
+}
+
+bool cNetlinkBackend::IsMediaAvailable (const string &path)
+{
+    CheckDevice(path);
+    // Removable drives without a media report a size of 0
+    return (atoll(ReadSysfs(path, "size").c_str()) > 0);
+}
+
+string cNetlinkBackend::GetType (const string &path)
+{
+    if (!IsMediaAvailable(path)) {
+        return "";
+    }
+    return ProbeFilesystem(GetDeviceFile(path));
+}
+
+/*
+ * Detect the file system by its super block, like blkid does for the file
+ * systems relevant for removable media. Returns an empty string if the
+ * file system is unknown, e.g. for an audio CD.
+ */
+string cNetlinkBackend::ProbeFilesystem (const string &devicefile)
+{
+    unsigned char *buf;
+    ssize_t len;
+    ssize_t off;
+    string retval;
+
+    int fd = open(devicefile.c_str(), O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0) {
+        mLogger->logmsg(LOGLEVEL_WARNING, "Can not open %s %s",
+                        devicefile.c_str(), strerror(errno));
+        return retval;
+    }
+    buf = new unsigned char[PROBE_SIZE];
+    len = pread(fd, buf, PROBE_SIZE, 0);
+    close(fd);
+
+    if (len <= 0) {
+        delete[] buf;
+        return retval;
+    }
+    // UDF volume recognition sequence, checked before iso9660 since UDF
+    // bridge discs (e.g. video DVDs) contain both.
+    for (off = 0x8000; (off + 6 <= len) && retval.empty(); off += 2048) {
+        if ((memcmp(buf + off + 1, "NSR02", 5) == 0) ||
+            (memcmp(buf + off + 1, "NSR03", 5) == 0)) {
+            retval = "udf";
+        }
+    }
+    if (retval.empty()) {
+        if ((len >= 0x8006) && (memcmp(buf + 0x8001, "CD001", 5) == 0)) {
+            retval = "iso9660";
+        }
+        else if ((len >= 0x468) && (GetLe16(buf + 0x438) == 0xEF53)) {
+            unsigned long compat = GetLe32(buf + 0x45C);
+            unsigned long incompat = GetLe32(buf + 0x460);
+            if (incompat & (0x40 | 0x80 | 0x200)) { // extents, 64bit, flex_bg
+                retval = "ext4";
+            }
+            else if (compat & 0x4) { // journal
+                retval = "ext3";
+            }
+            else {
+                retval = "ext2";
+            }
+        }
+        else if ((len >= 0x10048) && (memcmp(buf + 0x10040, "_BHRfS_M", 8) == 0)) {
+            retval = "btrfs";
+        }
+        else if ((len >= 4) && (memcmp(buf, "XFSB", 4) == 0)) {
+            retval = "xfs";
+        }
+        else if ((len >= 11) && (memcmp(buf + 3, "NTFS    ", 8) == 0)) {
+            retval = "ntfs";
+        }
+        else if ((len >= 11) && (memcmp(buf + 3, "EXFAT   ", 8) == 0)) {
+            retval = "exfat";
+        }
+        else if ((len >= 512) && (buf[510] == 0x55) && (buf[511] == 0xAA) &&
+                 ((memcmp(buf + 54, "FAT12", 5) == 0) ||
+                  (memcmp(buf + 54, "FAT16", 5) == 0) ||
+                  (memcmp(buf + 82, "FAT32", 5) == 0))) {
+            retval = "vfat";
+        }
+    }
+    delete[] buf;
+    return retval;
+}
+
+void cNetlinkBackend::GetDeviceProperties(const string &path,
+                                              DEVICE_PROPERTIES &props)
+{
+    props.nativePath = GetNativePath(path);
+    props.deviceFile = GetDeviceFile(path);
+    props.isPartition = IsPartition(path);
+    props.isOptical = IsOpticalDisk(path);
+    props.isMediaAvailable = IsMediaAvailable(path);
+    props.type.clear();
+    props.uuid.clear();
+    props.label.clear();
+    props.size = strtoull(ReadSysfs(path, "size").c_str(), NULL, 10) * 512;
+    if (props.isMediaAvailable) {
+        props.type = ProbeFilesystem(props.deviceFile);
+        props.uuid = LinkName(FindLinks("/dev/disk/by-uuid", props.deviceFile));
+        props.label = LinkName(FindLinks("/dev/disk/by-label",
+                                         props.deviceFile));
+    }
+    props.mountPaths = GetMountPaths(path);
+    props.isMounted = !props.mountPaths.empty();
+    lock_guard<mutex> lock(mMutex);
+    mDevices[path] = props;
+}
+
+// Mount the media without udisks below MOUNT_BASE
+string cNetlinkBackend::AutoMount (const string path)
+{
+    DEVICE_PROPERTIES props;
+    unsigned long flags = MS_NOSUID | MS_NODEV;
+
+    GetDeviceProperties(path, props);
+    if (props.isMounted) {
+        return props.mountPaths.front();
+    }
+    if (props.type.empty()) {
+        DEVKITEXCEPTION("No file system on " + props.deviceFile);
+    }
+    string mountpoint = string(MOUNT_BASE) + "/" +
+                        props.deviceFile.substr(props.deviceFile.rfind('/') + 1);
+    if ((mkdir(mountpoint.c_str(), 0755) != 0) && (errno != EEXIST)) {
+        DEVKITEXCEPTION("Can not create " + mountpoint + ": " + strerror(errno));
+    }
+    if (props.isOptical || (props.type == "iso9660") || (props.type == "udf")) {
+        flags |= MS_RDONLY;
+    }
+    if ((mount(props.deviceFile.c_str(), mountpoint.c_str(), props.type.c_str(),
+               flags, NULL) != 0) &&
+        (((errno != EROFS) && (errno != EACCES)) ||
+         (mount(props.deviceFile.c_str(), mountpoint.c_str(),
+                props.type.c_str(), flags | MS_RDONLY, NULL) != 0))) {
+        string err = strerror(errno);
+        rmdir(mountpoint.c_str());
+        DEVKITEXCEPTION("Can not mount " + props.deviceFile + ": " + err);
+    }
+    lock_guard<mutex> lock(mMutex);
+    mMountPoints.insert(mountpoint);
+    return mountpoint;
+}
+
+void cNetlinkBackend::UnMount (const string &path)
+{
+    stringList mountpaths = GetMountPaths(path);
+    stringList::iterator it;
+
+    for (it = mountpaths.begin(); it != mountpaths.end(); it++) {
+        if (umount2(it->c_str(), 0) != 0) {
+            DEVKITEXCEPTION("Can not unmount " + *it + ": " + strerror(errno));
+        }
+        unique_lock<mutex> lock(mMutex);
+        bool created = (mMountPoints.erase(*it) > 0);
+        lock.unlock();
+        if (created) {
+            rmdir(it->c_str());
+        }
+    }
+}
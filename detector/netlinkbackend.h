@@ -0,0 +1,74 @@
+/*
+ * netlinkbackend.h: Device backend reading kernel uevents from a netlink
+ *                   socket and the device properties from sysfs, for
+ *                   systems without udisks.
+ *
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * This code is distributed under the terms and conditions of the
+ * GNU GENERAL PUBLIC LICENSE. See the file COPYING for details.
+ */
+
+#ifndef NETLINKBACKEND_H_
+#define NETLINKBACKEND_H_
+
+#include <string>
+#include <map>
+#include <mutex>
+#include "devicebackend.h"
+
+// The path of a device is its directory in sysfs, e.g.
+// /sys/devices/pci0000:00/0000:00:1f.2/ata1/host0/target0:0:0/0:0:0:0/block/sr0
+class cNetlinkBackend : public cDeviceBackend {
+public:
+    cNetlinkBackend(cLogger *logger);
+    virtual ~cNetlinkBackend();
+
+    std::string FindDeviceByDeviceFile (const std::string device);
+    stringList EnumerateDevices (void);
+    // Mount the media below MOUNT_BASE and return mount path
+    std::string AutoMount(const std::string path);
+    void UnMount (const std::string &path);
+    std::string GetNativePath (const std::string &path);
+    std::string GetType (const std::string &path);
+    std::string GetDeviceFile (const std::string &path);
+    stringList GetDeviceFileById (const std::string &path);
+    stringList GetDeviceFileByPath (const std::string &path);
+    stringList GetMountPaths (const std::string &path);
+    bool IsMounted(const std::string &path);
+    bool IsOpticalDisk(const std::string &path);
+    bool IsPartition(const std::string &path);
+    bool IsMediaAvailable(const std::string &path);
+    void GetDeviceProperties(const std::string &path, DEVICE_PROPERTIES &props);
+
+protected:
+    bool Connect (void);
+    bool ReadSignal (int timeout, DEVICE_EVENT &event);
+
+private:
+    static const char *SYSFS_CLASS_BLOCK;
+    static const char *MOUNT_BASE;
+    static const int UEVENT_BUFFER_SIZE = 8192;
+    static const int PROBE_SIZE = 0x10048; // Up to the btrfs super block
+    // Time in ms between two attempts to open the socket
+    static const int RETRY_DELAY = 1000;
+
+    int mSocket;
+    // Time of the next attempt to open the socket
+    long long mNextAttempt;
+    // Protects mDevices and mMountPoints, the methods may be called
+    // from several threads
+    std::mutex mMutex;
+    // Last known properties, needed to describe a removed device
+    std::map<std::string, DEVICE_PROPERTIES> mDevices;
+    // Mount points created by AutoMount
+    stringSet mMountPoints;
+
+    void CheckDevice (const std::string &path);
+    std::string ReadSysfs (const std::string &path, const std::string &attr);
+    std::string ProbeFilesystem (const std::string &devicefile);
+    stringList FindLinks (const std::string &dir, const std::string &devicefile);
+    static bool IsVirtual (const std::string &path);
+};
+
+#endif /* NETLINKBACKEND_H_ */
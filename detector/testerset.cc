@@ -0,0 +1,194 @@
+/*
+ * testerset.cc: Media testers of one configuration, replaced as a whole
+ *               when the config file is reloaded.
+ *
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * This code is distributed under the terms and conditions of the
+ * GNU GENERAL PUBLIC LICENSE. See the file COPYING for details.
+ */
+
+#include <stdlib.h>
+#include <algorithm>
+#include <set>
+#include "testerset.h"
+#include "stringtools.h"
+
+using namespace std;
+
+cTesterSet::cTesterSet(cLogger *logger, const MediaTesterList &known)
+{
+    mLogger = logger;
+    mKnown = known;
+    mParallelTesters = false;
+    mAdaptiveOrder = false;
+    mNegativeTTL = DEFAULT_NEGATIVE_TTL;
+    mDispatch.assign(MEDIA_MASK_ALL + 1, DISPATCH());
+}
+
+cTesterSet::~cTesterSet()
+{
+    MediaTesterList::iterator it;
+    for (it = mTesters.begin(); it != mTesters.end(); it++) {
+        delete *it;
+    }
+}
+
+bool cTesterSet::Load(cConfigFileParser &config)
+{
+    Section::iterator iter;
+    string sectionname;
+
+    if (!config.GetFirstSection(iter, sectionname)) {
+        mLogger->logmsg(LOGLEVEL_ERROR, "Empty file");
+        return false;
+    }
+    do {
+        if (!AddOptions(config, sectionname)) {
+            if (!AddDetector(config, sectionname)) {
+                return false;
+            }
+        }
+    } while (config.GetNextSection(iter, sectionname));
+
+    BuildDispatch();
+    return true;
+}
+
+// Create a new instance for a tester, initialize this instance with the contens
+// of the config file and register this tester, for example
+// the file detector reads in the suffix list associated with a file detector
+// instance.
+bool cTesterSet::RegisterTester(const cMediaTester *tester,
+                                cConfigFileParser &config,
+                                const string sectionname)
+{
+    cMediaTester *t = tester->create(mLogger);
+    if (!t->loadConfig (config, sectionname)) {
+        mLogger->logmsg(LOGLEVEL_ERROR, "Error on parsing %s", sectionname.c_str());
+        delete t;
+        return false;
+    }
+    mTesters.push_back(t);
+    mTesterTypes[t] = const_cast<cMediaTester *>(tester);
+    return true;
+}
+
+/*
+ * Precompute the testers for each media mask, so that testers which can not
+ * match a media are never called and e.g. the file testers do not mount
+ * audio CDs.
+ */
+void cTesterSet::BuildDispatch(void)
+{
+    MediaTesterList::iterator it;
+    MediaTesterList::iterator kt;
+
+    for (MEDIA_MASK_T m = 0; m <= MEDIA_MASK_ALL; m++) {
+        DISPATCH &entry = mDispatch[m];
+        set<cMediaTester *> types;
+        for (it = mTesters.begin(); it != mTesters.end(); it++) {
+            if ((*it)->canMatch(m)) {
+                entry.testers.push_back(*it);
+                types.insert(mTesterTypes[*it]);
+            }
+        }
+        stable_sort(entry.testers.begin(), entry.testers.end(),
+                    [](const cMediaTester *a, const cMediaTester *b) {
+                        return a->GetPriority() > b->GetPriority();
+                    });
+        for (kt = mKnown.begin(); kt != mKnown.end(); kt++) {
+            if (types.find(*kt) != types.end()) {
+                entry.scanners.push_back(*kt);
+            }
+        }
+    }
+}
+
+// Search the corresponding tester for the given TYPE keyword in the
+// config file and register an instance of this detector.
+bool cTesterSet::AddDetector(cConfigFileParser &config, const string section)
+{
+    bool found = false;
+    mLogger->logmsg(LOGLEVEL_INFO, "Section %s", section.c_str());
+    string type;
+    if (!config.GetSingleValue(section, "TYPE", type)) {
+        mLogger->logmsg(LOGLEVEL_ERROR, "No type specified for section %s", section.c_str());
+        return false;
+    }
+
+    MediaTesterList::iterator it;
+    for (it = mKnown.begin(); it != mKnown.end(); it++) {
+        cMediaTester *te = *it;
+        if (te->typeMatches(type)) {
+            if (!RegisterTester(te, config, section)) {
+                return false;
+            }
+            found = true;
+        }
+    }
+
+    if (!found) {
+        mLogger->logmsg(LOGLEVEL_ERROR, "Invalid type %s", type.c_str());
+    }
+    return found;
+}
+
+// Read the options of the GLOBAL section, which control the testers. The
+// other global options are read by the detector.
+bool cTesterSet::AddOptions(cConfigFileParser &config, const string sectionname)
+{
+    string dev;
+
+    if (sectionname != "GLOBAL") {
+        return false;
+    }
+
+    if (config.HasKey(sectionname, "PARALLELTESTERS")) {
+        if (config.GetSingleValue(sectionname, "PARALLELTESTERS", dev)) {
+            dev = StringTools::ToUpper(dev);
+            if (dev == "YES") {
+                mParallelTesters = true;
+            }
+            else if (dev == "NO") {
+                mParallelTesters = false;
+            }
+            else {
+                mLogger->logmsg(LOGLEVEL_ERROR, "Invalid keyword %s for PARALLELTESTERS",
+                                dev.c_str());
+            }
+            mLogger->logmsg(LOGLEVEL_INFO, "Parallel testers %s",
+                            mParallelTesters ? "yes" : "no");
+        }
+    }
+    if (config.HasKey(sectionname, "ADAPTIVEORDER")) {
+        if (config.GetSingleValue(sectionname, "ADAPTIVEORDER", dev)) {
+            dev = StringTools::ToUpper(dev);
+            if (dev == "YES") {
+                mAdaptiveOrder = true;
+            }
+            else if (dev == "NO") {
+                mAdaptiveOrder = false;
+            }
+            else {
+                mLogger->logmsg(LOGLEVEL_ERROR, "Invalid keyword %s for ADAPTIVEORDER",
+                                dev.c_str());
+            }
+            mLogger->logmsg(LOGLEVEL_INFO, "Adaptive order %s",
+                            mAdaptiveOrder ? "yes" : "no");
+        }
+    }
+    if (config.HasKey(sectionname, "NEGATIVETTL")) {
+        if (config.GetSingleValue(sectionname, "NEGATIVETTL", dev)) {
+            int ttl = atoi(dev.c_str());
+            if (ttl < 0) {
+                mLogger->logmsg(LOGLEVEL_ERROR, "Invalid negative TTL %s", dev.c_str());
+            }
+            else {
+                mNegativeTTL = ttl;
+                mLogger->logmsg(LOGLEVEL_INFO, "Negative TTL %d s", ttl);
+            }
+        }
+    }
+    return true;
+}
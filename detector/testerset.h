@@ -0,0 +1,80 @@
+/*
+ * testerset.h: Media testers of one configuration, replaced as a whole
+ *              when the config file is reloaded.
+ *
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * This code is distributed under the terms and conditions of the
+ * GNU GENERAL PUBLIC LICENSE. See the file COPYING for details.
+ */
+
+#ifndef TESTERSET_H_
+#define TESTERSET_H_
+
+#include <list>
+#include <map>
+#include <vector>
+#include <string>
+#include "configfileparser.h"
+#include "mediatester.h"
+#include "logger.h"
+#include "stdtypes.h"
+
+// The set is not changed after Load, so detections in progress can use it
+// without locking while a new set is built from a changed config file.
+class cTesterSet {
+public:
+    typedef std::list<cMediaTester *> MediaTesterList;
+    typedef std::vector<cMediaTester *> MediaTesterVector;
+    // Testers which can match the media of one media mask
+    typedef struct {
+        // Registered testers in the order of their priority
+        MediaTesterVector testers;
+        // Known testers, whose scan hooks are called
+        MediaTesterVector scanners;
+    } DISPATCH;
+
+    static const int DEFAULT_NEGATIVE_TTL = 60;
+
+    // The known testers are owned by the caller and must live longer than
+    // the set, the registered testers are created from them.
+    cTesterSet(cLogger *logger, const MediaTesterList &known);
+    ~cTesterSet();
+    // Register the testers of all sections and read the tester options of
+    // the GLOBAL section. False if a section is invalid.
+    bool Load(cConfigFileParser &config);
+
+    const MediaTesterList &GetTesters(void) const { return mTesters; }
+    const DISPATCH &GetDispatch(MEDIA_MASK_T m) const {
+        return mDispatch[m & MEDIA_MASK_ALL];
+    }
+    bool GetParallelTesters(void) const { return mParallelTesters; }
+    bool GetAdaptiveOrder(void) const { return mAdaptiveOrder; }
+    int GetNegativeTTL(void) const { return mNegativeTTL; }
+
+private:
+    cLogger *mLogger;
+    MediaTesterList mKnown;
+    MediaTesterList mTesters;
+    // Known tester of each registered tester
+    std::map<cMediaTester *, cMediaTester *> mTesterTypes;
+    // Testers to run, indexed by the media mask
+    std::vector<DISPATCH> mDispatch;
+    // Run the independent testers of one media in parallel
+    bool mParallelTesters;
+    // Order the testers of one priority by their statistics
+    bool mAdaptiveOrder;
+    // Seconds a media without a matching tester is not detected again
+    int mNegativeTTL;
+
+    bool AddOptions(cConfigFileParser &config, const std::string sectionname);
+    bool AddDetector(cConfigFileParser &config, const std::string section);
+    bool RegisterTester(const cMediaTester *, cConfigFileParser &,
+                          const std::string);
+    void BuildDispatch(void);
+
+    cTesterSet(const cTesterSet &);
+    cTesterSet &operator=(const cTesterSet &);
+};
+
+#endif /* TESTERSET_H_ */
@@ -0,0 +1,619 @@
+/*
+ * tracebackend.cc: Recording of the device events and property replies of
+ *                  a device backend to a trace file and replay of such a
+ *                  trace without hardware.
+ *
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * This code is distributed under the terms and conditions of the
+ * GNU GENERAL PUBLIC LICENSE. See the file COPYING for details.
+ */
+
+#include <stdlib.h>
+#include <string>
+#include "tracebackend.h"
+
+using namespace std;
+
+static const char *TRACE_HEADER = "# autostart device trace 1";
+
+string cTraceFile::Escape (const string &str)
+{
+    string retval;
+    string::const_iterator it;
+    for (it = str.begin(); it != str.end(); it++) {
+        switch (*it) {
+        case '\\':
+            retval += "\\\\";
+            break;
+        case '\t':
+            retval += "\\t";
+            break;
+        case '\n':
+            retval += "\\n";
+            break;
+        default:
+            retval += *it;
+        }
+    }
+    return retval;
+}
+
+string cTraceFile::Unescape (const string &str)
+{
+    string retval;
+    for (string::size_type i = 0; i < str.length(); i++) {
+        if ((str[i] == '\\') && (i + 1 < str.length())) {
+            i++;
+            if (str[i] == 't') {
+                retval += '\t';
+            }
+            else if (str[i] == 'n') {
+                retval += '\n';
+            }
+            else {
+                retval += str[i];
+            }
+        }
+        else {
+            retval += str[i];
+        }
+    }
+    return retval;
+}
+
+cTraceFile::FIELDS cTraceFile::Split (const string &line)
+{
+    FIELDS fields;
+    string::size_type start = 0;
+    string::size_type pos;
+
+    while ((pos = line.find('\t', start)) != string::npos) {
+        fields.push_back(Unescape(line.substr(start, pos - start)));
+        start = pos + 1;
+    }
+    fields.push_back(Unescape(line.substr(start)));
+    return fields;
+}
+
+void cTraceFile::PutProperties (FIELDS &fields, const DEVICE_PROPERTIES &props)
+{
+    string flags;
+    flags += props.isOptical ? '1' : '0';
+    flags += props.isMounted ? '1' : '0';
+    flags += props.isPartition ? '1' : '0';
+    flags += props.isMediaAvailable ? '1' : '0';
+
+    fields.push_back(props.nativePath);
+    fields.push_back(props.deviceFile);
+    fields.push_back(props.type);
+    fields.push_back(flags);
+    fields.push_back(props.uuid);
+    fields.push_back(props.label);
+    fields.push_back(to_string(props.size));
+    fields.insert(fields.end(), props.mountPaths.begin(),
+                  props.mountPaths.end());
+}
+
+bool cTraceFile::GetProperties (const FIELDS &fields, size_t pos,
+                                   DEVICE_PROPERTIES &props)
+{
+    if ((fields.size() < pos + 7) || (fields[pos + 3].length() != 4)) {
+        return false;
+    }
+    props.nativePath = fields[pos];
+    props.deviceFile = fields[pos + 1];
+    props.type = fields[pos + 2];
+    props.isOptical = (fields[pos + 3][0] == '1');
+    props.isMounted = (fields[pos + 3][1] == '1');
+    props.isPartition = (fields[pos + 3][2] == '1');
+    props.isMediaAvailable = (fields[pos + 3][3] == '1');
+    props.uuid = fields[pos + 4];
+    props.label = fields[pos + 5];
+    props.size = strtoull(fields[pos + 6].c_str(), NULL, 10);
+    props.mountPaths.assign(fields.begin() + pos + 7, fields.end());
+    return true;
+}
+
+/*
+ * Recorder
+ */
+cRecordingBackend::cRecordingBackend(cLogger *logger, cDeviceBackend *backend,
+                                         const string &tracefile)
+                                         : cDeviceBackend(logger)
+{
+    mBackend = backend;
+    mStart = Now();
+    mTrace.open(tracefile.c_str(), ios::out | ios::trunc);
+    if (mTrace.is_open()) {
+        mTrace << TRACE_HEADER << endl;
+    }
+    else {
+        mLogger->logmsg(LOGLEVEL_ERROR, "Can not open trace file %s",
+                        tracefile.c_str());
+    }
+}
+
+cRecordingBackend::~cRecordingBackend()
+{
+    delete mBackend;
+}
+
+void cRecordingBackend::Record (const char *kind, const char *method,
+                                   const string &path,
+                                   const cTraceFile::FIELDS &values)
+{
+    cTraceFile::FIELDS::const_iterator it;
+
+    lock_guard<mutex> lock(mMutex);
+    if (!mTrace.is_open()) {
+        return;
+    }
+    mTrace << (Now() - mStart) << '\t' << kind << '\t' << method << '\t'
+           << cTraceFile::Escape(path);
+    for (it = values.begin(); it != values.end(); it++) {
+        mTrace << '\t' << cTraceFile::Escape(*it);
+    }
+    // Flush each record, the trace should survive a crash of VDR
+    mTrace << endl;
+}
+
+void cRecordingBackend::Record (const char *method, const string &path,
+                                   const string &value)
+{
+    cTraceFile::FIELDS values;
+    values.push_back(value);
+    Record("R", method, path, values);
+}
+
+void cRecordingBackend::Record (const char *method, const string &path,
+                                   const stringList &values)
+{
+    cTraceFile::FIELDS fields(values.begin(), values.end());
+    Record("R", method, path, fields);
+}
+
+void cRecordingBackend::Record (const char *method, const string &path,
+                                   bool value)
+{
+    Record(method, path, string(value ? "1" : "0"));
+}
+
+void cRecordingBackend::RecordError (const char *method, const string &path,
+                                        const cDeviceKitException &e)
+{
+    cTraceFile::FIELDS values;
+    values.push_back(e.what());
+    Record("X", method, path, values);
+}
+
+bool cRecordingBackend::WaitDevkit(int timeout, DEVICE_EVENT &event)
+{
+    static const char *signals = "ARCU";
+
+    if (!mBackend->WaitDevkit(timeout, event)) {
+        return false;
+    }
+    cTraceFile::FIELDS values;
+    cTraceFile::PutProperties(values, event.properties);
+    string signal(1, signals[event.signal]);
+    Record("E", signal.c_str(), event.path, values);
+    return true;
+}
+
+string cRecordingBackend::FindDeviceByDeviceFile (const string device)
+{
+    try {
+        string val = mBackend->FindDeviceByDeviceFile(device);
+        Record("FindDeviceByDeviceFile", device, val);
+        return val;
+    } catch (cDeviceKitException &e) {
+        RecordError("FindDeviceByDeviceFile", device, e);
+        throw;
+    }
+}
+
+stringList cRecordingBackend::EnumerateDevices (void)
+{
+    try {
+        stringList val = mBackend->EnumerateDevices();
+        Record("EnumerateDevices", "", val);
+        return val;
+    } catch (cDeviceKitException &e) {
+        RecordError("EnumerateDevices", "", e);
+        throw;
+    }
+}
+
+string cRecordingBackend::AutoMount (const string path)
+{
+    try {
+        string val = mBackend->AutoMount(path);
+        Record("AutoMount", path, val);
+        return val;
+    } catch (cDeviceKitException &e) {
+        RecordError("AutoMount", path, e);
+        throw;
+    }
+}
+
+void cRecordingBackend::UnMount (const string &path)
+{
+    try {
+        mBackend->UnMount(path);
+        Record("R", "UnMount", path, cTraceFile::FIELDS());
+    } catch (cDeviceKitException &e) {
+        RecordError("UnMount", path, e);
+        throw;
+    }
+}
+
+string cRecordingBackend::GetNativePath (const string &path)
+{
+    try {
+        string val = mBackend->GetNativePath(path);
+        Record("GetNativePath", path, val);
+        return val;
+    } catch (cDeviceKitException &e) {
+        RecordError("GetNativePath", path, e);
+        throw;
+    }
+}
+
+string cRecordingBackend::GetType (const string &path)
+{
+    try {
+        string val = mBackend->GetType(path);
+        Record("GetType", path, val);
+        return val;
+    } catch (cDeviceKitException &e) {
+        RecordError("GetType", path, e);
+        throw;
+    }
+}
+
+string cRecordingBackend::GetDeviceFile (const string &path)
+{
+    try {
+        string val = mBackend->GetDeviceFile(path);
+        Record("GetDeviceFile", path, val);
+        return val;
+    } catch (cDeviceKitException &e) {
+        RecordError("GetDeviceFile", path, e);
+        throw;
+    }
+}
+
+stringList cRecordingBackend::GetDeviceFileById (const string &path)
+{
+    try {
+        stringList val = mBackend->GetDeviceFileById(path);
+        Record("GetDeviceFileById", path, val);
+        return val;
+    } catch (cDeviceKitException &e) {
+        RecordError("GetDeviceFileById", path, e);
+        throw;
+    }
+}
+
+stringList cRecordingBackend::GetDeviceFileByPath (const string &path)
+{
+    try {
+        stringList val = mBackend->GetDeviceFileByPath(path);
+        Record("GetDeviceFileByPath", path, val);
+        return val;
+    } catch (cDeviceKitException &e) {
+        RecordError("GetDeviceFileByPath", path, e);
+        throw;
+    }
+}
+
+stringList cRecordingBackend::GetMountPaths (const string &path)
+{
+    try {
+        stringList val = mBackend->GetMountPaths(path);
+        Record("GetMountPaths", path, val);
+        return val;
+    } catch (cDeviceKitException &e) {
+        RecordError("GetMountPaths", path, e);
+        throw;
+    }
+}
+
+bool cRecordingBackend::IsMounted (const string &path)
+{
+    try {
+        bool val = mBackend->IsMounted(path);
+        Record("IsMounted", path, val);
+        return val;
+    } catch (cDeviceKitException &e) {
+        RecordError("IsMounted", path, e);
+        throw;
+    }
+}
+
+bool cRecordingBackend::IsOpticalDisk (const string &path)
+{
+    try {
+        bool val = mBackend->IsOpticalDisk(path);
+        Record("IsOpticalDisk", path, val);
+        return val;
+    } catch (cDeviceKitException &e) {
+        RecordError("IsOpticalDisk", path, e);
+        throw;
+    }
+}
+
+bool cRecordingBackend::IsPartition (const string &path)
+{
+    try {
+        bool val = mBackend->IsPartition(path);
+        Record("IsPartition", path, val);
+        return val;
+    } catch (cDeviceKitException &e) {
+        RecordError("IsPartition", path, e);
+        throw;
+    }
+}
+
+bool cRecordingBackend::IsMediaAvailable (const string &path)
+{
+    try {
+        bool val = mBackend->IsMediaAvailable(path);
+        Record("IsMediaAvailable", path, val);
+        return val;
+    } catch (cDeviceKitException &e) {
+        RecordError("IsMediaAvailable", path, e);
+        throw;
+    }
+}
+
+void cRecordingBackend::GetDeviceProperties (const string &path,
+                                                DEVICE_PROPERTIES &props)
+{
+    try {
+        mBackend->GetDeviceProperties(path, props);
+        cTraceFile::FIELDS values;
+        cTraceFile::PutProperties(values, props);
+        Record("R", "GetDeviceProperties", path, values);
+    } catch (cDeviceKitException &e) {
+        RecordError("GetDeviceProperties", path, e);
+        throw;
+    }
+}
+
+void cRecordingBackend::PrefetchProperties (const stringList &paths)
+{
+    mBackend->PrefetchProperties(paths);
+}
+
+/*
+ * Replay
+ */
+cReplayBackend::cReplayBackend(cLogger *logger, double speed)
+                                  : cDeviceBackend(logger)
+{
+    mSpeed = speed;
+    mStart = -1;
+    mFinished = false;
+}
+
+bool cReplayBackend::Load (const string &tracefile)
+{
+    ifstream file;
+    string line;
+    int lineno = 0;
+
+    file.open(tracefile.c_str());
+    if (!file.is_open()) {
+        mLogger->logmsg(LOGLEVEL_ERROR, "Can not open trace file %s",
+                        tracefile.c_str());
+        return false;
+    }
+    while (getline(file, line)) {
+        lineno++;
+        if (line.empty() || (line[0] == '#')) {
+            continue;
+        }
+        cTraceFile::FIELDS fields = cTraceFile::Split(line);
+        if ((fields.size() < 4) || (fields[1].length() != 1)) {
+            mLogger->logmsg(LOGLEVEL_ERROR, "Invalid trace record in line %d",
+                            lineno);
+            return false;
+        }
+        long long time = atoll(fields[0].c_str());
+        if (fields[1] == "E") {
+            TRACEEVENT ev;
+            ev.time = time;
+            ev.event.path = fields[3];
+            switch (fields[2][0]) {
+            case 'A':
+                ev.event.signal = DeviceAdded;
+                break;
+            case 'R':
+                ev.event.signal = DeviceRemoved;
+                break;
+            case 'C':
+                ev.event.signal = DeviceChanged;
+                break;
+            default:
+                ev.event.signal = Unkown;
+            }
+            if (!cTraceFile::GetProperties(fields, 4, ev.event.properties)) {
+                mLogger->logmsg(LOGLEVEL_ERROR, "Invalid event in line %d",
+                                lineno);
+                return false;
+            }
+            mEvents.push_back(ev);
+        }
+        else if ((fields[1] == "R") || (fields[1] == "X")) {
+            TRACEREPLY reply;
+            reply.error = (fields[1] == "X");
+            reply.values.assign(fields.begin() + 4, fields.end());
+            mReplies[fields[2] + '\t' + fields[3]].push_back(reply);
+        }
+        else {
+            mLogger->logmsg(LOGLEVEL_ERROR, "Invalid record type in line %d",
+                            lineno);
+            return false;
+        }
+    }
+    mLogger->logmsg(LOGLEVEL_INFO, "Loaded %d events from %s",
+                    (int)mEvents.size(), tracefile.c_str());
+    return true;
+}
+
+bool cReplayBackend::WaitDevkit(int timeout, DEVICE_EVENT &event)
+{
+    cEventLoop::FDEVENT events[cEventLoop::MAX_EVENTS];
+    bool woken;
+
+    if (mStart < 0) {
+        mStart = Now();
+    }
+    if (mEvents.empty()) {
+        mFinished = true;
+        return false;
+    }
+    if (mSpeed > 0) {
+        long long due = mStart + (long long)(mEvents.front().time / mSpeed);
+        long long wait = due - Now();
+        if (wait > 0) {
+            if ((timeout >= 0) && (timeout < wait)) {
+                mEventLoop.Wait(timeout, events, cEventLoop::MAX_EVENTS, woken);
+                return false;
+            }
+            mEventLoop.Wait(wait, events, cEventLoop::MAX_EVENTS, woken);
+            if (woken) {
+                return false;
+            }
+        }
+    }
+    event = mEvents.front().event;
+    mEvents.pop_front();
+    return true;
+}
+
+cTraceFile::FIELDS cReplayBackend::Reply (const char *method,
+                                            const string &path)
+{
+    map<string, ReplyQueue>::iterator it;
+    TRACEREPLY reply;
+
+    unique_lock<mutex> lock(mMutex);
+    it = mReplies.find(string(method) + '\t' + path);
+    if ((it == mReplies.end()) || it->second.empty()) {
+        DEVKITEXCEPTION(string("No reply in trace for ") + method + " " + path);
+    }
+    ReplyQueue &queue = it->second;
+    if (queue.size() > 1) {
+        // Keep the last reply for further calls
+        reply = queue.front();
+        queue.pop_front();
+    }
+    else {
+        reply = queue.front();
+    }
+    lock.unlock();
+    if (reply.error) {
+        throw cDeviceKitException(reply.values.empty() ? string("") :
+                                  reply.values.front());
+    }
+    return reply.values;
+}
+
+string cReplayBackend::ReplyS (const char *method, const string &path)
+{
+    cTraceFile::FIELDS values = Reply(method, path);
+    return values.empty() ? string("") : values.front();
+}
+
+bool cReplayBackend::ReplyB (const char *method, const string &path)
+{
+    return (ReplyS(method, path) == "1");
+}
+
+stringList cReplayBackend::ReplyAS (const char *method, const string &path)
+{
+    cTraceFile::FIELDS values = Reply(method, path);
+    return stringList(values.begin(), values.end());
+}
+
+string cReplayBackend::FindDeviceByDeviceFile (const string device)
+{
+    return ReplyS("FindDeviceByDeviceFile", device);
+}
+
+stringList cReplayBackend::EnumerateDevices (void)
+{
+    return ReplyAS("EnumerateDevices", "");
+}
+
+string cReplayBackend::AutoMount (const string path)
+{
+    return ReplyS("AutoMount", path);
+}
+
+void cReplayBackend::UnMount (const string &path)
+{
+    Reply("UnMount", path);
+}
+
+string cReplayBackend::GetNativePath (const string &path)
+{
+    return ReplyS("GetNativePath", path);
+}
+
+string cReplayBackend::GetType (const string &path)
+{
+    return ReplyS("GetType", path);
+}
+
+string cReplayBackend::GetDeviceFile (const string &path)
+{
+    return ReplyS("GetDeviceFile", path);
+}
+
+stringList cReplayBackend::GetDeviceFileById (const string &path)
+{
+    return ReplyAS("GetDeviceFileById", path);
+}
+
+stringList cReplayBackend::GetDeviceFileByPath (const string &path)
+{
+    return ReplyAS("GetDeviceFileByPath", path);
+}
+
+stringList cReplayBackend::GetMountPaths (const string &path)
+{
+    return ReplyAS("GetMountPaths", path);
+}
+
+bool cReplayBackend::IsMounted (const string &path)
+{
+    return ReplyB("IsMounted", path);
+}
+
+bool cReplayBackend::IsOpticalDisk (const string &path)
+{
+    return ReplyB("IsOpticalDisk", path);
+}
+
+bool cReplayBackend::IsPartition (const string &path)
+{
+    return ReplyB("IsPartition", path);
+}
+
+bool cReplayBackend::IsMediaAvailable (const string &path)
+{
+    return ReplyB("IsMediaAvailable", path);
+}
+
+void cReplayBackend::GetDeviceProperties (const string &path,
+                                             DEVICE_PROPERTIES &props)
+{
+    cTraceFile::FIELDS values = Reply("GetDeviceProperties", path);
+    if (!cTraceFile::GetProperties(values, 0, props)) {
+        DEVKITEXCEPTION("Invalid properties in trace for " + path);
+    }
+}
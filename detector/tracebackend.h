@@ -0,0 +1,160 @@
+/*
+ * tracebackend.h: Recording of the device events and property replies of a
+ *                 device backend to a trace file and replay of such a
+ *                 trace without hardware.
+ *
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * This code is distributed under the terms and conditions of the
+ * GNU GENERAL PUBLIC LICENSE. See the file COPYING for details.
+ */
+
+#ifndef TRACEBACKEND_H_
+#define TRACEBACKEND_H_
+
+#include <string>
+#include <fstream>
+#include <vector>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <atomic>
+#include "devicebackend.h"
+
+/*
+ * The trace file contains one record per line with tab separated fields:
+ *   <ms> E <signal> <path> <properties>      device event
+ *   <ms> R <method> <path> <value>...        reply of a method
+ *   <ms> X <method> <path> <message>         method failed
+ * ms is the time since the start of the recording. Properties are stored
+ * as native path, device file, type, flags (optical, mounted, partition,
+ * media available), file system UUID, label, size and mount paths.
+ */
+class cTraceFile {
+public:
+    typedef std::vector<std::string> FIELDS;
+
+    static std::string Escape (const std::string &str);
+    static std::string Unescape (const std::string &str);
+    static FIELDS Split (const std::string &line);
+    static void PutProperties (FIELDS &fields, const DEVICE_PROPERTIES &props);
+    // Decode properties starting at fields[pos]
+    static bool GetProperties (const FIELDS &fields, size_t pos,
+                                 DEVICE_PROPERTIES &props);
+};
+
+// Records everything delivered by another backend, which is owned by the
+// recorder.
+class cRecordingBackend : public cDeviceBackend {
+public:
+    cRecordingBackend(cLogger *logger, cDeviceBackend *backend,
+                        const std::string &tracefile);
+    virtual ~cRecordingBackend();
+    bool IsOpen(void) { return mTrace.is_open(); }
+
+    bool WaitDevkit(int timeout, DEVICE_EVENT &event);
+    void SetEventWindow(int window) { mBackend->SetEventWindow(window); }
+    void SetCallTimeout(int timeout) { mBackend->SetCallTimeout(timeout); }
+    void Wakeup(void) { mBackend->Wakeup(); }
+
+    std::string FindDeviceByDeviceFile (const std::string device);
+    stringList EnumerateDevices (void);
+    std::string AutoMount(const std::string path);
+    void UnMount (const std::string &path);
+    std::string GetNativePath (const std::string &path);
+    std::string GetType (const std::string &path);
+    std::string GetDeviceFile (const std::string &path);
+    stringList GetDeviceFileById (const std::string &path);
+    stringList GetDeviceFileByPath (const std::string &path);
+    stringList GetMountPaths (const std::string &path);
+    bool IsMounted(const std::string &path);
+    bool IsOpticalDisk(const std::string &path);
+    bool IsPartition(const std::string &path);
+    bool IsMediaAvailable(const std::string &path);
+    void GetDeviceProperties(const std::string &path, DEVICE_PROPERTIES &props);
+    void PrefetchProperties(const stringList &paths);
+
+protected:
+    // Events are read by the recorded backend
+    bool Connect (void) { return true; }
+    bool ReadSignal (int timeout, DEVICE_EVENT &event) { return false; }
+
+private:
+    cDeviceBackend *mBackend;
+    // The methods may be called from several threads, mMutex keeps the
+    // records apart
+    std::mutex mMutex;
+    std::ofstream mTrace;
+    long long mStart;
+
+    void Record (const char *kind, const char *method,
+                   const std::string &path, const cTraceFile::FIELDS &values);
+    void Record (const char *method, const std::string &path,
+                   const std::string &value);
+    void Record (const char *method, const std::string &path,
+                   const stringList &values);
+    void Record (const char *method, const std::string &path, bool value);
+    void RecordError (const char *method, const std::string &path,
+                        const cDeviceKitException &e);
+};
+
+// Feeds the detector from a recorded trace. The events are delivered with
+// the recorded timing divided by speed, a speed of 0 delivers them without
+// delay.
+class cReplayBackend : public cDeviceBackend {
+public:
+    cReplayBackend(cLogger *logger, double speed = 1.0);
+    bool Load(const std::string &tracefile);
+    bool Finished(void) { return mFinished; }
+
+    bool WaitDevkit(int timeout, DEVICE_EVENT &event);
+    void SetEventWindow(int window) {};
+
+    std::string FindDeviceByDeviceFile (const std::string device);
+    stringList EnumerateDevices (void);
+    std::string AutoMount(const std::string path);
+    void UnMount (const std::string &path);
+    std::string GetNativePath (const std::string &path);
+    std::string GetType (const std::string &path);
+    std::string GetDeviceFile (const std::string &path);
+    stringList GetDeviceFileById (const std::string &path);
+    stringList GetDeviceFileByPath (const std::string &path);
+    stringList GetMountPaths (const std::string &path);
+    bool IsMounted(const std::string &path);
+    bool IsOpticalDisk(const std::string &path);
+    bool IsPartition(const std::string &path);
+    bool IsMediaAvailable(const std::string &path);
+    void GetDeviceProperties(const std::string &path, DEVICE_PROPERTIES &props);
+
+protected:
+    bool Connect (void) { return true; }
+    bool ReadSignal (int timeout, DEVICE_EVENT &event) { return false; }
+
+private:
+    typedef struct {
+        long long time;
+        DEVICE_EVENT event;
+    } TRACEEVENT;
+    typedef struct {
+        bool error;
+        cTraceFile::FIELDS values;
+    } TRACEREPLY;
+    typedef std::deque<TRACEREPLY> ReplyQueue;
+
+    double mSpeed;
+    long long mStart;
+    std::atomic<bool> mFinished;
+    std::deque<TRACEEVENT> mEvents;
+    // Protects mReplies, the methods may be called from several threads
+    std::mutex mMutex;
+    // Replies per method and path in recorded order, the last reply is
+    // repeated for further calls.
+    std::map<std::string, ReplyQueue> mReplies;
+
+    cTraceFile::FIELDS Reply (const char *method, const std::string &path);
+    std::string ReplyS (const char *method, const std::string &path);
+    bool ReplyB (const char *method, const std::string &path);
+    stringList ReplyAS (const char *method, const std::string &path);
+};
+
+#endif /* TRACEBACKEND_H_ */
@@ -8,26 +8,32 @@
  * GNU GENERAL PUBLIC LICENSE. See the file COPYING for details.
  */
 #include "videodvdtester.h"
+#include <stdio.h>
 #include <dvdread/dvd_reader.h>
 
-bool cVideoDVDTester::isMedia (cMediaHandle d, stringList &keylist)
+bool cVideoDVDTester::isMedia (const cMediaHandle &d, stringList &keylist)
+{
+    std::string identity;
+    return probeMedia(d, keylist, identity);
+}
+
+// The disc ID is read from the opened DVD, so it needs no further open
+bool cVideoDVDTester::probeMedia (const cMediaHandle &d, stringList &keylist,
+                                     std::string &identity)
 {
     dvd_reader_t *reader;
     dvd_file_t *file;
+    unsigned char discid[16];
+    char buf[4];
     bool success = true;
     MEDIA_MASK_T m = d.GetMediaMask();
 
-    if (!(m & MEDIA_OPTICAL)) {
+    identity.clear();
+    if (!canMatch(m)) {
         return (false);
     }
-    if (!(m & MEDIA_AVAILABLE))
-    {
-        return (false);
-    }
-    if (!((m & MEDIA_FS_ISO9660) ||
-          (m & MEDIA_FS_UDF) ||
-          (m & MEDIA_FS_UNKNOWN)))
-    {
+    // The device may have been removed while the probe was waiting
+    if (d.IsCancelled()) {
         return (false);
     }
     reader = DVDOpen (d.GetDeviceFile().c_str());
@@ -40,10 +46,16 @@ bool cVideoDVDTester::isMedia (cMediaHandle d, stringList &keylist)
         mLogger->logmsg(LOGLEVEL_INFO, "not a dvd");
         success = false;
     }
+    else if (DVDDiscID(reader, discid) == 0) {
+        identity = "DVD:";
+        for (size_t i = 0; i < sizeof(discid); i++) {
+            snprintf(buf, sizeof(buf), "%02x", discid[i]);
+            identity += buf;
+        }
+    }
     DVDClose (reader);
     if (success) {
         keylist = mKeylist;
     }
     return (success);
 }
-
@@ -18,7 +18,17 @@ class cVideoDVDTester : public cMediaTester
 public:
     cVideoDVDTester(cLogger *l, std::string descr, std::string ext) :
             cMediaTester (l, descr, ext) {};
-    bool isMedia(cMediaHandle d, stringList &keylist);
+    bool isMedia(const cMediaHandle &d, stringList &keylist);
+    // Disc ID of libdvdread, a hash of the IFO files
+    bool probeMedia (const cMediaHandle &d, stringList &keylist,
+                       std::string &identity);
+    bool isIndependent (void) const { return true; }
+    MEDIA_MASK_T requiredMask (void) const {
+        return MEDIA_OPTICAL | MEDIA_AVAILABLE;
+    }
+    MEDIA_MASK_T anyMask (void) const {
+        return MEDIA_FS_ISO9660 | MEDIA_FS_UDF | MEDIA_FS_UNKNOWN;
+    }
     cMediaTester *create(cLogger *l) const {
         return new cVideoDVDTester(l, mDescription, mExt);
     }